@@ -18,6 +18,8 @@ CPC_TSTOBJS := $(patsubst $(CPC_TSTDIR)/%,$(CPC_TSTBUILD)/%,$(CPC_TSTSOURCES:.cp
 
 CPC_INCLIST := $(COM_INCLIST) $(patsubst $(CPC_SRCDIR)/%,-I $(CPC_SRCDIR)/%,$(CPC_INCDIR))
 CPC_INCLIST := $(COM_INCLIST) -I $(CPC_INCDIR)
+# the CPC to HLL conversion is tested against HLL
+CPC_TSTINCLIST := $(CPC_INCLIST) -I hll/include
 CPC_BUILDLIST := $(patsubst src/%,$(CPC_BUILDDIR)/%,$(CPC_INCDIR))
 
 cpc: $(CPC_OBJECTS)
@@ -35,7 +37,7 @@ $(CPC_BUILDDIR)/%.o: $(CPC_SRCDIR)/%.c
 $(CPC_TSTBUILD)/%.o: $(CPC_TSTDIR)/%.cpp
 	@mkdir -p $(CPC_TSTBUILD)
 	@echo "Compiling $<...";
-	@$(CC) $(CPPFLAGS) $(INC) $(CPC_INCLIST) -c -o $@ $<
+	@$(CC) $(CPPFLAGS) $(INC) $(CPC_TSTINCLIST) -c -o $@ $<
 
 .PHONY: cpc_test cpc_clean
 cpc_exec: $(COM_TSTOBJS) $(CPC_OBJECTS) $(CPC_TSTOBJS)
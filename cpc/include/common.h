@@ -28,6 +28,25 @@ typedef int64_t Long;  // signed
 #define ALL64BITS 0xffffffffffffffffULL
 #define ALL32BITS 0xffffffffULL
 
+// Every object that owns memory (sketch, table, unioning gadget) carries one of these,
+// so that different objects can use different memory resources.
+// The context is passed back to both functions (for instance, a pointer to an arena).
+
+typedef struct fm85_allocator_type
+{
+  void * (*alloc) (size_t numBytes, void * context);
+  void (*dealloc) (void * ptr, void * context);
+  void * context;
+} fm85Allocator;
+
+static inline void * fm85allocWith (const fm85Allocator * allocator, size_t numBytes) {
+  return allocator->alloc (numBytes, allocator->context);
+}
+
+static inline void fm85freeWith (const fm85Allocator * allocator, void * ptr) {
+  allocator->dealloc (ptr, allocator->context);
+}
+
 // Do not use either of these with a shift of 0 or 64.
 #define ROTATE_RIGHT_MACRO(val,shift) (((val) >> (shift)) | ((val) << (64 - (shift))))
 #define ROTATE_LEFT_MACRO(val,shift)  (((val) << (shift)) | ((val) >> (64 - (shift))))
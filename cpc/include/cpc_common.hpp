@@ -15,6 +15,7 @@ static const uint8_t CPC_MIN_LG_K = 4;
 static const uint8_t CPC_MAX_LG_K = 26;
 static const uint8_t CPC_DEFAULT_LG_K = 11;
 static const uint64_t DEFAULT_SEED = 9001;
+static const unsigned CPC_MAX_NUM_THREADS = 256;
 
 static uint16_t compute_seed_hash(uint64_t seed) {
   HashState hashes;
@@ -22,6 +23,17 @@ static uint16_t compute_seed_hash(uint64_t seed) {
   return hashes.h1 & 0xffff;
 }
 
+// source of memory for a particular sketch or union (for instance, a per-request arena)
+// all memory owned by the object, including its internal tables and buffers, comes from here
+// the resource must outlive the objects using it
+// a null resource means the global allocator set by cpc_init() (malloc and free by default)
+class cpc_memory_resource {
+  public:
+    virtual ~cpc_memory_resource() {}
+    virtual void* allocate(size_t bytes) = 0;
+    virtual void deallocate(void* ptr) = 0;
+};
+
 } /* namespace datasketches */
 
 #endif
@@ -0,0 +1,77 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#ifndef CPC_HLL_CONVERSION_HPP_
+#define CPC_HLL_CONVERSION_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "cpc_sketch.hpp"
+#include "hll.hpp"
+#include "HllSketch.hpp"
+#include "HllUtil.hpp"
+#include "Conversions.hpp"
+
+namespace datasketches {
+
+/*
+ * Converts a CPC sketch into an HLL sketch without going back to the input data.
+ *
+ * Both sketches take the row (slot) from the low bits of the first hash and the column
+ * (register value minus one) from the leading zeros of the second hash, so the HLL registers
+ * are the highest columns set in each row of the CPC bit matrix. The result has the same registers
+ * as an HLL sketch built from the same data, and can be merged with such sketches in an HllUnion.
+ * This requires the CPC sketch to use the default seed, since HLL always uses it.
+ *
+ * The HLL sketch is always in the HLL (array) mode, and its estimates come from the composite
+ * estimator, since the HIP accumulator cannot be recovered.
+ */
+
+class cpc_hll_conversion {
+  public:
+    // lg_config_k must not exceed lg_k of the CPC sketch, the rows are folded if it is smaller
+    static hll_sketch to_hll(const cpc_sketch& sketch, int lg_config_k, TgtHllType tgt_type = HLL_4) {
+      if (sketch.seed != HllUtil::DEFAULT_UPDATE_SEED) {
+        throw std::invalid_argument("CPC sketch must use the default seed to be converted to HLL");
+      }
+      const int lg_k = sketch.state->lgK;
+      if (lg_config_k > lg_k) {
+        throw std::invalid_argument("lg_config_k must not exceed lg_k of the CPC sketch: "
+            + std::to_string(lg_config_k) + " > " + std::to_string(lg_k));
+      }
+      HllUtil::checkLgK(lg_config_k);
+      if (sketch.is_empty()) return HllSketch::newInstance(lg_config_k, tgt_type);
+
+      const long long k = 1LL << lg_k;
+      const long long mask = (1LL << lg_config_k) - 1;
+      std::vector<uint8_t> registers(1 << lg_config_k, 0);
+      U64* bit_matrix = bitMatrixOfSketch(sketch.state);
+      for (long long row = 0; row < k; row++) {
+        const U64 pattern = bit_matrix[row];
+        if (pattern == 0) continue;
+        const int col = 63 - countLeadingZerosInUnsignedLong(pattern); // the highest column
+        const uint8_t value = std::min(col, 62) + 1; // as in HllUtil::coupon()
+        uint8_t& reg = registers[row & mask];
+        if (value > reg) reg = value;
+      }
+      fm85freeWith(&sketch.allocator, bit_matrix);
+
+      HllArray* hll_array = Conversions::convertFromRegisters(lg_config_k, tgt_type, registers.data());
+      return std::unique_ptr<HllSketchPvt>(new HllSketchPvt(hll_array));
+    }
+
+    // uses the lg_k of the CPC sketch, or the largest lg_config_k that HLL supports
+    static hll_sketch to_hll(const cpc_sketch& sketch, TgtHllType tgt_type = HLL_4) {
+      const int max_lg_config_k = HllUtil::MAX_LOG_K;
+      const int lg_config_k = std::min(static_cast<int>(sketch.state->lgK), max_lg_config_k);
+      return to_hll(sketch, lg_config_k, tgt_type);
+    }
+};
+
+} /* namespace datasketches */
+
+#endif
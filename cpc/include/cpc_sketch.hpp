@@ -11,6 +11,7 @@
 #include <functional>
 #include <stdexcept>
 #include <cmath>
+#include <cstdint>
 
 #include "fm85.h"
 #include "fm85Compression.h"
@@ -34,33 +35,52 @@ typedef std::unique_ptr<void, std::function<void(void*)>> ptr_with_deleter;
 class cpc_sketch;
 typedef std::unique_ptr<cpc_sketch, void(*)(cpc_sketch*)> cpc_sketch_unique_ptr;
 
-// allocation and initialization of global compression tables
-// call this before anything else if you want to control the initialization time
-// or you want to use a custom memory allocation and deallocation mechanism
-// otherwise initialization happens during instantiation of the first cpc_sketch or cpc_union
-// it is safe to call more than once assuming no race conditions
-// this is not thread safe! neither is the rest of the library
+// the compression and decoding tables are constant static data,
+// so no initialization is required, and sketches can be created from any thread
+// call this only if you want to use a custom memory allocation and deallocation mechanism
+// in that case call it before creating any sketches or unions since it is not synchronized
 void cpc_init(void* (*alloc)(size_t) = &malloc, void (*dealloc)(void*) = &free);
 
-// optional deallocation of globally allocated compression tables
+// no longer needed since there are no globally allocated tables, kept for compatibility
 void cpc_cleanup();
 
+static void* cpc_resource_alloc(size_t size, void* resource) {
+  return static_cast<cpc_memory_resource*>(resource)->allocate(size);
+}
+
+static void cpc_resource_dealloc(void* ptr, void* resource) {
+  static_cast<cpc_memory_resource*>(resource)->deallocate(ptr);
+}
+
+static fm85Allocator make_fm85_allocator(cpc_memory_resource* resource) {
+  if (resource == nullptr) return fm85DefaultAllocator;
+  fm85Allocator allocator = { &cpc_resource_alloc, &cpc_resource_dealloc, resource };
+  return allocator;
+}
+
 class cpc_sketch {
   public:
 
-    explicit cpc_sketch(uint8_t lg_k = CPC_DEFAULT_LG_K, uint64_t seed = DEFAULT_SEED) : seed(seed) {
-      fm85Init();
+    explicit cpc_sketch(uint8_t lg_k = CPC_DEFAULT_LG_K, uint64_t seed = DEFAULT_SEED, cpc_memory_resource* resource = nullptr) :
+    seed(seed), allocator(make_fm85_allocator(resource)) {
       if (lg_k < CPC_MIN_LG_K or lg_k > CPC_MAX_LG_K) {
         throw std::invalid_argument("lg_k must be >= " + std::to_string(CPC_MIN_LG_K) + " and <= " + std::to_string(CPC_MAX_LG_K) + ": " + std::to_string(lg_k));
       }
-      state = fm85Make(lg_k);
+      state = fm85Make(lg_k, &allocator);
     }
 
-    cpc_sketch(const cpc_sketch& other) : state(fm85Copy(other.state)), seed(other.seed) {}
+    // the copy uses the same memory resource as the original
+    cpc_sketch(const cpc_sketch& other) : state(fm85Copy(other.state, &other.allocator)), seed(other.seed), allocator(other.allocator) {}
+
+    // the moved-from sketch can only be destroyed or assigned to
+    cpc_sketch(cpc_sketch&& other) noexcept : state(other.state), seed(other.seed), allocator(other.allocator) {
+      other.state = nullptr;
+    }
 
     cpc_sketch& operator=(cpc_sketch other) {
       seed = other.seed;
       std::swap(state, other.state); // @suppress("Invalid arguments")
+      std::swap(allocator, other.allocator); // @suppress("Invalid arguments")
       return *this;
     }
 
@@ -230,9 +250,10 @@ class cpc_sketch {
       FM85* compressed = fm85Compress(state);
       const uint8_t preamble_ints(get_preamble_ints(compressed));
       const size_t size = header_size_bytes + (preamble_ints + compressed->csvLength + compressed->cwLength) * sizeof(uint32_t);
+      const fm85Allocator alloc(allocator);
       ptr_with_deleter data_ptr(
-          fm85alloc(size),
-          [](void* ptr) { fm85free(ptr); }
+          fm85allocWith(&alloc, size),
+          [alloc](void* ptr) { fm85freeWith(&alloc, ptr); }
       );
       char* ptr = static_cast<char*>(data_ptr.get()) + header_size_bytes;
       ptr += copy_to_mem(ptr, &preamble_ints, sizeof(preamble_ints));
@@ -290,8 +311,8 @@ class cpc_sketch {
     }
 
     static cpc_sketch_unique_ptr
-    deserialize(std::istream& is, uint64_t seed = DEFAULT_SEED) {
-      fm85Init();
+    deserialize(std::istream& is, uint64_t seed = DEFAULT_SEED, cpc_memory_resource* resource = nullptr) {
+      const fm85Allocator allocator(make_fm85_allocator(resource));
       uint8_t preamble_ints;
       is.read((char*)&preamble_ints, sizeof(preamble_ints));
       uint8_t serial_version;
@@ -325,6 +346,7 @@ class cpc_sketch {
       compressed.compressedWindow = nullptr;
       compressed.surprisingValueTable = nullptr;
       compressed.slidingWindow = nullptr;
+      compressed.allocator = allocator;
       if (has_table || has_window) {
         uint32_t num_coupons;
         is.read((char*)&num_coupons, sizeof(num_coupons));
@@ -346,48 +368,106 @@ class cpc_sketch {
           compressed.cwLength = cw_length;
         }
         if (has_hip && !(has_table && has_window)) read_hip(&compressed, is);
+      }
+      // checked before the arrays are allocated
+      check_preamble(preamble_ints, get_preamble_ints(compressed.numCoupons, has_hip, has_table, has_window),
+          serial_version, family_id, seed_hash, seed);
+      if (has_table || has_window) {
         if (has_window) {
-          compressed.compressedWindow = new uint32_t[compressed.cwLength];
-          is.read((char*)compressed.compressedWindow, compressed.cwLength * sizeof(uint32_t));
+          compressed.compressedWindow = read_array(is, compressed.cwLength, allocator);
         }
         if (has_table) {
-          compressed.compressedSurprisingValues = new uint32_t[compressed.csvLength];
-          is.read((char*)compressed.compressedSurprisingValues, compressed.csvLength * sizeof(uint32_t));
+          try {
+            compressed.compressedSurprisingValues = read_array(is, compressed.csvLength, allocator);
+          } catch (...) {
+            free_compressed_arrays(&compressed);
+            throw;
+          }
         }
         if (!has_window) compressed.numCompressedSurprisingValues = compressed.numCoupons;
       }
       compressed.windowOffset = determineCorrectOffset(compressed.lgK, compressed.numCoupons);
-
-      uint8_t expected_preamble_ints(get_preamble_ints(&compressed));
-      if (preamble_ints != expected_preamble_ints) {
-        throw std::invalid_argument("Possible corruption: preamble ints: expected "
-            + std::to_string(expected_preamble_ints) + ", got " + std::to_string(preamble_ints));
-      }
-      if (serial_version != SERIAL_VERSION) {
-        throw std::invalid_argument("Possible corruption: serial version: expected "
-            + std::to_string(SERIAL_VERSION) + ", got " + std::to_string(serial_version));
+      FM85* uncompressed;
+      try {
+        uncompressed = fm85Uncompress(&compressed);
+      } catch (...) {
+        free_compressed_arrays(&compressed);
+        throw;
       }
-      if (family_id != FAMILY) {
-        throw std::invalid_argument("Possible corruption: family: expected "
-            + std::to_string(FAMILY) + ", got " + std::to_string(family_id));
+      free_compressed_arrays(&compressed);
+      return make_unique_ptr(uncompressed, seed);
+    }
+
+    static cpc_sketch_unique_ptr
+    deserialize(const void* bytes, size_t size, uint64_t seed = DEFAULT_SEED, cpc_memory_resource* resource = nullptr) {
+      const fm85Allocator allocator(make_fm85_allocator(resource));
+      FM85 compressed;
+      const bool arrays_copied = compressed_from_mem(bytes, size, seed, allocator, &compressed);
+      FM85* uncompressed;
+      try {
+        uncompressed = fm85Uncompress(&compressed);
+      } catch (...) {
+        if (arrays_copied) free_compressed_arrays(&compressed);
+        throw;
       }
-      if (seed_hash != compute_seed_hash(seed)) {
-        throw std::invalid_argument("Incompatible seed hashes: " + std::to_string(seed_hash) + ", "
-            + std::to_string(compute_seed_hash(seed)));
+      if (arrays_copied) free_compressed_arrays(&compressed);
+      return make_unique_ptr(uncompressed, seed);
+    }
+
+    // for debugging
+    uint64_t get_num_coupons() const {
+      return state->numCoupons;
+    }
+
+    // for debugging
+    // this should catch some forms of corruption during serialization-deserialization
+    bool validate() const {
+      U64* bit_matrix = bitMatrixOfSketch(state);
+      const long long num_bits_set = countBitsSetInMatrix(bit_matrix, 1LL << state->lgK);
+      fm85freeWith(&allocator, bit_matrix);
+      return num_bits_set == state->numCoupons;
+    }
+
+    friend std::ostream& operator<<(std::ostream& os, cpc_sketch const& sketch);
+
+    friend class cpc_union;
+    friend class cpc_hll_conversion;
+
+  private:
+    static const uint8_t SERIAL_VERSION = 1;
+    static const uint8_t FAMILY = 16;
+
+    enum flags { IS_BIG_ENDIAN, IS_COMPRESSED, HAS_HIP, HAS_TABLE, HAS_WINDOW };
+
+    FM85* state;
+    uint64_t seed;
+    fm85Allocator allocator;
+
+    // for deserialization and cpc_union::get_result()
+    cpc_sketch(FM85* state, uint64_t seed = DEFAULT_SEED) : state(state), seed(seed), allocator(state->allocator) {}
+
+    // for deserialization and cpc_union::get_result()
+    // the sketch object itself is placed in memory from the allocator of its state
+    static cpc_sketch_unique_ptr make_unique_ptr(FM85* state, uint64_t seed) {
+      void* mem = fm85allocWith(&state->allocator, sizeof(cpc_sketch));
+      if (mem == nullptr) {
+        fm85Free(state);
+        throw std::bad_alloc();
       }
-      FM85* uncompressed = fm85Uncompress(&compressed);
-      delete [] compressed.compressedSurprisingValues;
-      delete [] compressed.compressedWindow;
-      cpc_sketch_unique_ptr sketch_ptr(
-          new (fm85alloc(sizeof(cpc_sketch))) cpc_sketch(uncompressed, seed),
-          [](cpc_sketch* s) { s->~cpc_sketch(); fm85free(s); }
-      );
-      return sketch_ptr;
+      return cpc_sketch_unique_ptr(new (mem) cpc_sketch(state, seed), &destroy);
     }
 
-    static cpc_sketch_unique_ptr
-    deserialize(const void* bytes, size_t size, uint64_t seed = DEFAULT_SEED) {
-      fm85Init();
+    static void destroy(cpc_sketch* sketch) {
+      const fm85Allocator allocator(sketch->allocator);
+      sketch->~cpc_sketch();
+      fm85freeWith(&allocator, sketch);
+    }
+
+    // parses a serialized image into a compressed state (which can be uncompressed or merged into a union)
+    // the compressed arrays point into the image if it is suitably aligned, otherwise they are copied
+    // returns true if the arrays were copied and must be freed with free_compressed_arrays()
+    static bool compressed_from_mem(const void* bytes, size_t size, uint64_t seed, const fm85Allocator& allocator, FM85* state) {
+      FM85& compressed = *state;
       const char* ptr = static_cast<const char*>(bytes);
       uint8_t preamble_ints;
       ptr += copy_from_mem(ptr, &preamble_ints, sizeof(preamble_ints));
@@ -406,7 +486,6 @@ class cpc_sketch {
       const bool has_hip(flags_byte & (1 << flags::HAS_HIP));
       const bool has_table(flags_byte & (1 << flags::HAS_TABLE));
       const bool has_window(flags_byte & (1 << flags::HAS_WINDOW));
-      FM85 compressed;
       compressed.isCompressed = 1;
       compressed.mergeFlag = has_hip ? 0 : 1;
       compressed.lgK = lg_k;
@@ -422,6 +501,7 @@ class cpc_sketch {
       compressed.compressedWindow = nullptr;
       compressed.surprisingValueTable = nullptr;
       compressed.slidingWindow = nullptr;
+      compressed.allocator = allocator;
       if (has_table || has_window) {
         uint32_t num_coupons;
         ptr += copy_from_mem(ptr, &num_coupons, sizeof(num_coupons));
@@ -443,97 +523,103 @@ class cpc_sketch {
           compressed.cwLength = cw_length;
         }
         if (has_hip && !(has_table && has_window)) ptr += copy_hip_from_mem(&compressed, ptr);
+        // the decoders only read these arrays
         if (has_window) {
-          compressed.compressedWindow = new uint32_t[compressed.cwLength];
-          ptr += copy_from_mem(ptr, compressed.compressedWindow, compressed.cwLength * sizeof(uint32_t));
+          compressed.compressedWindow = reinterpret_cast<uint32_t*>(const_cast<char*>(ptr));
+          ptr += compressed.cwLength * sizeof(uint32_t);
         }
         if (has_table) {
-          compressed.compressedSurprisingValues = new uint32_t[compressed.csvLength];
-          ptr += copy_from_mem(ptr, compressed.compressedSurprisingValues, compressed.csvLength * sizeof(uint32_t));
+          compressed.compressedSurprisingValues = reinterpret_cast<uint32_t*>(const_cast<char*>(ptr));
+          ptr += compressed.csvLength * sizeof(uint32_t);
         }
         if (!has_window) compressed.numCompressedSurprisingValues = compressed.numCoupons;
       }
       if (ptr != static_cast<const char*>(bytes) + size) throw std::logic_error("deserialized size mismatch");
       compressed.windowOffset = determineCorrectOffset(compressed.lgK, compressed.numCoupons);
 
-      uint8_t expected_preamble_ints(get_preamble_ints(&compressed));
-      if (preamble_ints != expected_preamble_ints) {
-        throw std::invalid_argument("Possible corruption: preamble ints: expected "
-            + std::to_string(expected_preamble_ints) + ", got " + std::to_string(preamble_ints));
-      }
-      if (serial_version != SERIAL_VERSION) {
-        throw std::invalid_argument("Possible corruption: serial version: expected "
-            + std::to_string(SERIAL_VERSION) + ", got " + std::to_string(serial_version));
-      }
-      if (family_id != FAMILY) {
-        throw std::invalid_argument("Possible corruption: family: expected "
-            + std::to_string(FAMILY) + ", got " + std::to_string(family_id));
+      check_preamble(preamble_ints, get_preamble_ints(&compressed), serial_version, family_id, seed_hash, seed);
+      if (reinterpret_cast<uintptr_t>(bytes) % alignof(uint32_t) == 0) return false;
+      if (compressed.compressedWindow != nullptr) {
+        compressed.compressedWindow = copy_array(compressed.compressedWindow, compressed.cwLength, allocator);
       }
-      if (seed_hash != compute_seed_hash(seed)) {
-        throw std::invalid_argument("Incompatible seed hashes: " + std::to_string(seed_hash) + ", "
-            + std::to_string(compute_seed_hash(seed)));
+      if (compressed.compressedSurprisingValues != nullptr) {
+        try {
+          compressed.compressedSurprisingValues = copy_array(compressed.compressedSurprisingValues, compressed.csvLength, allocator);
+        } catch (...) {
+          if (compressed.compressedWindow != nullptr) fm85freeWith(&allocator, compressed.compressedWindow);
+          throw;
+        }
       }
-      FM85* uncompressed = fm85Uncompress(&compressed);
-      delete [] compressed.compressedSurprisingValues;
-      delete [] compressed.compressedWindow;
-      cpc_sketch_unique_ptr sketch_ptr(
-          new (fm85alloc(sizeof(cpc_sketch))) cpc_sketch(uncompressed, seed),
-          [](cpc_sketch* s) { s->~cpc_sketch(); fm85free(s); }
-      );
-      return sketch_ptr;
+      return true;
     }
 
-    // for debugging
-    uint64_t get_num_coupons() const {
-      return state->numCoupons;
+    static uint32_t* copy_array(const uint32_t* src, size_t length, const fm85Allocator& allocator) {
+      uint32_t* dst = static_cast<uint32_t*>(fm85allocWith(&allocator, length * sizeof(uint32_t)));
+      if (dst == nullptr) throw std::bad_alloc();
+      copy_from_mem(src, dst, length * sizeof(uint32_t));
+      return dst;
     }
 
-    // for debugging
-    // this should catch some forms of corruption during serialization-deserialization
-    bool validate() const {
-      U64* bit_matrix = bitMatrixOfSketch(state);
-      const long long num_bits_set = countBitsSetInMatrix(bit_matrix, 1LL << state->lgK);
-      fm85free(bit_matrix);
-      return num_bits_set == state->numCoupons;
+    static uint32_t* read_array(std::istream& is, size_t length, const fm85Allocator& allocator) {
+      uint32_t* dst = static_cast<uint32_t*>(fm85allocWith(&allocator, length * sizeof(uint32_t)));
+      if (dst == nullptr) throw std::bad_alloc();
+      is.read((char*)dst, length * sizeof(uint32_t));
+      return dst;
     }
 
-    friend std::ostream& operator<<(std::ostream& os, cpc_sketch const& sketch);
-
-    friend class cpc_union;
-
-  private:
-    static const uint8_t SERIAL_VERSION = 1;
-    static const uint8_t FAMILY = 16;
-
-    enum flags { IS_BIG_ENDIAN, IS_COMPRESSED, HAS_HIP, HAS_TABLE, HAS_WINDOW };
-
-    FM85* state;
-    uint64_t seed;
+    static void free_compressed_arrays(FM85* state) {
+      if (state->compressedSurprisingValues != nullptr) fm85freeWith(&state->allocator, state->compressedSurprisingValues);
+      if (state->compressedWindow != nullptr) fm85freeWith(&state->allocator, state->compressedWindow);
+    }
 
-    // for deserialization and cpc_union::get_result()
-    cpc_sketch(FM85* state, uint64_t seed = DEFAULT_SEED) : state(state), seed(seed) {}
 
     static uint8_t get_preamble_ints(const FM85* state) {
+      return get_preamble_ints(state->numCoupons, !state->mergeFlag,
+          state->compressedSurprisingValues != nullptr, state->compressedWindow != nullptr);
+    }
+
+    static uint8_t get_preamble_ints(uint32_t num_coupons, bool has_hip, bool has_table, bool has_window) {
       uint8_t preamble_ints(2);
-      if (state->numCoupons > 0) {
+      if (num_coupons > 0) {
         preamble_ints += 1; // number of coupons
-        if (!state->mergeFlag) {
+        if (has_hip) {
           preamble_ints += 4; // HIP
         }
-        if (state->compressedSurprisingValues != nullptr) {
+        if (has_table) {
           preamble_ints += 1; // table length
           // number of values (if there is no window it is the same as number of coupons)
-          if (state->compressedWindow != nullptr) {
+          if (has_window) {
             preamble_ints += 1;
           }
         }
-        if (state->compressedWindow != nullptr) {
+        if (has_window) {
           preamble_ints += 1; // window length
         }
       }
       return preamble_ints;
     }
 
+    // the checks of the preamble that both deserialize() and compressed_from_mem() do
+    static void check_preamble(uint8_t preamble_ints, uint8_t expected_preamble_ints, uint8_t serial_version,
+        uint8_t family_id, uint16_t seed_hash, uint64_t seed) {
+      if (preamble_ints != expected_preamble_ints) {
+        throw std::invalid_argument("Possible corruption: preamble ints: expected "
+            + std::to_string(expected_preamble_ints) + ", got " + std::to_string(preamble_ints));
+      }
+      if (serial_version != SERIAL_VERSION) {
+        throw std::invalid_argument("Possible corruption: serial version: expected "
+            + std::to_string(SERIAL_VERSION) + ", got " + std::to_string(serial_version));
+      }
+      if (family_id != FAMILY) {
+        throw std::invalid_argument("Possible corruption: family: expected "
+            + std::to_string(FAMILY) + ", got " + std::to_string(family_id));
+      }
+      if (seed_hash != compute_seed_hash(seed)) {
+        throw std::invalid_argument("Incompatible seed hashes: " + std::to_string(seed_hash) + ", "
+            + std::to_string(compute_seed_hash(seed)));
+      }
+    }
+
     static inline void write_hip(const FM85* state, std::ostream& os) {
       os.write((char*)&state->kxp, sizeof(FM85::kxp));
       os.write((char*)&state->hipEstAccum, sizeof(FM85::hipEstAccum));
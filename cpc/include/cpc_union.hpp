@@ -6,6 +6,8 @@
 #ifndef CPC_UNION_HPP_
 #define CPC_UNION_HPP_
 
+#include <vector>
+
 #include "fm85Merging.h"
 #include "cpc_sketch.hpp"
 
@@ -18,25 +20,15 @@ namespace datasketches {
  * author Alexander Saydakov
  */
 
-UG85* ug85Copy(UG85* other) {
-  UG85* copy(new UG85(*other));
-  if (other->accumulator != nullptr) copy->accumulator = fm85Copy(other->accumulator);
-  if (other->bitMatrix != nullptr) {
-    uint32_t k = 1 << copy->lgK;
-    copy->bitMatrix = (U64 *) malloc ((size_t) (k * sizeof(U64)));
-    std::copy(&other->bitMatrix[0], &other->bitMatrix[k], copy->bitMatrix);
-  }
-  return copy;
-}
-
 class cpc_union {
   public:
-    explicit cpc_union(uint8_t lg_k = CPC_DEFAULT_LG_K, uint64_t seed = DEFAULT_SEED) : seed(seed) {
-      fm85Init();
+    // the union, its internal buffers and the result sketches use the given memory resource
+    explicit cpc_union(uint8_t lg_k = CPC_DEFAULT_LG_K, uint64_t seed = DEFAULT_SEED, cpc_memory_resource* resource = nullptr) : seed(seed) {
       if (lg_k < CPC_MIN_LG_K or lg_k > CPC_MAX_LG_K) {
         throw std::invalid_argument("lg_k must be >= " + std::to_string(CPC_MIN_LG_K) + " and <= " + std::to_string(CPC_MAX_LG_K) + ": " + std::to_string(lg_k));
       }
-      state = ug85Make(lg_k);
+      const fm85Allocator allocator(make_fm85_allocator(resource));
+      state = ug85Make(lg_k, &allocator);
     }
 
     cpc_union(const cpc_union& other) {
@@ -44,6 +36,11 @@ class cpc_union {
       state = ug85Copy(other.state);
     }
 
+    // the moved-from union can only be destroyed or assigned to
+    cpc_union(cpc_union&& other) noexcept : state(other.state), seed(other.seed) {
+      other.state = nullptr;
+    }
+
     cpc_union& operator=(cpc_union other) {
       seed = other.seed;
       std::swap(state, other.state); // @suppress("Invalid arguments")
@@ -54,6 +51,15 @@ class cpc_union {
       ug85Free(state);
     }
 
+    // for lg_k >= 20 the bit matrix operations (merging large sketches and get_result)
+    // can be split across the given number of threads
+    void set_num_threads(unsigned num_threads) {
+      if (num_threads < 1 or num_threads > CPC_MAX_NUM_THREADS) {
+        throw std::invalid_argument("num_threads must be >= 1 and <= " + std::to_string(CPC_MAX_NUM_THREADS) + ": " + std::to_string(num_threads));
+      }
+      ug85SetNumThreads(state, num_threads);
+    }
+
     void update(const cpc_sketch& sketch) {
       const uint16_t seed_hash_union = compute_seed_hash(seed);
       const uint16_t seed_hash_sketch = compute_seed_hash(sketch.seed);
@@ -64,12 +70,46 @@ class cpc_union {
       ug85MergeInto(state, sketch.state);
     }
 
+    // merges a range of sketches at once, which is much faster than merging them one by one
+    // if many of them are small (sparse), since their coupons are gathered, sorted and added in bulk
+    template<typename InputIt>
+    void update(InputIt first, InputIt last) {
+      const uint16_t seed_hash_union = compute_seed_hash(seed);
+      std::vector<FM85*> sources;
+      for (InputIt it = first; it != last; ++it) {
+        const cpc_sketch& sketch = *it;
+        const uint16_t seed_hash_sketch = compute_seed_hash(sketch.seed);
+        if (seed_hash_union != seed_hash_sketch) {
+          throw std::invalid_argument("Incompatible seed hashes: " + std::to_string(seed_hash_union) + ", "
+              + std::to_string(seed_hash_sketch));
+        }
+        sources.push_back(sketch.state);
+      }
+      ug85MergeManyInto(state, sources.data(), sources.size());
+    }
+
+    // merges a serialized sketch (as produced by cpc_sketch::serialize) straight from its compressed form
+    // without building an intermediate updateable sketch
+    void update(const void* bytes, size_t size) {
+      FM85 compressed;
+      const bool arrays_copied = cpc_sketch::compressed_from_mem(bytes, size, seed, state->allocator, &compressed);
+      try {
+        ug85MergeCompressedInto(state, &compressed);
+      } catch (...) {
+        if (arrays_copied) cpc_sketch::free_compressed_arrays(&compressed);
+        throw;
+      }
+      if (arrays_copied) cpc_sketch::free_compressed_arrays(&compressed);
+    }
+
     cpc_sketch_unique_ptr get_result() const {
-      cpc_sketch_unique_ptr sketch_ptr(
-          new (fm85alloc(sizeof(cpc_sketch))) cpc_sketch(ug85GetResult(state), seed),
-          [](cpc_sketch* s) { s->~cpc_sketch(); fm85free(s); }
-      );
-      return sketch_ptr;
+      return cpc_sketch::make_unique_ptr(ug85GetResult(state), seed);
+    }
+
+    // returns the union to the empty state with the original lg_k
+    // keeping its internal buffers, so that it can be reused without allocating again
+    void reset() {
+      ug85Reset(state);
     }
 
   private:
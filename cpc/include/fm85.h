@@ -53,25 +53,33 @@ typedef struct fm85_sketch_type
   double hipEstAccum;
   double hipErrAccum;
 
+  // All memory owned by this sketch (including its table and window) comes from here.
+  fm85Allocator allocator;
+
 } FM85;
 
 extern void* (*fm85alloc)(size_t);
 extern void (*fm85free)(void*);
 
+// Forwards to fm85alloc and fm85free (which can be set by fm85InitAD).
+extern const fm85Allocator fm85DefaultAllocator;
+
 /*******************************************************/
 // These routines are exported.
 
-void fm85Init (void); // Call this before anything else.
-void fm85InitAD (void* (*alloc)(size_t), void (*dealloc)(void*)); // or this to use custom allocator and deallocator
+void fm85Init (void); // No longer needed: all tables are static data. Kept for compatibility.
+void fm85InitAD (void* (*alloc)(size_t), void (*dealloc)(void*)); // to use custom allocator and deallocator
 
-void fm85Clean (void); // Call this at the end to clean up (optional)
+void fm85Clean (void); // No longer needed. Kept for compatibility.
 
-FM85 * fm85Make (Short lgK);
+FM85 * fm85Make (Short lgK, const fm85Allocator * allocator);
 
-FM85 * fm85Copy (FM85 * self);
+FM85 * fm85Copy (FM85 * self, const fm85Allocator * allocator); // the copy uses the given allocator
 
 void fm85Free (FM85 * sketch);
 
+void fm85Reset (FM85 * sketch, Short lgK); // empties an updateable sketch in place
+
 void fm85Update (FM85 * sketch, U64 hash0, U64 hash1);
 
 double getHIPEstimate (FM85 * sketch);
@@ -93,7 +101,9 @@ enum flavorType determineSketchFlavor (FM85 * self);
 
 Short determineCorrectOffset (Short lgK, Long c);
 
-U64 * bitMatrixOfSketch (FM85 * self);
+U64 * bitMatrixOfSketch (FM85 * self); // allocated with the sketch's allocator
+
+void fillBitMatrixOfSketch (FM85 * self, U64 * matrix); // the same, into a caller-supplied k-row matrix
 
 // these are only used internally
 // void promoteEmptyToSparse (FM85 * self);
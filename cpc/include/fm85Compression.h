@@ -26,8 +26,9 @@
 
 /****************************************/
 
-void makeTheDecodingTables (void); // call this at startup
-void freeTheDecodingTables (void); // call this at the end
+// The decoding tables are constant static data, so no initialization is needed.
+// This checks them against the encoding tables (throws std::logic_error on mismatch).
+void validateTheDecodingTables (void); // used for testing
 
 /****************************************/
 // Here "pairs" refers to row/column pairs that specify 
@@ -52,14 +53,14 @@ void lowLevelUncompressPairs (U32 * pairArray, // output
 
 Long lowLevelCompressBytes (U8 * byteArray,         // input
 			    Long numBytesToEncode,  // input
-			    U16 * encodingTable,    // input
+			    const U16 * encodingTable, // input
 			    U32 * compressedWords); // output
 
 /****************************************/
 
 void lowLevelUncompressBytes (U8 * byteArray,         // output
 			      Long numBytesToDecode,  // input (but refers to the output)
-			      U16 * decodingTable,    // input
+			      const U16 * decodingTable, // input
 			      U32 * compressedWords, // input
 			      Long numCompressedWords); // input
 
@@ -71,6 +72,21 @@ FM85 * fm85Uncompress (FM85 * compressedSketch); // returns an updateable copy o
 
 // Note: in the final system, compressed and uncompressed sketches will have different types
 
+/****************************************/
+// These work directly on a compressed sketch, without building an updateable copy.
+
+// allocates (with the source's allocator) and returns the numCompressedSurprisingValues pairs
+U32 * uncompressTheSurprisingValues (FM85 * compressedSketch);
+
+// the same into the given array of at least numCompressedSurprisingValues pairs
+void uncompressTheSurprisingValuesInto (FM85 * compressedSketch, U32 * pairs);
+
+// ORs the coupons of a compressed sketch into a bit matrix, modulo 2^destLgK rows
+// (the destination must not have more rows than the source)
+// windowBuffer is k bytes of scratch space, and pairsBuffer room for numCompressedSurprisingValues pairs,
+// or NULL to allocate them
+void orCompressedSketchIntoMatrix (U64 * destMatrix, Short destLgK, FM85 * compressedSketch, U8 * windowBuffer, U32 * pairsBuffer);
+
 /****************************************/
 
 #define GOT_FM85_COMPRESSION_H
@@ -15,11 +15,29 @@
 
 /****************************************/
 
+// Below this size the bitMatrix operations take less time than starting threads.
+#define UG85_MIN_LGK_FOR_THREADS 20
+
+// A kept buffer that is this many times larger than needed (and larger than k rows)
+// is given back and reallocated.
+#define UG85_SHRINK_FACTOR 4
+
 typedef struct fm85_unioning_gadget
 {
   Short lgK; // Note: in some cases this will be reduced.
+  Short initialLgK; // restored by ug85Reset
   FM85 * accumulator; // this is a sketch object
-  U64  * bitMatrix;
+  U64  * bitMatrix; // when not NULL this points to matrixBuffer
+  fm85Allocator allocator; // used for the gadget, its accumulator and its bitMatrix
+  Short numThreads; // for the bitMatrix operations when lgK >= UG85_MIN_LGK_FOR_THREADS
+  // The following are kept between merges (and across ug85Reset) so that steady-state merging
+  // into the bitMatrix does not allocate. A SPARSE accumulator still allocates (and grows) its own
+  // hash table. The gadget owns them even when they are not in use.
+  U64  * matrixBuffer;
+  Long   matrixBufferRows;
+  U64  * scratchBuffer; // for converting a source into rows, or for gathering pairs
+  Long   scratchBufferRows;
+  FM85 * spareAccumulator; // the EMPTY accumulator, while the bitMatrix is in use
   // Note: at most one of the previous two fields will be non-NULL at any given moment.
   // accumulator is a sketch object that is employed until it graduates out of Sparse mode.
   // At that point, it is converted into a full-sized bitMatrix, which is mathematically a sketch,
@@ -29,12 +47,24 @@ typedef struct fm85_unioning_gadget
 
 /****************************************/
 
-UG85 * ug85Make (Short lgK);
+UG85 * ug85Make (Short lgK, const fm85Allocator * allocator);
+
+UG85 * ug85Copy (UG85 * other);
 
 void ug85Free (UG85 * unioner);
 
+void ug85SetNumThreads (UG85 * unioner, Short numThreads); // 1 by default
+
+void ug85Reset (UG85 * unioner); // back to EMPTY with the initial lgK, keeping the buffers
+
 void ug85MergeInto (UG85 * unioner, FM85 * sourceSketch);
 
+// merges many sketches at once (the SPARSE ones are gathered and added in bulk)
+void ug85MergeManyInto (UG85 * unioner, FM85 ** sourceSketches, Long numSources);
+
+// merges a compressed sketch without uncompressing it
+void ug85MergeCompressedInto (UG85 * unioner, FM85 * compressedSourceSketch);
+
 FM85 * ug85GetResult (UG85 * unioner);
 
 /****************************************/
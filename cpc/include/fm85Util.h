@@ -8,20 +8,15 @@
 #ifndef GOT_FM85_UTIL_H
 #include "common.h"
 
-void * shallowCopy (void * oldObject, size_t numBytes);
+void * shallowCopy (void * oldObject, size_t numBytes, const fm85Allocator * allocator);
 
-extern double invPow2Tab[];
+// These lookup tables are constant static data, so no initialization is needed.
 
-void fillInvPow2Tab (void);
+extern const double invPow2Tab[];
 
-extern double kxpByteLookup[];
+extern const double kxpByteLookup[];
 
-void fillKxpByteLookup(void);
-
-extern U8 byteTrailingZerosTable[];
-
-void fillByteLeadingZerosTable(void);
-void fillByteTrailingZerosTable(void);
+extern const U8 byteTrailingZerosTable[];
 
 Short countLeadingZerosInUnsignedLong  (U64 theInput);
 Short countTrailingZerosInUnsignedLong (U64 theInput);
@@ -31,7 +26,17 @@ Long divideLongsRoundingUp (Long x, Long y);
 // for delta-encoding an instance of (n choose m)
 Long golombChooseNumberOfBaseBits (Long n, Long m);
 
-Long countBitsSetInMatrix (U64 * array, Long length);
+// The following use SIMD instructions where available.
+// The lengths must be multiples of 8 (for counting) or 16 (for OR'ing).
+
+Long countBitsSetInMatrix (const U64 * array, Long length);
+
+void orMatrixRows (U64 * dest, const U64 * src, Long numRows);
+
+// dest[i] |= window[i] << shift
+void orWindowRows (U64 * dest, const U8 * window, Long numRows, Short shift);
+
+Long warrenCountBitsSetInMatrix (const U64 * array, Long length); // used for testing
 
 /******************************************/
 
@@ -23,13 +23,14 @@ typedef struct u32_table_type
   Short lgSize; // log2 of number of slots
   Long  numItems;
   U32 * slots;
+  fm85Allocator allocator;
 } u32Table;
 
 /*******************************************************/
 
-u32Table * u32TableMake (Short initialLgSize, Short numValidBits);
+u32Table * u32TableMake (Short initialLgSize, Short numValidBits, const fm85Allocator * allocator);
 
-u32Table * u32TableCopy (u32Table * self);
+u32Table * u32TableCopy (u32Table * self, const fm85Allocator * allocator);
 
 void u32TableClear (u32Table * self);
 
@@ -47,11 +48,11 @@ Boolean u32TableMaybeDelete (u32Table * self, U32 item);
 
 // this one slightly breaks the abstraction boundary
 
-u32Table * makeU32TableFromPairsArray (U32 * pairs, Long numPairs, Short sketchLgK);
+u32Table * makeU32TableFromPairsArray (U32 * pairs, Long numPairs, Short sketchLgK, const fm85Allocator * allocator);
 
 /*******************************************************/
 
-U32 * u32TableUnwrappingGetItems (u32Table * self, Long * returnNumItems);
+U32 * u32TableUnwrappingGetItems (u32Table * self, Long * returnNumItems); // allocated with the table's allocator
 
 void printU32Array (U32 * array, Long arrayLength);
 
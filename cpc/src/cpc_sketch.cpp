@@ -13,7 +13,7 @@ void cpc_init(void* (*alloc)(size_t), void (*dealloc)(void*)) {
   fm85InitAD(alloc, dealloc);
 }
 
-// optional deallocation of globally allocated compression tables
+// no longer needed, kept for compatibility
 void cpc_cleanup() {
   fm85Clean();
 }
@@ -31,37 +31,28 @@ U32 rowColFromTwoHashes (U64 hash0, U64 hash1, Short lgK) {
 
 /*******************************************************/
 
-Boolean fm85Initialized = 0;
-
 // This is to support custom allocator and deallocator
-void* (*fm85alloc)(size_t);
-void (*fm85free)(void*);
+void* (*fm85alloc)(size_t) = &malloc;
+void (*fm85free)(void*) = &free;
 
-// This stuff would be handled by Java's mechanism
-// for initializing class variables.
+static void * defaultAlloc (size_t numBytes, void * context) { return fm85alloc (numBytes); }
+static void defaultDealloc (void * ptr, void * context) { fm85free (ptr); }
 
-void fm85Init (void) {
-  fm85InitAD(&malloc, &free);
-}
+const fm85Allocator fm85DefaultAllocator = { &defaultAlloc, &defaultDealloc, NULL };
 
-// This is to support custom allocator and deallocator
+// All lookup and decoding tables are constant static data now,
+// so there is nothing to initialize. This is kept for compatibility.
+
+void fm85Init (void) {}
+
+// This is to support custom allocator and deallocator.
+// Call this before creating any sketches (it is not synchronized).
 void fm85InitAD (void* (*alloc)(size_t), void (*dealloc)(void*)) {
-  if (!fm85Initialized) {
-    fm85Initialized = 1;
-    fm85alloc = alloc;
-    fm85free = dealloc;
-    fillByteLeadingZerosTable();
-    fillByteTrailingZerosTable();
-    makeTheDecodingTables();
-    fillInvPow2Tab ();
-    fillKxpByteLookup ();
-  }
+  fm85alloc = alloc;
+  fm85free = dealloc;
 }
 
-void fm85Clean (void) {
-  freeTheDecodingTables();
-  fm85Initialized = 0;
-}
+void fm85Clean (void) {}
 
 /*******************************************************/
 // The flavor is a function of K and C (the number of collected coupons).
@@ -95,10 +86,11 @@ Short determineCorrectOffset (Short lgK, Long c) {
 
 /*******************************************************/
 
-FM85 * fm85Make (Short lgK) {
+FM85 * fm85Make (Short lgK, const fm85Allocator * allocator) {
   if (lgK < 4 || lgK > 26) throw std::invalid_argument("lgK must be between 4 and 26");
-  FM85 * self = (FM85 *) fm85alloc (sizeof(FM85));
+  FM85 * self = (FM85 *) fm85allocWith (allocator, sizeof(FM85));
   if (self == NULL) throw std::bad_alloc();
+  self->allocator = *allocator;
   self->lgK = lgK;
   self->isCompressed = 0;
   self->mergeFlag = 0;
@@ -128,25 +120,26 @@ FM85 * fm85Make (Short lgK) {
 
 /*******************************************************/
 
-FM85 * fm85Copy (FM85 * self) {
+FM85 * fm85Copy (FM85 * self, const fm85Allocator * allocator) {
   if (self == NULL) throw std::invalid_argument("self is null");
-  FM85 * newObj = (FM85 *) shallowCopy ((void *) self, sizeof(FM85));
+  FM85 * newObj = (FM85 *) shallowCopy ((void *) self, sizeof(FM85), allocator);
+  newObj->allocator = *allocator;
 
   if (self->surprisingValueTable != NULL) {
-    newObj->surprisingValueTable = u32TableCopy (self->surprisingValueTable);
+    newObj->surprisingValueTable = u32TableCopy (self->surprisingValueTable, allocator);
   }
   if (self->slidingWindow != NULL) {
     Long k = (1LL << self->lgK);
     size_t theSize = k * sizeof(U8);
-    newObj->slidingWindow = (U8 *) shallowCopy ((void *) self->slidingWindow, theSize);
+    newObj->slidingWindow = (U8 *) shallowCopy ((void *) self->slidingWindow, theSize, allocator);
   }
   if (self->compressedSurprisingValues != NULL) {
     size_t theSize = self->csvLength * sizeof(U32);
-    newObj->compressedSurprisingValues = (U32 *) shallowCopy ((void *) self->compressedSurprisingValues, theSize);
+    newObj->compressedSurprisingValues = (U32 *) shallowCopy ((void *) self->compressedSurprisingValues, theSize, allocator);
   }
   if (self->compressedWindow != NULL) {
     size_t theSize = self->cwLength * sizeof(U32);
-    newObj->compressedWindow = (U32 *) shallowCopy ((void *) self->compressedWindow, theSize);
+    newObj->compressedWindow = (U32 *) shallowCopy ((void *) self->compressedWindow, theSize, allocator);
   }
 
   return (newObj);
@@ -154,13 +147,35 @@ FM85 * fm85Copy (FM85 * self) {
 
 /*******************************************************/
 
+// Empties the sketch (possibly changing its lgK) without freeing the sketch itself.
+
+void fm85Reset (FM85 * self, Short lgK) {
+  if (lgK < 4 || lgK > 26) throw std::invalid_argument("lgK must be between 4 and 26");
+  if (self->isCompressed != 0) throw std::invalid_argument("isCompressed != 0");
+  if (self->surprisingValueTable != NULL) { u32TableFree (self->surprisingValueTable); }
+  if (self->slidingWindow != NULL) { fm85freeWith (&self->allocator, self->slidingWindow); }
+  self->surprisingValueTable = (u32Table *) NULL;
+  self->slidingWindow = (U8 *) NULL;
+  self->lgK = lgK;
+  self->mergeFlag = 0;
+  self->numCoupons = 0LL;
+  self->windowOffset = 0;
+  self->firstInterestingColumn = 0;
+  self->kxp = (double) (1LL << lgK);
+  self->hipEstAccum = 0.0;
+  self->hipErrAccum = 0.0;
+}
+
+/*******************************************************/
+
 void fm85Free (FM85 * self) {
   if (self != NULL) {
+    fm85Allocator allocator = self->allocator; // the sketch itself is freed last
     if (self->surprisingValueTable != NULL) u32TableFree (self->surprisingValueTable);
-    if (self->slidingWindow != NULL) fm85free (self->slidingWindow);
-    if (self->compressedSurprisingValues != NULL) fm85free (self->compressedSurprisingValues);
-    if (self->compressedWindow != NULL) fm85free (self->compressedWindow);
-    fm85free (self);
+    if (self->slidingWindow != NULL) fm85freeWith (&allocator, self->slidingWindow);
+    if (self->compressedSurprisingValues != NULL) fm85freeWith (&allocator, self->compressedSurprisingValues);
+    if (self->compressedWindow != NULL) fm85freeWith (&allocator, self->compressedWindow);
+    fm85freeWith (&allocator, self);
   }
 }
 
@@ -176,13 +191,20 @@ void fm85Free (FM85 * self) {
 // This produces a full-size k-by-64 bit matrix from any Live sketch.
 
 U64 * bitMatrixOfSketch (FM85 * self) {
+  if (self->isCompressed != 0) throw std::logic_error("isCompressed != 0");
+  Long k = (1LL << self->lgK);
+  U64 * matrix = (U64 *) fm85allocWith (&self->allocator, (size_t) (k * sizeof(U64)));
+  if (matrix == NULL) throw std::bad_alloc();
+  fillBitMatrixOfSketch (self, matrix);
+  return (matrix);
+}
+
+void fillBitMatrixOfSketch (FM85 * self, U64 * matrix) {
   if (self->isCompressed != 0) throw std::logic_error("isCompressed != 0");
   Long k = (1LL << self->lgK);
   Short offset = self->windowOffset;
   if (offset < 0 || offset > 56) throw std::logic_error("offset < 0 || offset > 56");
   Long i = 0;
-  U64 * matrix = (U64 *) fm85alloc ((size_t) (k * sizeof(U64)));
-  if (matrix == NULL) throw std::bad_alloc();
 
 // Fill the matrix with default rows in which the "early zone" is filled with ones.
 // This is essential for the routine's O(k) time cost (as opposed to O(C)).
@@ -190,7 +212,7 @@ U64 * bitMatrixOfSketch (FM85 * self) {
   for (i = 0; i < k; i++) { matrix[i] = defaultRow; } 
 
   if (self->numCoupons == 0) { 
-    return (matrix); // Returning a matrix of zeros rather than NULL.
+    return; // a matrix of zeros
   }
 
   U8 * window = self->slidingWindow;
@@ -215,8 +237,6 @@ U64 * bitMatrixOfSketch (FM85 * self) {
       matrix[row] ^= (1ULL << col); 
     }
   }
-
-  return(matrix);
 }
 
 /*******************************************************/
@@ -224,7 +244,7 @@ U64 * bitMatrixOfSketch (FM85 * self) {
 void promoteEmptyToSparse (FM85 * self) {
   if (self->numCoupons != 0) throw std::logic_error("numCoupons != 0");
   if (self->surprisingValueTable != NULL) throw std::logic_error("surprisingValueTable != NULL");
-  self->surprisingValueTable = u32TableMake (2, 6 + self->lgK);
+  self->surprisingValueTable = u32TableMake (2, 6 + self->lgK, &self->allocator);
 }
 
 /*******************************************************/
@@ -236,11 +256,11 @@ void promoteSparseToWindowed (FM85 * self) {
   if (!(c32 == 3 * k || (self->lgK == 4 && c32 > 3 * k))) throw std::logic_error("wrong c32");
   Long i;
 
-  U8 * window = (U8 *) fm85alloc ((size_t) (k * sizeof(U8)));
+  U8 * window = (U8 *) fm85allocWith (&self->allocator, (size_t) (k * sizeof(U8)));
   if (window == NULL) throw std::bad_alloc();
   bzero ((void *) window, (size_t) k); // zero the memory (because we will be OR'ing into it)
 
-  u32Table * newTable = u32TableMake (2, 6 + self->lgK);
+  u32Table * newTable = u32TableMake (2, 6 + self->lgK, &self->allocator);
 
   u32Table * oldTable = self->surprisingValueTable;
   U32 * oldSlots = oldTable->slots;
@@ -358,7 +378,7 @@ void modifyOffset (FM85 * self, Short newOffset) {
     }
   }
 
-  fm85free (bitMatrix);
+  fm85freeWith (&self->allocator, bitMatrix);
   self->windowOffset = newOffset;
 
   self->firstInterestingColumn = countTrailingZerosInUnsignedLong (allSurprisesORed);
@@ -12,60 +12,17 @@
 #include <new>
 
 /*********************************/
-// The following material is in a separate file because it is so big.
+// The following material is in separate files because it is so big.
 
 #include "compressionData.data"
+#include "decodingTables.data"
 
 /***************************************************************/
 /***************************************************************/
-// Intentionally uses malloc instead of the custom allocator
-// since it is for global initialization, not for allocating instances.
-U8 * makeInversePermutation (U8 * permu, int length) {
-  U8 * inverse = (U8 *) malloc (((size_t) length) * sizeof(U8));
-  if (inverse == NULL) throw std::bad_alloc();
-  int i;
-  for (i = 0; i < length; i++) {
-    inverse[permu[i]] = i;
-  }
-  for (i = 0; i < length; i++) {
-    if (permu[inverse[i]] != i) throw std::logic_error("inverse permutation error");
-  }
-  return inverse;
-}
-
-/***************************************************************/
-/***************************************************************/
+// Checks that a size-4096 decoding table is the exact inverse of an encoding
+// table that maps unsigned bytes to codewords of length at most 12.
 
-/* Given an encoding table that maps unsigned bytes to codewords 
-   of length at most 12, this builds a size-4096 decoding table */
-
-// The second argument is typically 256, but can be other values such as 65.
-// Intentionally uses malloc instead of the custom allocator
-// since it is for global initialization, not for allocating instances.
-U16 * makeDecodingTable (U16 * encodingTable, int numByteValues) { 
-  int byteValue;
-  U16 * decodingTable = (U16 *) malloc (((size_t) 4096) * sizeof(U16));
-  if (decodingTable == NULL) throw std::bad_alloc();
-  for (byteValue=0; byteValue < numByteValues; byteValue++) {
-    int encodingEntry = encodingTable [byteValue];
-    int codeValue = encodingEntry & 0xfff;
-    int codeLength = encodingEntry >> 12;    
-    int decodingEntry = (codeLength << 8) | byteValue;
-    int garbageLength = 12 - codeLength;
-    int numCopies = 1 << garbageLength;
-    int garbageBits;
-    for (garbageBits = 0; garbageBits < numCopies; garbageBits++) {
-      int extendedCodeValue = codeValue | (garbageBits << codeLength);
-      decodingTable[extendedCodeValue & 0xfff] = decodingEntry;
-    }
-  }
-  return (decodingTable);
-}
-
-/***************************************************************/
-/***************************************************************/
-
-void validateDecodingTable (U16 * decodingTable, U16 * encodingTable) {
+static void validateDecodingTable (const U16 * decodingTable, const U16 * encodingTable) {
   int decodeThis;
   
   for (decodeThis = 0; decodeThis < 4096; decodeThis++) {
@@ -88,33 +45,27 @@ void validateDecodingTable (U16 * decodingTable, U16 * encodingTable) {
 }
 
 /***************************************************************/
+
+static void validateInversePermutation (const U8 * permu, const U8 * inverse, int length) {
+  int i;
+  for (i = 0; i < length; i++) {
+    if (inverse[permu[i]] != i) throw std::logic_error("inverse permutation error");
+    if (permu[inverse[i]] != i) throw std::logic_error("inverse permutation error");
+  }
+}
+
 /***************************************************************/
 
-void makeTheDecodingTables (void) {
+void validateTheDecodingTables (void) {
   int i;
-  lengthLimitedUnaryDecodingTable65 = makeDecodingTable (lengthLimitedUnaryEncodingTable65, 65);
   validateDecodingTable (lengthLimitedUnaryDecodingTable65, lengthLimitedUnaryEncodingTable65);
 
   for (i = 0; i < (16 + 6); i++) {
-    decodingTablesForHighEntropyByte[i] = makeDecodingTable(encodingTablesForHighEntropyByte[i], 256);
     validateDecodingTable (decodingTablesForHighEntropyByte[i], encodingTablesForHighEntropyByte[i]);
   }
 
   for (i = 0; i < 16; i++) {
-    columnPermutationsForDecoding[i] = makeInversePermutation(columnPermutationsForEncoding[i],56);
-  }
-
-  //  fprintf (stderr, "tables okay\n"); fflush (stderr);
-}
-
-void freeTheDecodingTables (void) {
-  int i;
-  free(lengthLimitedUnaryDecodingTable65);
-  for (i = 0; i < (16 + 6); i++) {
-    free(decodingTablesForHighEntropyByte[i]);
-  }
-  for (i = 0; i < 16; i++) {
-    free(columnPermutationsForDecoding[i]);
+    validateInversePermutation (columnPermutationsForEncoding[i], columnPermutationsForDecoding[i], 56);
   }
 }
 
@@ -221,7 +172,7 @@ static inline Long readUnary (U32 * compressedWords,
 
 Long lowLevelCompressBytes (U8 * byteArray,          // input
 			    Long numBytesToEncode,   // input
-			    U16 * encodingTable,     // input 
+			    const U16 * encodingTable, // input
 			    U32 * compressedWords) { // output
 
   Long byteIndex = 0;
@@ -256,7 +207,7 @@ Long lowLevelCompressBytes (U8 * byteArray,          // input
 
 void lowLevelUncompressBytes (U8 * byteArray,          // output
 			      Long numBytesToDecode,   // input (but refers to the output)
-			      U16 * decodingTable,     // input
+			      const U16 * decodingTable, // input
 			      U32 * compressedWords,   // input
 			      Long numCompressedWords) { // input
   Long byteIndex = 0;
@@ -484,7 +435,7 @@ Short determinePseudoPhase (Short lgK, Long c) {
 void compressTheWindow (FM85 * target, FM85 * source) {
   Long k = (1LL << source->lgK);  
   Long windowBufLen = safeLengthForCompressedWindowBuf (k);
-  U32 * windowBuf = (U32 *) fm85alloc ((size_t) (windowBufLen * sizeof(U32)));
+  U32 * windowBuf = (U32 *) fm85allocWith (&source->allocator, (size_t) (windowBufLen * sizeof(U32)));
   if (windowBuf == NULL) throw std::logic_error("windowBuf == NULL");
   Short pseudoPhase = determinePseudoPhase (source->lgK, source->numCoupons);
   target->cwLength = lowLevelCompressBytes (source->slidingWindow, k,
@@ -494,10 +445,10 @@ void compressTheWindow (FM85 * target, FM85 * source) {
   // At this point we free the unused portion of the compression output buffer.
   // Note: realloc caused strange timing spikes for lgK = 11 and 12.
 
-  U32 * shorterBuf = (U32 *) fm85alloc (((size_t) target->cwLength) * sizeof(U32));
+  U32 * shorterBuf = (U32 *) fm85allocWith (&source->allocator, ((size_t) target->cwLength) * sizeof(U32));
   if (shorterBuf == NULL) throw std::bad_alloc();
   memcpy ((void *) shorterBuf, (void *) windowBuf, ((size_t) target->cwLength) * sizeof(U32));
-  fm85free (windowBuf);
+  fm85freeWith (&source->allocator, windowBuf);
   target->compressedWindow = shorterBuf;
 
   return;
@@ -508,7 +459,7 @@ void compressTheWindow (FM85 * target, FM85 * source) {
 
 void uncompressTheWindow (FM85 * target, FM85 * source) {
   Long k = (1LL << source->lgK);  
-  U8 * window = (U8 *) fm85alloc ((size_t) (k * sizeof(U8)));
+  U8 * window = (U8 *) fm85allocWith (&source->allocator, (size_t) (k * sizeof(U8)));
   if (window == NULL) throw std::bad_alloc();
   // zeroing not needed here (unlike the Hybrid Flavor)
   if (target->slidingWindow != NULL) throw std::logic_error("target->slidingWindow != NULL");
@@ -531,7 +482,7 @@ void compressTheSurprisingValues (FM85 * target, FM85 * source, U32 * pairs, Lon
   Long k = (1LL << source->lgK);
   Long numBaseBits = golombChooseNumberOfBaseBits (k + numPairs, numPairs);
   Long pairBufLen = safeLengthForCompressedPairBuf (k, numPairs, numBaseBits);
-  U32 * pairBuf = (U32 *) fm85alloc ((size_t) (pairBufLen * sizeof(U32)));
+  U32 * pairBuf = (U32 *) fm85allocWith (&source->allocator, (size_t) (pairBufLen * sizeof(U32)));
   if (pairBuf == NULL) throw std::bad_alloc();
 
   target->csvLength = lowLevelCompressPairs (pairs, numPairs, numBaseBits, pairBuf);
@@ -539,10 +490,10 @@ void compressTheSurprisingValues (FM85 * target, FM85 * source, U32 * pairs, Lon
   // At this point we free the unused portion of the compression output buffer.
   // Note: realloc caused strange timing spikes for lgK = 11 and 12.
 
-  U32 * shorterBuf = (U32 *) fm85alloc (((size_t) target->csvLength) * sizeof(U32));
+  U32 * shorterBuf = (U32 *) fm85allocWith (&source->allocator, ((size_t) target->csvLength) * sizeof(U32));
   if (shorterBuf == NULL) throw std::bad_alloc();
   memcpy ((void *) shorterBuf, (void *) pairBuf, ((size_t) target->csvLength) * sizeof(U32));
-  fm85free (pairBuf);
+  fm85freeWith (&source->allocator, pairBuf);
   target->compressedSurprisingValues = shorterBuf;
 }
 
@@ -553,15 +504,29 @@ void compressTheSurprisingValues (FM85 * target, FM85 * source, U32 * pairs, Lon
 
 U32 * uncompressTheSurprisingValues (FM85 * source) {
   if (source->isCompressed != 1) throw std::logic_error("not compressed");
-  Long k = (1LL << source->lgK);  
   Long numPairs = source->numCompressedSurprisingValues;
   if (numPairs <= 0) throw std::logic_error("numPairs <= 0");
-  U32 * pairs = (U32 *) fm85alloc ((size_t) numPairs * sizeof(U32));
+  U32 * pairs = (U32 *) fm85allocWith (&source->allocator, (size_t) numPairs * sizeof(U32));
   if (pairs == NULL) throw std::bad_alloc();
+  try {
+    uncompressTheSurprisingValuesInto (source, pairs);
+  } catch (...) {
+    fm85freeWith (&source->allocator, pairs);
+    throw;
+  }
+  return (pairs);
+}
+
+// the same into an array provided by the caller
+
+void uncompressTheSurprisingValuesInto (FM85 * source, U32 * pairs) {
+  if (source->isCompressed != 1) throw std::logic_error("not compressed");
+  Long k = (1LL << source->lgK);
+  Long numPairs = source->numCompressedSurprisingValues;
+  if (numPairs <= 0) throw std::logic_error("numPairs <= 0");
   Long numBaseBits = golombChooseNumberOfBaseBits (k + numPairs, numPairs);
-  lowLevelUncompressPairs(pairs, numPairs, numBaseBits, 
+  lowLevelUncompressPairs(pairs, numPairs, numBaseBits,
 			  source->compressedSurprisingValues, source->csvLength);
-  return (pairs);
 }
 
 /***************************************************************/
@@ -586,7 +551,7 @@ void compressSparseFlavor (FM85 * target, FM85 * source) {
   U32 * pairs = u32TableUnwrappingGetItems (source->surprisingValueTable, &numPairs);
   introspectiveInsertionSort(pairs, 0, numPairs-1);
   compressTheSurprisingValues (target, source, pairs, numPairs);
-  if (pairs) fm85free (pairs);
+  if (pairs) fm85freeWith (&source->allocator, pairs);
   return;
 }
 
@@ -597,9 +562,9 @@ void uncompressSparseFlavor (FM85 * target, FM85 * source) {
   if (source->compressedSurprisingValues == NULL) throw std::logic_error("source->compressedSurprisingValues == NULL");
   U32 * pairs = uncompressTheSurprisingValues (source);
   Long numPairs = source->numCompressedSurprisingValues;
-  u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, source->lgK);
+  u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, source->lgK, &source->allocator);
   target->surprisingValueTable = table;
-  fm85free (pairs);
+  fm85freeWith (&source->allocator, pairs);
   return;
 }
 
@@ -608,9 +573,9 @@ void uncompressSparseFlavor (FM85 * target, FM85 * source) {
 // The empty space that this leaves at the beginning of the output array
 // will be filled in later by the caller.
 
-U32 * trickyGetPairsFromWindow (U8 * window, Long k, Long numPairsToGet, Long emptySpace) {
+U32 * trickyGetPairsFromWindow (U8 * window, Long k, Long numPairsToGet, Long emptySpace, const fm85Allocator * allocator) {
   Long outputLength = emptySpace + numPairsToGet;
-  U32 * pairs = (U32 *) fm85alloc ((size_t) (outputLength * sizeof(U32)));
+  U32 * pairs = (U32 *) fm85allocWith (allocator, (size_t) (outputLength * sizeof(U32)));
   if (pairs == NULL) throw std::bad_alloc();
   Long rowIndex = 0;
   Long pairIndex = emptySpace;
@@ -641,7 +606,7 @@ void compressHybridFlavor (FM85 * target, FM85 * source) {
   if (source->windowOffset != 0) throw std::logic_error("source->windowOffset != 0");
   Long numPairsFromArray = source->numCoupons - numPairsFromTable; // because the window offset is zero
 
-  U32 * allPairs = trickyGetPairsFromWindow (source->slidingWindow, k, numPairsFromArray, numPairsFromTable);
+  U32 * allPairs = trickyGetPairsFromWindow (source->slidingWindow, k, numPairsFromArray, numPairsFromTable, &source->allocator);
 
   u32Merge (pairsFromTable, 0, numPairsFromTable,
 	    allPairs, numPairsFromTable, numPairsFromArray,
@@ -650,8 +615,8 @@ void compressHybridFlavor (FM85 * target, FM85 * source) {
   //  for (i = 0; i < source->numCoupons-1; i++) { assert (allPairs[i] < allPairs[i+1]); }
 
   compressTheSurprisingValues (target, source, allPairs, source->numCoupons);
-  if (pairsFromTable) fm85free (pairsFromTable);
-  fm85free (allPairs);
+  if (pairsFromTable) fm85freeWith (&source->allocator, pairsFromTable);
+  fm85freeWith (&source->allocator, allPairs);
   return;
 }
 
@@ -668,7 +633,7 @@ void uncompressHybridFlavor (FM85 * target, FM85 * source) {
 
   Long k = (1LL << source->lgK);
 
-  U8 * window = (U8 *) fm85alloc ((size_t) (k * sizeof(U8)));
+  U8 * window = (U8 *) fm85allocWith (&source->allocator, (size_t) (k * sizeof(U8)));
   if (window == NULL) throw std::bad_alloc();
   bzero ((void *) window, (size_t) k); // important: zero the memory
   
@@ -693,11 +658,12 @@ void uncompressHybridFlavor (FM85 * target, FM85 * source) {
 
   u32Table * table = makeU32TableFromPairsArray (pairs, 
 						 nextTruePair,
-						 source->lgK);
+						 source->lgK,
+						 &source->allocator);
   target->surprisingValueTable = table;
   target->slidingWindow = window;
 
-  fm85free (pairs);
+  fm85freeWith (&source->allocator, pairs);
 
   return;
 }
@@ -727,7 +693,7 @@ void compressPinnedFlavor (FM85 * target, FM85 * source) {
 
     introspectiveInsertionSort(pairs, 0, numPairs-1);
     compressTheSurprisingValues (target, source, pairs, numPairs);
-    if (pairs) fm85free (pairs);
+    if (pairs) fm85freeWith (&source->allocator, pairs);
   }
   return;
 }
@@ -739,7 +705,7 @@ void uncompressPinnedFlavor (FM85 * target, FM85 * source) {
   uncompressTheWindow (target, source);
   Long numPairs = source->numCompressedSurprisingValues;
   if (numPairs == 0) {
-    target->surprisingValueTable = u32TableMake (2, 6 + source->lgK);
+    target->surprisingValueTable = u32TableMake (2, 6 + source->lgK, &source->allocator);
   }
   else {
     if (numPairs <= 0) throw std::logic_error("numPairs <= 0");
@@ -750,9 +716,9 @@ void uncompressPinnedFlavor (FM85 * target, FM85 * source) {
       if ((pairs[i] & 63) >= 56) throw std::logic_error("(pairs[i] & 63) >= 56");
       pairs[i] += 8; 
     }
-    u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, source->lgK);
+    u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, source->lgK, &source->allocator);
     target->surprisingValueTable = table;
-    fm85free (pairs);
+    fm85freeWith (&source->allocator, pairs);
   }
   return;
 }
@@ -777,7 +743,7 @@ void compressSlidingFlavor (FM85 * target, FM85 * source) {
 
     Short pseudoPhase = determinePseudoPhase (source->lgK, source->numCoupons); // NB
     if (pseudoPhase >= 16) throw std::logic_error("pseudoPhase >= 16");
-    U8 * permutation = columnPermutationsForEncoding[pseudoPhase];
+    const U8 * permutation = columnPermutationsForEncoding[pseudoPhase];
 
     Short offset = source->windowOffset;
     if (offset <= 0 || offset > 56) throw std::out_of_range("offset out of range");
@@ -797,7 +763,7 @@ void compressSlidingFlavor (FM85 * target, FM85 * source) {
 
     introspectiveInsertionSort(pairs, 0, numPairs-1);
     compressTheSurprisingValues (target, source, pairs, numPairs);
-    if (pairs) fm85free (pairs);
+    if (pairs) fm85freeWith (&source->allocator, pairs);
   }
   return;
 }
@@ -810,7 +776,7 @@ void uncompressSlidingFlavor (FM85 * target, FM85 * source) {
 
   Long numPairs = source->numCompressedSurprisingValues;
   if (numPairs == 0) {
-    target->surprisingValueTable = u32TableMake (2, 6 + source->lgK);
+    target->surprisingValueTable = u32TableMake (2, 6 + source->lgK, &source->allocator);
   }
   else {
     if (numPairs <= 0) throw std::logic_error("numPairs <= 0");
@@ -819,7 +785,7 @@ void uncompressSlidingFlavor (FM85 * target, FM85 * source) {
 
     Short pseudoPhase = determinePseudoPhase (source->lgK, source->numCoupons); // NB
     if (pseudoPhase >= 16) throw std::logic_error("pseudoPhase >= 16");
-    U8 * permutation = columnPermutationsForDecoding[pseudoPhase];
+    const U8 * permutation = columnPermutationsForDecoding[pseudoPhase];
 
     Short offset = source->windowOffset;
     if (offset <= 0 || offset > 56) throw std::out_of_range("offset out of range");
@@ -836,10 +802,10 @@ void uncompressSlidingFlavor (FM85 * target, FM85 * source) {
       pairs[i] = (U32) ((row << 6) | col);
     }
 
-    u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, source->lgK);
+    u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, source->lgK, &source->allocator);
     target->surprisingValueTable = table;
 
-    fm85free (pairs);
+    fm85freeWith (&source->allocator, pairs);
   }
   return;
 }
@@ -852,7 +818,7 @@ void uncompressSlidingFlavor (FM85 * target, FM85 * source) {
 FM85 * fm85Compress (FM85 * source) {
   if (source->isCompressed != 0) throw std::invalid_argument("already compressed");
 
-  FM85 * target = (FM85 *) fm85alloc (sizeof(FM85));
+  FM85 * target = (FM85 *) fm85allocWith (&source->allocator, sizeof(FM85));
   if (target == NULL) throw std::bad_alloc();
 
   target->lgK = source->lgK;
@@ -863,6 +829,7 @@ FM85 * fm85Compress (FM85 * source) {
   target->kxp = source->kxp;
   target->hipEstAccum = source->hipEstAccum;
   target->hipErrAccum = source->hipErrAccum;
+  target->allocator = source->allocator;
 
   target->isCompressed = 1;
 
@@ -913,7 +880,7 @@ FM85 * fm85Compress (FM85 * source) {
 FM85 * fm85Uncompress (FM85 * source) {
   if (source->isCompressed != 1) throw std::invalid_argument("not compressed");
 
-  FM85 * target = (FM85 *) fm85alloc (sizeof(FM85));
+  FM85 * target = (FM85 *) fm85allocWith (&source->allocator, sizeof(FM85));
   if (target == NULL) throw std::bad_alloc();
 
   target->lgK = source->lgK;
@@ -924,6 +891,7 @@ FM85 * fm85Uncompress (FM85 * source) {
   target->kxp = source->kxp;
   target->hipEstAccum = source->hipEstAccum;
   target->hipErrAccum = source->hipErrAccum;
+  target->allocator = source->allocator;
 
   target->isCompressed = 0;
 
@@ -958,3 +926,88 @@ FM85 * fm85Uncompress (FM85 * source) {
 
   return target;
 }
+
+/***************************************************************/
+/***************************************************************/
+// This is the inverse of the compression logic above, except that instead of building
+// the window and the hash table of an updateable sketch, the coupons go straight
+// into the rows of the destination. Only the window (k bytes) and the pairs need temporary buffers.
+
+void orCompressedSketchIntoMatrix (U64 * destMatrix, Short destLgK, FM85 * source, U8 * windowBuffer, U32 * pairsBuffer) {
+  if (source->isCompressed != 1) throw std::invalid_argument("not compressed");
+  if (destLgK > source->lgK) throw std::logic_error("destLgK > source->lgK");
+  Long k = (1LL << source->lgK);
+  Long destK = (1LL << destLgK);
+  Long destMask = destK - 1LL; // downsamples when destLgK < srcLgK
+  enum flavorType flavor = determineSketchFlavor(source);
+  if (flavor == EMPTY) return;
+
+  Long numPairs = (source->compressedSurprisingValues == NULL) ? 0 : source->numCompressedSurprisingValues;
+  U32 * pairs = NULL;
+  if (numPairs > 0) {
+    if (pairsBuffer != NULL) {
+      uncompressTheSurprisingValuesInto (source, pairsBuffer);
+      pairs = pairsBuffer;
+    }
+    else {
+      pairs = uncompressTheSurprisingValues (source);
+    }
+  }
+  U32 * pairsToFree = (pairsBuffer == NULL) ? pairs : NULL;
+  Long i;
+
+  if (flavor == SPARSE || flavor == HYBRID) { // in the hybrid flavor the window is stored as pairs
+    if (source->compressedWindow != NULL) throw std::logic_error("source->compressedWindow != NULL");
+    for (i = 0; i < numPairs; i++) {
+      U32 rowCol = pairs[i];
+      destMatrix[((Long) (rowCol >> 6)) & destMask] |= (1ULL << (rowCol & 63));
+    }
+    if (pairsToFree) fm85freeWith (&source->allocator, pairsToFree);
+    return;
+  }
+
+  if (source->compressedWindow == NULL) throw std::logic_error("source->compressedWindow == NULL");
+  U8 * window = windowBuffer;
+  if (window == NULL) window = (U8 *) fm85allocWith (&source->allocator, (size_t) (k * sizeof(U8)));
+  if (window == NULL) {
+    if (pairsToFree) fm85freeWith (&source->allocator, pairsToFree);
+    throw std::bad_alloc();
+  }
+  Short pseudoPhase = determinePseudoPhase (source->lgK, source->numCoupons);
+  lowLevelUncompressBytes (window, k, decodingTablesForHighEntropyByte[pseudoPhase],
+                           source->compressedWindow, source->cwLength);
+
+  if (flavor == PINNED) {
+    if (source->windowOffset != 0) throw std::logic_error("source->windowOffset != 0");
+    Long block;
+    for (block = 0; block < k; block += destK) { orWindowRows (destMatrix, window + block, destK, 0); }
+    for (i = 0; i < numPairs; i++) { // undo the compressor's 8-column shift
+      U32 rowCol = pairs[i] + 8;
+      destMatrix[((Long) (rowCol >> 6)) & destMask] |= (1ULL << (rowCol & 63));
+    }
+  }
+  else { // SLIDING
+    // Below the window a surprising value is a MISSING coupon, so each source row
+    // has to be assembled completely before it can be OR'ed into the destination.
+    // The compressor sorted the pairs, so they arrive grouped by row.
+    const U8 * permutation = columnPermutationsForDecoding[pseudoPhase];
+    Short offset = source->windowOffset;
+    if (offset <= 0 || offset > 56) throw std::out_of_range("offset out of range");
+    U64 earlyZone = (1ULL << offset) - 1;
+    Long row, nextPair = 0;
+    for (row = 0; row < k; row++) {
+      U64 bits = earlyZone | (((U64) window[row]) << offset);
+      while (nextPair < numPairs && ((Long) (pairs[nextPair] >> 6)) == row) {
+        Short col = (Short) (pairs[nextPair++] & 63);
+        col = permutation[col]; // undo the permutation
+        col = (col + (offset+8)) & 63; // then undo the rotation
+        bits ^= (1ULL << col);
+      }
+      destMatrix[row & destMask] |= bits;
+    }
+    if (nextPair != numPairs) throw std::logic_error("nextPair != numPairs");
+  }
+
+  if (windowBuffer == NULL) fm85freeWith (&source->allocator, window);
+  if (pairsToFree) fm85freeWith (&source->allocator, pairsToFree);
+}
@@ -9,16 +9,55 @@
 
 #include <stdexcept>
 #include <new>
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
 
-UG85 * ug85Make (Short lgK) {
+UG85 * ug85Make (Short lgK, const fm85Allocator * allocator) {
   if (lgK < 4) throw std::invalid_argument("lgK < 4");
-  UG85 * self = (UG85 *) fm85alloc (sizeof(UG85));
+  UG85 * self = (UG85 *) fm85allocWith (allocator, sizeof(UG85));
   if (self == NULL) throw std::bad_alloc();
   self->lgK = lgK;
+  self->initialLgK = lgK;
+  self->allocator = *allocator;
+  self->numThreads = 1;
+  self->bitMatrix = NULL;
+  self->matrixBuffer = NULL;
+  self->matrixBufferRows = 0;
+  self->scratchBuffer = NULL;
+  self->scratchBufferRows = 0;
+  self->spareAccumulator = NULL;
   // We begin with the accumulator holding an EMPTY sketch object.
   // As an optimization the accumulator could start as NULL, but that would require changes elsewhere.
-  self->accumulator = fm85Make (lgK);
-  self->bitMatrix = NULL;
+  try {
+    self->accumulator = fm85Make (lgK, allocator);
+  } catch (...) {
+    fm85freeWith (allocator, self);
+    throw;
+  }
+  return (self);
+}
+
+/*******************************************************************************************/
+
+UG85 * ug85Copy (UG85 * other) {
+  if (other == NULL) throw std::invalid_argument("other is null");
+  UG85 * self = (UG85 *) shallowCopy ((void *) other, sizeof(UG85), &other->allocator);
+  // the buffers are not shared
+  self->matrixBuffer = NULL;
+  self->matrixBufferRows = 0;
+  self->scratchBuffer = NULL;
+  self->scratchBufferRows = 0;
+  self->spareAccumulator = NULL;
+  if (other->accumulator != NULL) self->accumulator = fm85Copy (other->accumulator, &other->allocator);
+  if (other->bitMatrix != NULL) {
+    Long k = (1LL << other->lgK);
+    self->matrixBuffer = (U64 *) shallowCopy ((void *) other->bitMatrix, (size_t) (k * sizeof(U64)), &other->allocator);
+    self->matrixBufferRows = k;
+    self->bitMatrix = self->matrixBuffer;
+  }
   return (self);
 }
 
@@ -26,10 +65,130 @@ UG85 * ug85Make (Short lgK) {
 
 void ug85Free (UG85 * self) {
   if (self != NULL) {
+    fm85Allocator allocator = self->allocator; // the gadget itself is freed last
     if (self->accumulator != NULL) { fm85Free (self->accumulator); }
-    if (self->bitMatrix != NULL) { fm85free (self->bitMatrix); }
-    fm85free (self);
+    if (self->spareAccumulator != NULL) { fm85Free (self->spareAccumulator); }
+    if (self->matrixBuffer != NULL) { fm85freeWith (&allocator, self->matrixBuffer); }
+    if (self->scratchBuffer != NULL) { fm85freeWith (&allocator, self->scratchBuffer); }
+    fm85freeWith (&allocator, self);
+  }
+}
+
+/*******************************************************************************************/
+
+void ug85SetNumThreads (UG85 * self, Short numThreads) {
+  if (numThreads < 1) throw std::invalid_argument("numThreads < 1");
+  self->numThreads = numThreads;
+}
+
+/*******************************************************************************************/
+
+// Splits the rows [0, numRows) into contiguous ranges, one per thread, and calls fn (begin, end, part)
+// for each of them. The calling thread handles the first range.
+// Range boundaries are multiples of 64 rows so that the vectorized loops never see a partial block.
+// The started threads are always joined, and the first exception thrown by a range is rethrown
+// once they have all finished.
+
+struct RowRangeThreads {
+  std::vector<std::thread> threads;
+  ~RowRangeThreads () {
+    for (std::thread & thread : threads) if (thread.joinable ()) thread.join ();
+  }
+};
+
+static void forEachRowRange (Long numRows, Short numThreads, const std::function<void(Long, Long, Short)> & fn) {
+  Long rowsPerPart = ((numRows / numThreads) + 63) & ~63LL;
+  if (numThreads <= 1 || rowsPerPart >= numRows) { fn (0, numRows, 0); return; }
+  Long numParts = (numRows + rowsPerPart - 1) / rowsPerPart;
+  std::vector<std::exception_ptr> errors (numParts);
+  auto runPart = [&fn, &errors] (Long begin, Long end, Short part) {
+    try { fn (begin, end, part); }
+    catch (...) { errors[part] = std::current_exception (); }
+  };
+  {
+    RowRangeThreads started; // joins on the way out, even if starting a thread fails
+    started.threads.reserve (numParts - 1);
+    Short part = 1;
+    Long begin;
+    for (begin = rowsPerPart; begin < numRows; begin += rowsPerPart, part++) {
+      Long end = begin + rowsPerPart < numRows ? begin + rowsPerPart : numRows;
+      started.threads.push_back (std::thread (runPart, begin, end, part));
+    }
+    runPart (0, rowsPerPart, 0);
+  }
+  for (std::exception_ptr & error : errors) if (error) std::rethrow_exception (error);
+}
+
+static Short numThreadsForLgK (UG85 * unioner, Short lgK) {
+  return lgK >= UG85_MIN_LGK_FOR_THREADS ? unioner->numThreads : 1;
+}
+
+/*******************************************************************************************/
+
+// Returns a kept buffer of at least numRows 64-bit rows (not cleared). It is only reallocated
+// if it is too small, or more than UG85_SHRINK_FACTOR times too big. A buffer of up to k rows
+// is never too big, since that is what merging a SLIDING source takes, and the bulk SPARSE path
+// asks for only about 3k/32 rows of the same buffer.
+
+static U64 * ug85ReuseBuffer (UG85 * unioner, U64 ** buffer, Long * bufferRows, Long numRows) {
+  Long maxRows = UG85_SHRINK_FACTOR * numRows;
+  if (maxRows < (1LL << unioner->lgK)) maxRows = 1LL << unioner->lgK;
+  if (*buffer != NULL && (*bufferRows < numRows || *bufferRows > maxRows)) {
+    fm85freeWith (&unioner->allocator, *buffer);
+    *buffer = NULL;
+    *bufferRows = 0;
+  }
+  if (*buffer == NULL) {
+    *buffer = (U64 *) fm85allocWith (&unioner->allocator, (size_t) (numRows * sizeof(U64)));
+    if (*buffer == NULL) throw std::bad_alloc();
+    *bufferRows = numRows;
+  }
+  return (*buffer);
+}
+
+// The bitMatrix (k rows at the current lgK) lives in the matrix buffer.
+
+static U64 * ug85AcquireBitMatrix (UG85 * unioner) {
+  if (unioner->bitMatrix != NULL) throw std::logic_error("unioner->bitMatrix != NULL");
+  unioner->bitMatrix = ug85ReuseBuffer (unioner, &unioner->matrixBuffer, &unioner->matrixBufferRows, 1LL << unioner->lgK);
+  return (unioner->bitMatrix);
+}
+
+// The accumulator is emptied and kept for the next ug85Reset.
+
+static void ug85ReleaseAccumulator (UG85 * unioner) {
+  FM85 * accumulator = unioner->accumulator;
+  unioner->accumulator = NULL;
+  if (unioner->spareAccumulator == NULL) {
+    fm85Reset (accumulator, accumulator->lgK);
+    unioner->spareAccumulator = accumulator;
   }
+  else {
+    fm85Free (accumulator);
+  }
+}
+
+static void ug85ConvertAccumulatorToBitMatrix (UG85 * unioner) {
+  if (unioner->accumulator->lgK != unioner->lgK) throw std::logic_error("unioner->accumulator->lgK != unioner->lgK");
+  fillBitMatrixOfSketch (unioner->accumulator, ug85AcquireBitMatrix (unioner));
+  ug85ReleaseAccumulator (unioner);
+}
+
+/*******************************************************************************************/
+
+void ug85Reset (UG85 * unioner) {
+  unioner->bitMatrix = NULL; // the matrix buffer is kept
+  if (unioner->accumulator == NULL) {
+    if (unioner->spareAccumulator != NULL) {
+      unioner->accumulator = unioner->spareAccumulator;
+      unioner->spareAccumulator = NULL;
+    }
+    else {
+      unioner->accumulator = fm85Make (unioner->initialLgK, &unioner->allocator);
+    }
+  }
+  fm85Reset (unioner->accumulator, unioner->initialLgK);
+  unioner->lgK = unioner->initialLgK;
 }
 
 /*******************************************************************************************/
@@ -76,6 +235,31 @@ void walkTableUpdatingSketch (FM85 * dest, u32Table * table) {
 
 /*******************************************************************************************/
 
+// The pairs of a compressed sketch are sorted, which would cause the snowplow effect
+// if they were inserted in order, so they are visited with a golden ratio stride instead.
+
+void walkPairsUpdatingSketch (FM85 * dest, U32 * pairs, Long numPairs) {
+  if (dest->lgK > 26) throw std::logic_error("dest->lgK > 26");
+  U32 destMask = (((1 << dest->lgK) - 1) << 6) | 63;  // downsamples when destlgK < srcLgK
+  double golden = 0.6180339887498949025;
+  Long stride = (Long) (golden * ((double) numPairs));
+  if (stride < 1) stride = 1;
+  Long a = stride, b = numPairs; // make the stride coprime with numPairs so that every pair is visited
+  while (b != 0) { Long t = a % b; a = b; b = t; }
+  while (a != 1) {
+    stride++;
+    a = stride; b = numPairs;
+    while (b != 0) { Long t = a % b; a = b; b = t; }
+  }
+  Long i,j;
+  for (i = 0, j = 0; i < numPairs; i++, j += stride) {
+    if (j >= numPairs) j -= numPairs;
+    fm85RowColUpdate (dest, pairs[j] & destMask);
+  }
+}
+
+/*******************************************************************************************/
+
 void orTableIntoMatrix (U64 * bitMatrix, Short destLgK, u32Table * table) {
   U32 * slots = table->slots;
   Long numSlots = (1LL << table->lgSize); 
@@ -93,26 +277,45 @@ void orTableIntoMatrix (U64 * bitMatrix, Short destLgK, u32Table * table) {
 
 /*******************************************************************************************/
 
-void orWindowIntoMatrix (U64 * destMatrix, Short destLgK, U8 * srcWindow, Short srcOffset, Short srcLgK) {
+// The source rows are processed in blocks of destK rows (which downsamples when destLgK < srcLgK),
+// and each thread owns a range of destination rows, so no synchronization is needed.
+
+void orWindowIntoMatrix (U64 * destMatrix, Short destLgK, U8 * srcWindow, Short srcOffset, Short srcLgK, Short numThreads) {
   if (destLgK > srcLgK) throw std::logic_error("destLgK > srcLgK");
-  Long destMask = (1LL << destLgK) - 1LL;  // downsamples when destlgK < srcLgK
+  Long destK = (1LL << destLgK);
   Long srcK = (1LL << srcLgK);
-  Long srcRow = 0;
-  for (srcRow = 0; srcRow < srcK; srcRow++) {
-    destMatrix[srcRow & destMask] |= (((U64) srcWindow[srcRow]) << srcOffset);
-  }
+  forEachRowRange (destK, numThreads, [=] (Long begin, Long end, Short part) {
+    Long block;
+    for (block = 0; block < srcK; block += destK) {
+      orWindowRows (destMatrix + begin, srcWindow + block + begin, end - begin, srcOffset);
+    }
+  });
 }
 
 /*******************************************************************************************/
 
-void orMatrixIntoMatrix (U64 * destMatrix, Short destLgK, U64 * srcMatrix, Short srcLgK) {
+void orMatrixIntoMatrix (U64 * destMatrix, Short destLgK, U64 * srcMatrix, Short srcLgK, Short numThreads) {
   if (destLgK > srcLgK) throw std::logic_error("destLgK > srcLgK");
-  Long destMask = (1LL << destLgK) - 1LL; // downsamples when destlgK < srcLgK
+  Long destK = (1LL << destLgK);
   Long srcK = (1LL << srcLgK);
-  Long srcRow = 0;
-  for (srcRow = 0; srcRow < srcK; srcRow++) {
-    destMatrix[srcRow & destMask] |= srcMatrix[srcRow];
-  }
+  forEachRowRange (destK, numThreads, [=] (Long begin, Long end, Short part) {
+    Long block;
+    for (block = 0; block < srcK; block += destK) {
+      orMatrixRows (destMatrix + begin, srcMatrix + block + begin, end - begin);
+    }
+  });
+}
+
+/*******************************************************************************************/
+
+static Long countBitsSetInMatrixUsingThreads (U64 * matrix, Long k, Short numThreads) {
+  std::vector<Long> counts (numThreads, 0);
+  forEachRowRange (k, numThreads, [&] (Long begin, Long end, Short part) {
+    counts[part] = countBitsSetInMatrix (matrix + begin, end - begin);
+  });
+  Long total = 0;
+  for (Long count : counts) total += count;
+  return total;
 }
 
 /*******************************************************************************************/
@@ -123,14 +326,9 @@ void ug85ReduceK (UG85 * unioner, Short newLgK) {
 
   if (unioner->bitMatrix != NULL) { // downsample the unioner's bit matrix
     if (unioner->accumulator != NULL) throw std::logic_error("accumulator is not null");
-    Long newK = (1LL << newLgK);
-    U64 * newMatrix = (U64 *) fm85alloc ((size_t) (newK * sizeof(U64)));
-    if (newMatrix == NULL) throw std::bad_alloc();
-    Long i = 0;
-    for (i = 0; i < newK; i++) { newMatrix[i] = 0LL; } // clear the bit matrix
-    orMatrixIntoMatrix (newMatrix, newLgK, unioner->bitMatrix, unioner->lgK);
-    fm85free (unioner->bitMatrix);
-    unioner->bitMatrix = newMatrix;
+    // This works in place, since OR'ing the first block of rows into itself changes nothing.
+    // The buffer keeps its size.
+    orMatrixIntoMatrix (unioner->bitMatrix, newLgK, unioner->bitMatrix, unioner->lgK, numThreadsForLgK (unioner, newLgK));
     unioner->lgK = newLgK;
     return;
   }
@@ -146,7 +344,7 @@ void ug85ReduceK (UG85 * unioner, Short newLgK) {
       return;
     }
 
-    FM85 * newSketch = fm85Make (newLgK);
+    FM85 * newSketch = fm85Make (newLgK, &unioner->allocator);
     if (oldSketch->slidingWindow != NULL || oldSketch->surprisingValueTable == NULL) throw std::logic_error("invalid state");
     walkTableUpdatingSketch (newSketch, oldSketch->surprisingValueTable);
 
@@ -159,11 +357,10 @@ void ug85ReduceK (UG85 * unioner, Short newLgK) {
       return;
     }
     else { // the new sketch has graduated beyond sparse, so convert to bitMatrix
-      unioner->accumulator = NULL;
-      unioner->bitMatrix = bitMatrixOfSketch (newSketch);
+      unioner->accumulator = newSketch;
       unioner->lgK = newLgK;
       fm85Free (oldSketch);
-      fm85Free (newSketch);
+      ug85ConvertAccumulatorToBitMatrix (unioner);
       return;
     }
   }
@@ -173,6 +370,20 @@ void ug85ReduceK (UG85 * unioner, Short newLgK) {
 
 /*******************************************************************************************/
 
+// Source is past SPARSE mode, so make sure that the unioner is a bitMatrix.
+
+static void ug85SwitchToBitMatrix (UG85 * unioner) {
+  if (unioner->accumulator != NULL) {
+    if (unioner->bitMatrix != NULL) throw std::logic_error("unioner->bitMatrix != NULL");
+    enum flavorType destFlavor = determineSketchFlavor (unioner->accumulator);
+    if (EMPTY != destFlavor && SPARSE != destFlavor) throw std::logic_error("wrong flavor");
+    ug85ConvertAccumulatorToBitMatrix (unioner);
+  }
+  if (unioner->bitMatrix == NULL) throw std::logic_error("unioner->bitMatrix == NULL");
+}
+
+/*******************************************************************************************/
+
 void ug85MergeInto (UG85 * unioner, FM85 * source) {
   if (NULL == unioner) throw std::invalid_argument("unioner is null");
   if (NULL == source) return;
@@ -195,16 +406,14 @@ void ug85MergeInto (UG85 * unioner, FM85 * source) {
     // A complete fix is coming soon.
     if (EMPTY == initialDestFlavor && unioner->lgK == source->lgK) { 
       fm85Free (unioner->accumulator);      
-      unioner->accumulator = fm85Copy(source);
+      unioner->accumulator = fm85Copy(source, &unioner->allocator);
     }
 
     walkTableUpdatingSketch (unioner->accumulator, source->surprisingValueTable);
     enum flavorType finalDestFlavor = determineSketchFlavor(unioner->accumulator);
     // if the accumulator has graduated beyond sparse, switch to a bitMatrix representation
     if (finalDestFlavor != EMPTY && finalDestFlavor != SPARSE) {
-      unioner->bitMatrix = bitMatrixOfSketch (unioner->accumulator);
-      fm85Free (unioner->accumulator);
-      unioner->accumulator = NULL;
+      ug85ConvertAccumulatorToBitMatrix (unioner);
     }
     return;
   }
@@ -217,19 +426,11 @@ void ug85MergeInto (UG85 * unioner, FM85 * source) {
 
   if (HYBRID != sourceFlavor && PINNED != sourceFlavor && SLIDING != sourceFlavor) throw std::logic_error("wrong flavor");
 
- // source is past SPARSE mode, so make sure that dest is a bitMatrix.
-  if (unioner->accumulator != NULL) {
-    if (unioner->bitMatrix != NULL) throw std::logic_error("unioner->bitMatrix != NULL");
-    enum flavorType destFlavor = determineSketchFlavor (unioner->accumulator);
-    if (EMPTY != destFlavor && SPARSE != destFlavor) throw std::logic_error("wrong flavor");
-    unioner->bitMatrix = bitMatrixOfSketch (unioner->accumulator);
-    fm85Free (unioner->accumulator);
-    unioner->accumulator = NULL;
-  }
-  if (unioner->bitMatrix == NULL) throw std::logic_error("unioner->bitMatrix == NULL");
+  ug85SwitchToBitMatrix (unioner);
 
   if (HYBRID == sourceFlavor || PINNED == sourceFlavor) { // Case C
-    orWindowIntoMatrix (unioner->bitMatrix, unioner->lgK, source->slidingWindow, source->windowOffset, source->lgK);
+    orWindowIntoMatrix (unioner->bitMatrix, unioner->lgK, source->slidingWindow, source->windowOffset, source->lgK,
+                        numThreadsForLgK (unioner, unioner->lgK));
     orTableIntoMatrix (unioner->bitMatrix, unioner->lgK, source->surprisingValueTable);
     return;
   }
@@ -237,15 +438,189 @@ void ug85MergeInto (UG85 * unioner, FM85 * source) {
   // SLIDING mode involves inverted logic, so we can't just walk the source sketch.
   // Instead, we convert it to a bitMatrix that can be OR'ed into the destination.
   if (SLIDING != sourceFlavor) throw std::logic_error("wrong flavor"); // Case D
-  U64 * sourceMatrix = bitMatrixOfSketch (source);
-  orMatrixIntoMatrix (unioner->bitMatrix, unioner->lgK, sourceMatrix, source->lgK);
-  fm85free (sourceMatrix);
+  U64 * sourceMatrix = ug85ReuseBuffer (unioner, &unioner->scratchBuffer, &unioner->scratchBufferRows, 1LL << source->lgK);
+  fillBitMatrixOfSketch (source, sourceMatrix);
+  orMatrixIntoMatrix (unioner->bitMatrix, unioner->lgK, sourceMatrix, source->lgK, numThreadsForLgK (unioner, unioner->lgK));
 
   return;
 }
 
 /*******************************************************************************************/
 
+// The same cases as above, but the source stays compressed.
+// Cases A and B walk the decompressed pairs. In cases C and D the compressed
+// window and pairs are decoded straight into the unioner's bitMatrix.
+
+void ug85MergeCompressedInto (UG85 * unioner, FM85 * source) {
+  if (NULL == unioner) throw std::invalid_argument("unioner is null");
+  if (NULL == source) return;
+  if (source->isCompressed != 1) throw std::invalid_argument("not compressed");
+
+  enum flavorType sourceFlavor = determineSketchFlavor(source);
+  if (EMPTY == sourceFlavor) return;
+
+  if (source->lgK < unioner->lgK) { ug85ReduceK (unioner, source->lgK); }
+
+  if (source->lgK < unioner->lgK) throw std::logic_error("source->lgK < unioner->lgK");
+
+  if (unioner->accumulator == NULL && unioner->bitMatrix == NULL) throw std::logic_error("both accumulator and bitMatrix are null");
+
+  // The scratch buffer holds the window (k bytes) followed by the pairs. It is sized for the pairs
+  // of any HYBRID source (fewer than k/2), so that sources of different flavors do not keep
+  // shrinking and growing it.
+  Long k = (1LL << source->lgK);
+  Long numPairs = (source->compressedSurprisingValues == NULL) ? 0 : source->numCompressedSurprisingValues;
+  Long windowRows = (k + 7) / 8;
+  Long pairRows = ((numPairs > k / 2 ? numPairs : k / 2) + 1) / 2;
+  U64 * scratch = ug85ReuseBuffer (unioner, &unioner->scratchBuffer, &unioner->scratchBufferRows, windowRows + pairRows);
+  U32 * pairsBuffer = (U32 *) (scratch + windowRows);
+
+  if (SPARSE == sourceFlavor && unioner->accumulator != NULL)  { // Case A
+    if (unioner->bitMatrix != NULL) throw std::logic_error("unioner->bitMatrix != NULL");
+    uncompressTheSurprisingValuesInto (source, pairsBuffer);
+    // the accumulator's hash table is still allocated (and grown) as the pairs are added
+    walkPairsUpdatingSketch (unioner->accumulator, pairsBuffer, numPairs);
+    enum flavorType finalDestFlavor = determineSketchFlavor(unioner->accumulator);
+    // if the accumulator has graduated beyond sparse, switch to a bitMatrix representation
+    if (finalDestFlavor != EMPTY && finalDestFlavor != SPARSE) ug85ConvertAccumulatorToBitMatrix (unioner);
+    return;
+  }
+
+  // Cases B, C and D
+  ug85SwitchToBitMatrix (unioner);
+  orCompressedSketchIntoMatrix (unioner->bitMatrix, unioner->lgK, source, (U8 *) scratch, pairsBuffer);
+}
+
+/*******************************************************************************************/
+
+// Sorts and deduplicates the gathered pairs, returning the new count.
+
+static Long sortAndDedupPairs (U32 * pairs, Long numPairs) {
+  std::sort (pairs, pairs + numPairs);
+  return (Long) (std::unique (pairs, pairs + numPairs) - pairs);
+}
+
+static void orPairsIntoMatrix (U64 * bitMatrix, U32 * pairs, Long numPairs) {
+  Long i;
+  for (i = 0; i < numPairs; i++) {
+    U32 rowCol = pairs[i];
+    bitMatrix[rowCol >> 6] |= (1ULL << (rowCol & 63));
+  }
+}
+
+// Replaces the accumulator (whose pairs have all been gathered) with a bitMatrix made of the pairs.
+
+static void ug85SwitchToBitMatrixOfPairs (UG85 * unioner, U32 * pairs, Long numPairs) {
+  Long k = (1LL << unioner->lgK);
+  U64 * matrix = ug85AcquireBitMatrix (unioner);
+  memset ((void *) matrix, 0, (size_t) (k * sizeof(U64)));
+  orPairsIntoMatrix (matrix, pairs, numPairs);
+  ug85ReleaseAccumulator (unioner);
+}
+
+/*******************************************************************************************/
+
+// Merging many SPARSE sources one at a time re-inserts every coupon into the accumulator's
+// hash table, with repeated resizing and flavor checks. Instead, the rowCols of all of the sources
+// (and of the accumulator) are gathered into one buffer, sorted and deduplicated in bulk,
+// and the accumulator is rebuilt once at the end. The buffer holds twice the number of coupons
+// at which the accumulator would leave the SPARSE flavor, so whenever it fills up it is compacted.
+// If the distinct coupons ever reach that number, the unioner switches to a bitMatrix, and the
+// remaining sources are OR'ed into it directly (which is also what happens when any source
+// is beyond SPARSE, or the unioner already has a bitMatrix).
+
+void ug85MergeManyInto (UG85 * unioner, FM85 ** sources, Long numSources) {
+  if (NULL == unioner) throw std::invalid_argument("unioner is null");
+  if (unioner->accumulator == NULL && unioner->bitMatrix == NULL) throw std::logic_error("both accumulator and bitMatrix are null");
+
+  Short minLgK = unioner->lgK;
+  Boolean anyBeyondSparse = 0;
+  Long i;
+  for (i = 0; i < numSources; i++) {
+    FM85 * source = sources[i];
+    if (source == NULL || source->numCoupons == 0) continue;
+    if (source->isCompressed != 0) throw std::invalid_argument("compressed source");
+    if (source->lgK < minLgK) minLgK = source->lgK;
+    if (determineSketchFlavor(source) != SPARSE) anyBeyondSparse = 1;
+  }
+  if (minLgK < unioner->lgK) { ug85ReduceK (unioner, minLgK); } // only once
+
+  if (anyBeyondSparse) {
+    for (i = 0; i < numSources; i++) {
+      FM85 * source = sources[i];
+      if (source == NULL || source->numCoupons == 0 || determineSketchFlavor(source) == SPARSE) continue;
+      ug85MergeInto (unioner, source);
+    }
+    if (unioner->bitMatrix == NULL) throw std::logic_error("unioner->bitMatrix == NULL");
+  }
+
+  Short lgK = unioner->lgK;
+  i = 0;
+  if (unioner->accumulator != NULL) {
+    Long k = (1LL << lgK);
+    Long firstNonSparseCount = (3 * k - 1) / 32 + 1; // see determineFlavor()
+    Long capacity = 2 * firstNonSparseCount;
+    U32 * pairs = (U32 *) ug85ReuseBuffer (unioner, &unioner->scratchBuffer, &unioner->scratchBufferRows, (capacity + 1) / 2);
+    Long numPairs = 0;
+
+    FM85 * accumulator = unioner->accumulator;
+    if (accumulator->numCoupons > 0) {
+      Long numItems;
+      U32 * items = u32TableUnwrappingGetItems (accumulator->surprisingValueTable, &numItems);
+      memcpy ((void *) pairs, (void *) items, (size_t) (numItems * sizeof(U32)));
+      numPairs = numItems;
+      fm85freeWith (&unioner->allocator, items);
+    }
+
+    U32 destMask = (((1 << lgK) - 1) << 6) | 63;  // downsamples when destlgK < srcLgK
+    for (; i < numSources && unioner->accumulator != NULL; i++) {
+      FM85 * source = sources[i];
+      if (source == NULL || source->numCoupons == 0) continue;
+      u32Table * table = source->surprisingValueTable;
+      U32 * slots = table->slots;
+      Long numSlots = (1LL << table->lgSize);
+      Long j;
+      for (j = 0; j < numSlots; j++) {
+        if (slots[j] == ALL32BITS) continue;
+        if (numPairs == capacity) {
+          numPairs = sortAndDedupPairs (pairs, numPairs);
+          if (numPairs >= firstNonSparseCount) {
+            ug85SwitchToBitMatrixOfPairs (unioner, pairs, numPairs);
+            break;
+          }
+        }
+        pairs[numPairs++] = slots[j] & destMask;
+      }
+      if (unioner->accumulator == NULL) break; // the rest of this source is OR'ed below
+    }
+
+    if (unioner->accumulator != NULL) {
+      numPairs = sortAndDedupPairs (pairs, numPairs);
+      if (determineFlavor (lgK, numPairs) == SPARSE) { // rebuild the accumulator in one pass
+        u32Table * table = makeU32TableFromPairsArray (pairs, numPairs, lgK, &unioner->allocator);
+        FM85 * accumulator = unioner->accumulator;
+        fm85Reset (accumulator, lgK);
+        accumulator->surprisingValueTable = table;
+        accumulator->numCoupons = numPairs;
+        Long p;
+        for (p = 0; p < numPairs; p++) { accumulator->kxp -= invPow2Tab[(pairs[p] & 63) + 1]; }
+      }
+      else if (numPairs > 0) {
+        ug85SwitchToBitMatrixOfPairs (unioner, pairs, numPairs);
+      }
+    }
+  }
+
+  // the unioner is a bitMatrix, so the remaining sparse sources are simply OR'ed into it
+  for (; i < numSources; i++) {
+    FM85 * source = sources[i];
+    if (source == NULL || source->numCoupons == 0 || determineSketchFlavor(source) != SPARSE) continue;
+    orTableIntoMatrix (unioner->bitMatrix, lgK, source->surprisingValueTable);
+  }
+}
+
+/*******************************************************************************************/
+
 FM85 * ug85GetResult (UG85 * unioner) {
   if (unioner == NULL) throw std::invalid_argument("unioner == NULL");
   if (unioner->accumulator == NULL && unioner->bitMatrix == NULL) throw std::logic_error("both accumulator and bitMatrix are null");
@@ -254,12 +629,12 @@ FM85 * ug85GetResult (UG85 * unioner) {
     if (unioner->bitMatrix != NULL) throw std::logic_error("unioner->bitMatrix != NULL");
     if (unioner->lgK != unioner->accumulator->lgK) throw std::logic_error("unioner->lgK != unioner->accumulator->lgK");
     if (unioner->accumulator->numCoupons == 0) {
-      FM85 * result = fm85Make (unioner->lgK);
+      FM85 * result = fm85Make (unioner->lgK, &unioner->allocator);
       result->mergeFlag = 1;
       return (result);
     }
     if (SPARSE != determineSketchFlavor(unioner->accumulator)) throw std::logic_error("wrong flavor");
-    FM85 * result = fm85Copy (unioner->accumulator);
+    FM85 * result = fm85Copy (unioner->accumulator, &unioner->allocator);
     result->mergeFlag = 1;
     return (result);
   } // end of case where unioner contains a sketch
@@ -269,10 +644,10 @@ FM85 * ug85GetResult (UG85 * unioner) {
   if (unioner->accumulator != NULL) throw std::logic_error("unioner->accumulator != NULL");
   U64 * matrix = unioner->bitMatrix;
   Short lgK = unioner->lgK;
-  FM85 * result = fm85Make (unioner->lgK); 
+  FM85 * result = fm85Make (unioner->lgK, &unioner->allocator); 
 
   Long k = (1LL << lgK);
-  Long numCoupons = countBitsSetInMatrix (matrix, k);
+  Long numCoupons = countBitsSetInMatrixUsingThreads (matrix, k, numThreadsForLgK (unioner, lgK));
   result->numCoupons = numCoupons;
 
   enum flavorType flavor = determineFlavor (lgK, numCoupons);
@@ -281,7 +656,7 @@ FM85 * ug85GetResult (UG85 * unioner) {
   Short offset = determineCorrectOffset (lgK, numCoupons);
   result->windowOffset = offset;
 
-  U8 * window = (U8 *) fm85alloc ((size_t) (k * sizeof(U8)));
+  U8 * window = (U8 *) fm85allocWith (&unioner->allocator, (size_t) (k * sizeof(U8)));
   if (window == NULL) throw std::bad_alloc();
   // don't need to zero the window's memory
   if (result->slidingWindow != NULL) throw std::logic_error("result->slidingWindow != NULL");
@@ -290,7 +665,7 @@ FM85 * ug85GetResult (UG85 * unioner) {
   //  u32Table * table = u32TableMake (2, 6 + lgK); // dynamically growing caused snowplow effect
   Short newTableSize = lgK - 4; //   K/16; in some cases this will end up being oversized
   if (newTableSize < 2) newTableSize = 2;
-  u32Table * table = u32TableMake (newTableSize, 6 + lgK); 
+  u32Table * table = u32TableMake (newTableSize, 6 + lgK, &unioner->allocator); 
   if (result->surprisingValueTable != NULL) throw std::logic_error("result->surprisingValueTable != NULL");
   result->surprisingValueTable = table;
 
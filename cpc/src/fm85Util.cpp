@@ -10,13 +10,16 @@
 #include <stdexcept>
 #include <new>
 
-extern void* (*fm85alloc)(size_t);
+#if defined(__GNUC__) && defined(__x86_64__)
+#define FM85_X86_SIMD
+#include <immintrin.h>
+#endif
 
 /******************************************/
 
-void * shallowCopy (void * oldObject, size_t numBytes) {
+void * shallowCopy (void * oldObject, size_t numBytes, const fm85Allocator * allocator) {
   if (oldObject == NULL || numBytes == 0) throw std::invalid_argument("shallowCopyObject: bad argument");
-  void * newObject = fm85alloc (numBytes);
+  void * newObject = fm85allocWith (allocator, numBytes);
   if (newObject == NULL) throw std::bad_alloc();
   memcpy (newObject, oldObject, numBytes);
   return (newObject);
@@ -24,28 +27,9 @@ void * shallowCopy (void * oldObject, size_t numBytes) {
 
 /******************************************/
 
-U8 byteLeadingZerosTable[256];
+// The following lookup tables are in a separate file.
 
-U8 slow_count_leading_zeros_in_byte (U8 the_byte)
-{
-  int shift;
-  int count = 0;
-  for (shift = 7; shift >= 0; shift--) {
-    int is_zero = !((the_byte >> shift) & 1);
-    if (is_zero)
-      count++;
-    else
-      break;
-  }
-  return count;
-}
-
-void fillByteLeadingZerosTable(void)
-{
-  int j;
-  for (j = 0; j < 256; j++)
-    byteLeadingZerosTable[j] = slow_count_leading_zeros_in_byte ((U8) j);
-}
+#include "utilTables.data"
 
 /******************************************/
 
@@ -78,31 +62,6 @@ Short countLeadingZerosInUnsignedLong (U64 theInput) {
 
 /******************************************/
 
-U8 byteTrailingZerosTable[256];
-
-// U8 lookupByteTrailingZeros (int x) { return (byteTrailingZerosTable[x]); }
-
-U8 slow_count_trailing_zeros_in_byte (U8 the_byte)
-{
-  int shift;
-  int count = 0;
-  for (shift = 0; shift <= 7; shift++) {
-    int is_zero = !((the_byte >> shift) & 1);
-    if (is_zero)
-      count++;
-    else
-      break;
-  }
-  return count;
-}
-
-void fillByteTrailingZerosTable(void)
-{
-  int j;
-  for (j = 0; j < 256; j++)
-    byteTrailingZerosTable[j] = slow_count_trailing_zeros_in_byte ((U8) j);    
-}
-
 Short countTrailingZerosInUnsignedLong (U64 theInput) {
   U64 tmp = theInput;
   int byte;
@@ -115,38 +74,6 @@ Short countTrailingZerosInUnsignedLong (U64 theInput) {
   return ((Short) (64));
 }
 
-/******************************************/
-
-double invPow2Tab[256];
-
-void fillInvPow2Tab (void)
-{
-  int j;
-  for (j = 0; j < 256; j++) {
-    invPow2Tab[j] = pow (2.0, (-1.0 * ((double) j)));
-  }
-}
-
-/******************************************/
-
-double kxpByteLookup[256];
-
-void fillKxpByteLookup (void) // must call fillInvPow2Tab() first
-{
-  int byte, col;
-  for (byte = 0; byte < 256; byte++) {
-    double sum = 0.0;
-    for (col = 0; col < 8; col++) {
-      int bit = (byte >> col) & 1;
-      if (bit == 0) { // note the inverted logic
-	sum += invPow2Tab[col+1]; // note the "+1"
-      }
-    }      
-    kxpByteLookup[byte] = sum;
-  }
-}
-
-
 /******************************************/
 
 Long divideLongsRoundingUp (Long x, Long y) {
@@ -224,7 +151,7 @@ static inline Long warrenBitCount(U64 i) {
   return (Long)i & 0x7f;
 }
 
-Long warrenCountBitsSetInMatrix (U64 * array, Long length) {
+Long warrenCountBitsSetInMatrix (const U64 * array, Long length) {
   Long i = 0;
   Long count = 0;
   for (i = 0; i < length; i++) {
@@ -236,10 +163,11 @@ Long warrenCountBitsSetInMatrix (U64 * array, Long length) {
 /*******************************************************/
 // This code is Figure 5-9 in "Hacker's Delight" by Henry S. Warren.
 
+#ifndef FM85_X86_SIMD
+
 #define CSA(h,l,a,b,c) {U64 u = a^b; U64 v = c; h = (a&b) | (u&v); l = u^v;}
 
-Long countBitsSetInMatrix (U64 * A, Long length) {
-  if ((length & 0x7) != 0) throw std::invalid_argument("the length of the array must be a multiple of 8");
+static Long csaCountBitsSetInMatrix (const U64 * A, Long length) {
   Long tot, i;
   U64 ones, twos, twosA, twosB, fours, foursA, foursB, eights;
   tot = 0;
@@ -266,6 +194,159 @@ Long countBitsSetInMatrix (U64 * A, Long length) {
   return (tot);
 }
 
+#endif
+
+/*******************************************************/
+// Vectorized versions of the loops that dominate unioning in bitMatrix mode.
+// The AVX2 versions are chosen at run time if the CPU supports them.
+// SSE2 is always available on x86-64. Other platforms use the scalar loops.
+
+#ifdef FM85_X86_SIMD
+
+static inline int cpuHasAVX2 (void) {
+  static const int hasAVX2 = __builtin_cpu_supports ("avx2");
+  return hasAVX2;
+}
+
+// Wojciech Mula's nibble lookup popcount.
+__attribute__((target("avx2")))
+static Long avx2CountBitsSetInMatrix (const U64 * A, Long length) {
+  const __m256i lookup = _mm256_setr_epi8 (0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                           0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i lowMask = _mm256_set1_epi8 (0x0f);
+  const __m256i zero = _mm256_setzero_si256 ();
+  __m256i acc = zero;
+  Long i;
+  for (i = 0; i < length; i += 4) {
+    __m256i v = _mm256_loadu_si256 ((const __m256i *) (A + i));
+    __m256i lo = _mm256_and_si256 (v, lowMask);
+    __m256i hi = _mm256_and_si256 (_mm256_srli_epi16 (v, 4), lowMask);
+    __m256i counts = _mm256_add_epi8 (_mm256_shuffle_epi8 (lookup, lo), _mm256_shuffle_epi8 (lookup, hi));
+    acc = _mm256_add_epi64 (acc, _mm256_sad_epu8 (counts, zero));
+  }
+  return (Long) (_mm256_extract_epi64 (acc, 0) + _mm256_extract_epi64 (acc, 1)
+                 + _mm256_extract_epi64 (acc, 2) + _mm256_extract_epi64 (acc, 3));
+}
+
+// The same bit twiddling as warrenBitCount, applied to two words at a time.
+static Long sse2CountBitsSetInMatrix (const U64 * A, Long length) {
+  const __m128i m1 = _mm_set1_epi8 (0x55);
+  const __m128i m2 = _mm_set1_epi8 (0x33);
+  const __m128i m4 = _mm_set1_epi8 (0x0f);
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i acc = zero;
+  Long i;
+  for (i = 0; i < length; i += 2) {
+    __m128i v = _mm_loadu_si128 ((const __m128i *) (A + i));
+    v = _mm_sub_epi8 (v, _mm_and_si128 (_mm_srli_epi64 (v, 1), m1));
+    v = _mm_add_epi8 (_mm_and_si128 (v, m2), _mm_and_si128 (_mm_srli_epi64 (v, 2), m2));
+    v = _mm_and_si128 (_mm_add_epi8 (v, _mm_srli_epi64 (v, 4)), m4);
+    acc = _mm_add_epi64 (acc, _mm_sad_epu8 (v, zero));
+  }
+  U64 sums[2];
+  _mm_storeu_si128 ((__m128i *) sums, acc);
+  return (Long) (sums[0] + sums[1]);
+}
+
+__attribute__((target("avx2")))
+static void avx2OrMatrixRows (U64 * dest, const U64 * src, Long numRows) {
+  Long i;
+  for (i = 0; i < numRows; i += 4) {
+    __m256i d = _mm256_loadu_si256 ((const __m256i *) (dest + i));
+    __m256i s = _mm256_loadu_si256 ((const __m256i *) (src + i));
+    _mm256_storeu_si256 ((__m256i *) (dest + i), _mm256_or_si256 (d, s));
+  }
+}
+
+static void sse2OrMatrixRows (U64 * dest, const U64 * src, Long numRows) {
+  Long i;
+  for (i = 0; i < numRows; i += 2) {
+    __m128i d = _mm_loadu_si128 ((const __m128i *) (dest + i));
+    __m128i s = _mm_loadu_si128 ((const __m128i *) (src + i));
+    _mm_storeu_si128 ((__m128i *) (dest + i), _mm_or_si128 (d, s));
+  }
+}
+
+__attribute__((target("avx2")))
+static void avx2OrWindowRows (U64 * dest, const U8 * window, Long numRows, Short shift) {
+  const __m128i count = _mm_cvtsi32_si128 (shift);
+  Long i;
+  for (i = 0; i < numRows; i += 4) {
+    U32 fourBytes;
+    memcpy (&fourBytes, window + i, sizeof(fourBytes));
+    __m256i w = _mm256_sll_epi64 (_mm256_cvtepu8_epi64 (_mm_cvtsi32_si128 ((int) fourBytes)), count);
+    __m256i d = _mm256_loadu_si256 ((const __m256i *) (dest + i));
+    _mm256_storeu_si256 ((__m256i *) (dest + i), _mm256_or_si256 (d, w));
+  }
+}
+
+static inline void sse2OrTwoRows (U64 * dest, __m128i twoBytes, __m128i count) {
+  __m128i d = _mm_loadu_si128 ((const __m128i *) dest);
+  _mm_storeu_si128 ((__m128i *) dest, _mm_or_si128 (d, _mm_sll_epi64 (twoBytes, count)));
+}
+
+// Zero-extends 16 window bytes to 64 bits by successive unpacking.
+static void sse2OrWindowRows (U64 * dest, const U8 * window, Long numRows, Short shift) {
+  const __m128i count = _mm_cvtsi32_si128 (shift);
+  const __m128i zero = _mm_setzero_si128 ();
+  Long i;
+  for (i = 0; i < numRows; i += 16) {
+    __m128i bytes = _mm_loadu_si128 ((const __m128i *) (window + i));
+    __m128i words[2] = { _mm_unpacklo_epi8 (bytes, zero), _mm_unpackhi_epi8 (bytes, zero) };
+    int j;
+    for (j = 0; j < 2; j++) {
+      __m128i lo = _mm_unpacklo_epi16 (words[j], zero);
+      __m128i hi = _mm_unpackhi_epi16 (words[j], zero);
+      U64 * row = dest + i + 8 * j;
+      sse2OrTwoRows (row + 0, _mm_unpacklo_epi32 (lo, zero), count);
+      sse2OrTwoRows (row + 2, _mm_unpackhi_epi32 (lo, zero), count);
+      sse2OrTwoRows (row + 4, _mm_unpacklo_epi32 (hi, zero), count);
+      sse2OrTwoRows (row + 6, _mm_unpackhi_epi32 (hi, zero), count);
+    }
+  }
+}
+
+#endif
+
+/*******************************************************/
+
+Long countBitsSetInMatrix (const U64 * A, Long length) {
+  if ((length & 0x7) != 0) throw std::invalid_argument("the length of the array must be a multiple of 8");
+#ifdef FM85_X86_SIMD
+  if (cpuHasAVX2 ()) return avx2CountBitsSetInMatrix (A, length);
+  return sse2CountBitsSetInMatrix (A, length);
+#else
+  return csaCountBitsSetInMatrix (A, length);
+#endif
+}
+
+/*******************************************************/
+
+void orMatrixRows (U64 * dest, const U64 * src, Long numRows) {
+  if ((numRows & 0xf) != 0) throw std::invalid_argument("the number of rows must be a multiple of 16");
+#ifdef FM85_X86_SIMD
+  if (cpuHasAVX2 ()) { avx2OrMatrixRows (dest, src, numRows); return; }
+  sse2OrMatrixRows (dest, src, numRows);
+#else
+  Long i;
+  for (i = 0; i < numRows; i++) { dest[i] |= src[i]; }
+#endif
+}
+
+/*******************************************************/
+
+void orWindowRows (U64 * dest, const U8 * window, Long numRows, Short shift) {
+  if ((numRows & 0xf) != 0) throw std::invalid_argument("the number of rows must be a multiple of 16");
+  if (shift < 0 || shift > 56) throw std::out_of_range("shift out of range");
+#ifdef FM85_X86_SIMD
+  if (cpuHasAVX2 ()) { avx2OrWindowRows (dest, window, numRows, shift); return; }
+  sse2OrWindowRows (dest, window, numRows, shift);
+#else
+  Long i;
+  for (i = 0; i < numRows; i++) { dest[i] |= (((U64) window[i]) << shift); }
+#endif
+}
+
 /*********************************************/
 // Here are some timings made with quickTestMerge.c
 // for the "5 5" case:
@@ -12,17 +12,14 @@
 #include <stdexcept>
 #include <new>
 
-extern void* (*fm85alloc)(size_t);
-extern void (*fm85free)(void*);
-
 /*******************************************************/
 
-u32Table * u32TableMake (Short lgSize, Short numValidBits) {
+u32Table * u32TableMake (Short lgSize, Short numValidBits, const fm85Allocator * allocator) {
   if (lgSize < 2) throw std::invalid_argument("lgSize must be >= 2");
   Long numSlots = (1LL << lgSize);
-  u32Table * self = (u32Table *) fm85alloc (sizeof(u32Table));
+  u32Table * self = (u32Table *) fm85allocWith (allocator, sizeof(u32Table));
   if (self == NULL) throw std::bad_alloc();
-  U32 * arr = (U32 *) fm85alloc ((size_t) (numSlots * sizeof(U32)));
+  U32 * arr = (U32 *) fm85allocWith (allocator, (size_t) (numSlots * sizeof(U32)));
   if (arr == NULL) throw std::bad_alloc();
   Long i = 0;
   for (i = 0; i < numSlots; i++) { arr[i] = ALL32BITS; }
@@ -31,17 +28,19 @@ u32Table * u32TableMake (Short lgSize, Short numValidBits) {
   self->lgSize = lgSize;
   self->numItems = 0;
   self->slots = arr;
+  self->allocator = *allocator;
   return (self);
 }
 
 /*******************************************************/
 
-u32Table * u32TableCopy (u32Table * self) {
+u32Table * u32TableCopy (u32Table * self, const fm85Allocator * allocator) {
   if (self == NULL) throw std::invalid_argument("self is null");
   if (self->slots == NULL) throw std::invalid_argument("no slots");
   Long numSlots = (1LL << self->lgSize);
-  u32Table * newObj = (u32Table *) shallowCopy ((void *) self, sizeof(u32Table));
-  newObj->slots = (U32 *) shallowCopy ((void *) self->slots, ((size_t) numSlots) * sizeof(U32));
+  u32Table * newObj = (u32Table *) shallowCopy ((void *) self, sizeof(u32Table), allocator);
+  newObj->slots = (U32 *) shallowCopy ((void *) self->slots, ((size_t) numSlots) * sizeof(U32), allocator);
+  newObj->allocator = *allocator;
   return (newObj);
 }
 
@@ -53,8 +52,9 @@ u32Table * u32TableCopy (u32Table * self) {
 
 void u32TableFree (u32Table * self) {
   if (self != NULL) {
-    if (self->slots != NULL) fm85free (self->slots);
-    fm85free (self);
+    fm85Allocator allocator = self->allocator; // the table itself is freed last
+    if (self->slots != NULL) fm85freeWith (&allocator, self->slots);
+    fm85freeWith (&allocator, self);
   }
 }
 
@@ -125,10 +125,10 @@ void u32TableMustInsert (u32Table * self, U32 item) {
 
 // This one is specifically tailored to be part of our fm85 decompression scheme.
 
-u32Table * makeU32TableFromPairsArray (U32 * pairs, Long numPairs, Short sketchLgK) {
+u32Table * makeU32TableFromPairsArray (U32 * pairs, Long numPairs, Short sketchLgK, const fm85Allocator * allocator) {
   Short lgNumSlots = 2;
   while (u32TableUpsizeDenom * numPairs > u32TableUpsizeNumer * (1LL << lgNumSlots)) { lgNumSlots++; }
-  u32Table * table = u32TableMake (lgNumSlots, 6 + sketchLgK); // Already filled with the "Empty" value which is ALL32BITS.
+  u32Table * table = u32TableMake (lgNumSlots, 6 + sketchLgK, allocator); // Already filled with the "Empty" value which is ALL32BITS.
   Long i = 0;
   // Note: there is a possible "snowplow effect" here because the caller is passing in a sorted pairs array.
   // However, we are starting out with the correct final table size, so the problem might not occur.
@@ -148,7 +148,7 @@ void privateU32TableRebuild (u32Table * self, Short newLgSize) {
   //  printf ("rebuilding: %lld -> %lld; %lld items in table\n", oldSize, newSize, self->numItems); fflush (stdout);
   if (newSize <= self->numItems) throw std::logic_error("newSize <= numItems");
   U32 * oldSlots = self->slots;
-  U32 * newSlots = (U32 *) fm85alloc ((size_t) (newSize * sizeof(U32)));
+  U32 * newSlots = (U32 *) fm85allocWith (&self->allocator, (size_t) (newSize * sizeof(U32)));
   if (newSlots == NULL) throw std::bad_alloc();
   Long i;
   for (i = 0; i < newSize; i++) { 
@@ -162,7 +162,7 @@ void privateU32TableRebuild (u32Table * self, Short newLgSize) {
       u32TableMustInsert (self, item);
     }
   }
-  fm85free (oldSlots);
+  fm85freeWith (&self->allocator, oldSlots);
   return;
 }
 
@@ -227,7 +227,7 @@ U32 * u32TableUnwrappingGetItems (u32Table * self, Long * returnNumItems) {
   if (self->numItems < 1) { return (NULL); }
   U32 * slots = self->slots;
   Long tableSize = (1LL << self->lgSize);
-  U32 * result = (U32 *) fm85alloc ((size_t) (self->numItems * sizeof(U32)));
+  U32 * result = (U32 *) fm85allocWith (&self->allocator, (size_t) (self->numItems * sizeof(U32)));
   if (result == NULL) throw std::bad_alloc();
   Long i = 0;
   Long l = 0;
@@ -7,6 +7,7 @@
 #include <cppunit/extensions/HelperMacros.h>
 
 #include "fm85Compression.h"
+#include "fm85Util.h"
 #include "MurmurHash3.h"
 
 namespace datasketches {
@@ -15,12 +16,11 @@ class compression_test: public CppUnit::TestFixture {
 
   CPPUNIT_TEST_SUITE(compression_test);
   CPPUNIT_TEST(compress_and_uncompress_pairs);
+  CPPUNIT_TEST(decoding_tables);
+  CPPUNIT_TEST(bit_matrix_operations);
   CPPUNIT_TEST_SUITE_END();
 
 public:
-  void setUp() {
-    fm85Init();
-  }
 
   void compress_and_uncompress_pairs() {
     const int N = 200;
@@ -65,6 +65,43 @@ public:
     }
   }
 
+  void decoding_tables() {
+    // the static decoding tables must be exact inverses of the encoding tables
+    validateTheDecodingTables();
+  }
+
+  void bit_matrix_operations() {
+    // the vectorized versions must agree with the obvious loops
+    const int N = 1 << 10;
+    U64 matrix[N];
+    U64 src[N];
+    U64 expected[N];
+    U8 window[N];
+    U64 value = 35538947; // some arbitrary starting value
+    HashState twoHashes;
+    for (int i = 0; i < N; i++) {
+      MurmurHash3_x64_128(&value, sizeof(value), 0, twoHashes);
+      matrix[i] = twoHashes.h1 & twoHashes.h2; // sparser than random
+      src[i] = twoHashes.h1 ^ twoHashes.h2;
+      window[i] = (U8) twoHashes.h1;
+      value++;
+    }
+    CPPUNIT_ASSERT_EQUAL(warrenCountBitsSetInMatrix(matrix, N), countBitsSetInMatrix(matrix, N));
+    CPPUNIT_ASSERT_EQUAL(warrenCountBitsSetInMatrix(matrix + 8, 8), countBitsSetInMatrix(matrix + 8, 8));
+
+    for (int i = 0; i < N; i++) expected[i] = matrix[i] | src[i];
+    orMatrixRows(matrix + 16, src + 16, N - 16); // unaligned start
+    orMatrixRows(matrix, src, 16);
+    for (int i = 0; i < N; i++) CPPUNIT_ASSERT_EQUAL(expected[i], matrix[i]);
+
+    for (Short shift = 0; shift <= 56; shift += 7) {
+      for (int i = 0; i < N; i++) expected[i] = matrix[i] | (((U64) window[i]) << shift);
+      orWindowRows(matrix, window, N, shift);
+      for (int i = 0; i < N; i++) CPPUNIT_ASSERT_EQUAL(expected[i], matrix[i]);
+    }
+    CPPUNIT_ASSERT_THROW(orMatrixRows(matrix, src, 15), std::invalid_argument);
+  }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(compression_test);
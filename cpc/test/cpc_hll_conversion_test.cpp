@@ -0,0 +1,109 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include "cpc_hll_conversion.hpp"
+
+namespace datasketches {
+
+class cpc_hll_conversion_test: public CppUnit::TestFixture {
+
+  CPPUNIT_TEST_SUITE(cpc_hll_conversion_test);
+  CPPUNIT_TEST(empty);
+  CPPUNIT_TEST(invalid_arguments);
+  CPPUNIT_TEST(same_registers);
+  CPPUNIT_TEST(folded_rows);
+  CPPUNIT_TEST(union_with_hll);
+  CPPUNIT_TEST_SUITE_END();
+
+  // compares the register values of two sketches in the HLL mode
+  static void check_same_registers(const HllSketch& expected, const HllSketch& actual) {
+    CPPUNIT_ASSERT_EQUAL(expected.getLgConfigK(), actual.getLgConfigK());
+    auto expected_it = static_cast<const HllSketchPvt&>(expected).getIterator();
+    auto actual_it = static_cast<const HllSketchPvt&>(actual).getIterator();
+    int num_slots = 0;
+    while (expected_it->nextAll()) {
+      CPPUNIT_ASSERT(actual_it->nextAll());
+      CPPUNIT_ASSERT_EQUAL(expected_it->getIndex(), actual_it->getIndex());
+      CPPUNIT_ASSERT_EQUAL(expected_it->getValue(), actual_it->getValue());
+      num_slots++;
+    }
+    CPPUNIT_ASSERT(!actual_it->nextAll());
+    CPPUNIT_ASSERT_EQUAL(1 << expected.getLgConfigK(), num_slots);
+  }
+
+  void empty() {
+    cpc_sketch cpc(11);
+    hll_sketch hll = cpc_hll_conversion::to_hll(cpc);
+    CPPUNIT_ASSERT(hll->isEmpty());
+    CPPUNIT_ASSERT_EQUAL(11, hll->getLgConfigK());
+    CPPUNIT_ASSERT_EQUAL(HLL_4, hll->getTgtHllType());
+  }
+
+  void invalid_arguments() {
+    cpc_sketch cpc1(11, 123);
+    cpc1.update(1);
+    CPPUNIT_ASSERT_THROW(cpc_hll_conversion::to_hll(cpc1), std::invalid_argument);
+    cpc_sketch cpc2(11);
+    cpc2.update(1);
+    CPPUNIT_ASSERT_THROW(cpc_hll_conversion::to_hll(cpc2, 12), std::invalid_argument);
+    CPPUNIT_ASSERT_THROW(cpc_hll_conversion::to_hll(cpc2, 3), std::invalid_argument);
+  }
+
+  void same_registers() {
+    // from the hybrid to the sliding flavor of CPC, always in the HLL mode
+    for (int n: {2000, 10000, 100000}) {
+      for (TgtHllType type: {HLL_4, HLL_6, HLL_8}) {
+        cpc_sketch cpc(11);
+        hll_sketch hll = HllSketch::newInstance(11, type);
+        for (int i = 0; i < n; i++) {
+          cpc.update(i);
+          hll->update(i);
+        }
+        hll_sketch converted = cpc_hll_conversion::to_hll(cpc, type);
+        CPPUNIT_ASSERT_EQUAL(type, converted->getTgtHllType());
+        check_same_registers(*hll, *converted);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(hll->getCompositeEstimate(), converted->getEstimate(), 1e-10);
+      }
+    }
+  }
+
+  void folded_rows() {
+    cpc_sketch cpc(12);
+    hll_sketch hll = HllSketch::newInstance(10, HLL_8);
+    for (int i = 0; i < 10000; i++) {
+      cpc.update(i);
+      hll->update(i);
+    }
+    check_same_registers(*hll, *cpc_hll_conversion::to_hll(cpc, 10, HLL_8));
+  }
+
+  void union_with_hll() {
+    cpc_sketch cpc(11);
+    hll_sketch hll1 = HllSketch::newInstance(11);
+    for (int i = 0; i < 10000; i++) {
+      cpc.update(i);
+      hll1->update(i);
+    }
+    hll_sketch hll2 = HllSketch::newInstance(11);
+    for (int i = 5000; i < 15000; i++) hll2->update(i);
+
+    hll_union u1 = HllUnion::newInstance(11);
+    u1->update(*hll1);
+    u1->update(*hll2);
+    hll_union u2 = HllUnion::newInstance(11);
+    u2->update(*cpc_hll_conversion::to_hll(cpc));
+    u2->update(*hll2);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(u1->getCompositeEstimate(), u2->getCompositeEstimate(), 1e-10);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(15000, u2->getEstimate(), 15000 * 0.05);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(cpc_hll_conversion_test);
+
+} /* namespace datasketches */
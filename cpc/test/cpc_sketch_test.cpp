@@ -4,6 +4,7 @@
  */
 
 #include <cstring>
+#include <vector>
 
 #include <cppunit/TestFixture.h>
 #include <cppunit/extensions/HelperMacros.h>
@@ -14,6 +15,27 @@ namespace datasketches {
 
 static const double RELATIVE_ERROR_FOR_LG_K_11 = 0.02;
 
+namespace {
+
+// counts outstanding allocations to make sure that all memory goes through the resource
+class counting_memory_resource: public cpc_memory_resource {
+  public:
+    counting_memory_resource(): num_allocations(0), num_outstanding(0) {}
+    void* allocate(size_t bytes) {
+      num_allocations++;
+      num_outstanding++;
+      return malloc(bytes);
+    }
+    void deallocate(void* ptr) {
+      num_outstanding--;
+      free(ptr);
+    }
+    unsigned num_allocations;
+    int num_outstanding;
+};
+
+} /* anonymous namespace */
+
 class cpc_sketch_test: public CppUnit::TestFixture {
 
   CPPUNIT_TEST_SUITE(cpc_sketch_test);
@@ -39,6 +61,9 @@ class cpc_sketch_test: public CppUnit::TestFixture {
   CPPUNIT_TEST(update_int_equivalence);
   CPPUNIT_TEST(update_float_equivalience);
   CPPUNIT_TEST(update_string_equivalence);
+  CPPUNIT_TEST(move);
+  CPPUNIT_TEST(memory_resource);
+  CPPUNIT_TEST(memory_resource_stream_seed_mismatch);
   CPPUNIT_TEST_SUITE_END();
 
   void lg_k_limits() {
@@ -340,6 +365,53 @@ class cpc_sketch_test: public CppUnit::TestFixture {
     CPPUNIT_ASSERT_DOUBLES_EQUAL(1, sketch.get_estimate(), RELATIVE_ERROR_FOR_LG_K_11);
   }
 
+  void move() {
+    std::vector<cpc_sketch> sketches;
+    for (int i = 0; i < 100; i++) { // relocation must move rather than copy
+      sketches.push_back(cpc_sketch(11));
+      sketches.back().update(i);
+    }
+    for (int i = 0; i < 100; i++) {
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(1, sketches[i].get_estimate(), RELATIVE_ERROR_FOR_LG_K_11);
+    }
+    cpc_sketch s1(std::move(sketches[0]));
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1, s1.get_estimate(), RELATIVE_ERROR_FOR_LG_K_11);
+    sketches[0] = std::move(s1);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1, sketches[0].get_estimate(), RELATIVE_ERROR_FOR_LG_K_11);
+  }
+
+  void memory_resource() {
+    counting_memory_resource resource;
+    {
+      cpc_sketch sketch(11, DEFAULT_SEED, &resource);
+      const int n = 10000; // sliding flavor
+      for (int i = 0; i < n; i++) sketch.update(i);
+      CPPUNIT_ASSERT(resource.num_allocations > 0);
+      CPPUNIT_ASSERT(sketch.validate());
+
+      cpc_sketch copy(sketch);
+      auto data = copy.serialize();
+      auto sketch_ptr(cpc_sketch::deserialize(data.first.get(), data.second, DEFAULT_SEED, &resource));
+      CPPUNIT_ASSERT_EQUAL(sketch.get_estimate(), sketch_ptr->get_estimate());
+
+      const unsigned num_allocations = resource.num_allocations;
+      cpc_sketch default_sketch(11); // must not use the resource
+      default_sketch.update(1);
+      CPPUNIT_ASSERT_EQUAL(num_allocations, resource.num_allocations);
+    }
+    CPPUNIT_ASSERT_EQUAL(0, resource.num_outstanding);
+  }
+
+  void memory_resource_stream_seed_mismatch() {
+    cpc_sketch sketch(11);
+    for (int i = 0; i < 10000; i++) sketch.update(i);
+    std::stringstream s(std::ios::in | std::ios::out | std::ios::binary);
+    sketch.serialize(s);
+    counting_memory_resource resource;
+    CPPUNIT_ASSERT_THROW(cpc_sketch::deserialize(s, 123, &resource), std::invalid_argument);
+    CPPUNIT_ASSERT_EQUAL(0, resource.num_outstanding);
+  }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(cpc_sketch_test);
@@ -3,6 +3,10 @@
  * Apache License 2.0. See LICENSE file at the project root for terms.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
 #include <cppunit/TestFixture.h>
 #include <cppunit/extensions/HelperMacros.h>
 
@@ -12,6 +16,32 @@ namespace datasketches {
 
 static const double RELATIVE_ERROR_FOR_LG_K_11 = 0.02;
 
+namespace {
+
+// counts outstanding allocations to make sure that all memory goes through the resource
+class counting_memory_resource: public cpc_memory_resource {
+  public:
+    counting_memory_resource(): num_allocations(0), num_outstanding(0) {}
+    void* allocate(size_t bytes) {
+      num_allocations++;
+      num_outstanding++;
+      sizes.push_back(bytes);
+      return malloc(bytes);
+    }
+    void deallocate(void* ptr) {
+      num_outstanding--;
+      free(ptr);
+    }
+    unsigned num_allocations_of(size_t bytes) const {
+      return std::count(sizes.begin(), sizes.end(), bytes);
+    }
+    unsigned num_allocations;
+    int num_outstanding;
+    std::vector<size_t> sizes;
+};
+
+} /* anonymous namespace */
+
 class cpc_union_test: public CppUnit::TestFixture {
 
   CPPUNIT_TEST_SUITE(cpc_union_test);
@@ -19,6 +49,17 @@ class cpc_union_test: public CppUnit::TestFixture {
   CPPUNIT_TEST(empty);
   CPPUNIT_TEST(copy);
   CPPUNIT_TEST(custom_seed);
+  CPPUNIT_TEST(move);
+  CPPUNIT_TEST(memory_resource);
+  CPPUNIT_TEST(multiple_threads);
+  CPPUNIT_TEST(update_from_bytes);
+  CPPUNIT_TEST(update_from_unaligned_bytes);
+  CPPUNIT_TEST(update_many_sparse);
+  CPPUNIT_TEST(update_many_mixed);
+  CPPUNIT_TEST(reset);
+  CPPUNIT_TEST(no_allocations_in_steady_state);
+  CPPUNIT_TEST(no_allocations_in_steady_state_from_bytes);
+  CPPUNIT_TEST(scratch_kept_between_sparse_and_sliding);
   CPPUNIT_TEST_SUITE_END();
 
   void lg_k_limits() {
@@ -71,6 +112,248 @@ class cpc_union_test: public CppUnit::TestFixture {
     CPPUNIT_ASSERT_THROW(u2.update(s), std::invalid_argument);
   }
 
+  void move() {
+    cpc_sketch s(11);
+    s.update(1);
+    cpc_union u1(11);
+    u1.update(s);
+    cpc_union u2(std::move(u1));
+    auto sp(u2.get_result());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1, sp->get_estimate(), RELATIVE_ERROR_FOR_LG_K_11);
+    u1 = std::move(u2);
+    u1.update(s);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(1, u1.get_result()->get_estimate(), RELATIVE_ERROR_FOR_LG_K_11);
+  }
+
+  void memory_resource() {
+    counting_memory_resource resource;
+    {
+      cpc_union u(11, DEFAULT_SEED, &resource);
+      cpc_sketch s1(11); // sparse
+      s1.update(1);
+      u.update(s1);
+      cpc_sketch s2(10); // sliding, reduces lg_k of the union and converts it to a bit matrix
+      for (int i = 0; i < 10000; i++) s2.update(i);
+      u.update(s2);
+      CPPUNIT_ASSERT(resource.num_allocations > 0);
+      cpc_union copy(u);
+      auto sp(copy.get_result());
+      CPPUNIT_ASSERT(sp->validate());
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(10000, sp->get_estimate(), 10000 * 0.05);
+    }
+    CPPUNIT_ASSERT_EQUAL(0, resource.num_outstanding);
+  }
+
+  static void check_same_result(const cpc_union& u1, const cpc_union& u2) {
+    auto sp1(u1.get_result());
+    auto sp2(u2.get_result());
+    CPPUNIT_ASSERT(sp2->validate());
+    CPPUNIT_ASSERT_EQUAL(sp1->get_num_coupons(), sp2->get_num_coupons());
+    auto data1 = sp1->serialize();
+    auto data2 = sp2->serialize();
+    CPPUNIT_ASSERT_EQUAL(data1.second, data2.second);
+    CPPUNIT_ASSERT(std::memcmp(data1.first.get(), data2.first.get(), data1.second) == 0);
+  }
+
+  void update_from_bytes() {
+    // empty, sparse, hybrid, pinned and sliding sources, each of them with a smaller, equal and larger lg_k
+    const int sizes[] = {0, 10, 100, 2000, 20000};
+    for (int lg_k = 10; lg_k <= 12; lg_k++) {
+      cpc_union u1(11);
+      cpc_union u2(11);
+      int value = 0;
+      for (int n: sizes) {
+        cpc_sketch s(lg_k);
+        for (int i = 0; i < n; i++) s.update(value++);
+        u1.update(s);
+        auto data = s.serialize();
+        u2.update(data.first.get(), data.second);
+        check_same_result(u1, u2);
+      }
+    }
+    // sliding source into a sparse union, and sparse sources into a bit matrix
+    cpc_union u1(11);
+    cpc_union u2(11);
+    for (int n: {5, 20000, 5, 50}) {
+      cpc_sketch s(11);
+      for (int i = 0; i < n; i++) s.update(n * 100000 + i);
+      u1.update(s);
+      auto data = s.serialize();
+      u2.update(data.first.get(), data.second);
+      check_same_result(u1, u2);
+    }
+  }
+
+  void update_from_unaligned_bytes() {
+    cpc_sketch s(11);
+    for (int i = 0; i < 20000; i++) s.update(i);
+    auto data = s.serialize(1);
+    cpc_union u1(11);
+    u1.update(s);
+    cpc_union u2(11);
+    u2.update(static_cast<char*>(data.first.get()) + 1, data.second - 1);
+    check_same_result(u1, u2);
+
+    cpc_union u3(11, 123);
+    CPPUNIT_ASSERT_THROW(u3.update(static_cast<char*>(data.first.get()) + 1, data.second - 1), std::invalid_argument);
+  }
+
+  void update_many_sparse() {
+    // stays sparse with few sketches, then graduates to a bit matrix part way through the batch
+    for (int num_sketches: {10, 1000}) {
+      std::vector<cpc_sketch> sketches;
+      int value = 0;
+      for (int i = 0; i < num_sketches; i++) {
+        sketches.push_back(cpc_sketch(i % 3 == 0 ? 12 : 11));
+        for (int j = 0; j < 5; j++) sketches.back().update(value++);
+        sketches.back().update(-2); // the same value in every sketch
+      }
+      cpc_union u1(11);
+      cpc_union u2(11);
+      cpc_sketch s(11);
+      s.update(-1);
+      u1.update(s); // something already in the accumulator
+      u2.update(s);
+      for (const cpc_sketch& sketch: sketches) u1.update(sketch);
+      u2.update(sketches.begin(), sketches.end());
+      check_same_result(u1, u2);
+
+      // the bulk path must also work when the union already has a bit matrix
+      u1.update(sketches.begin(), sketches.end());
+      for (const cpc_sketch& sketch: sketches) u2.update(sketch);
+      check_same_result(u1, u2);
+    }
+  }
+
+  void update_many_mixed() {
+    std::vector<cpc_sketch> sketches;
+    int value = 0;
+    for (int n: {0, 3, 20000, 7, 500}) {
+      sketches.push_back(cpc_sketch(n == 7 ? 10 : 11)); // one of them reduces lg_k
+      for (int i = 0; i < n; i++) sketches.back().update(value++);
+    }
+    cpc_union u1(11);
+    for (const cpc_sketch& sketch: sketches) u1.update(sketch);
+    cpc_union u2(11);
+    u2.update(sketches.begin(), sketches.end());
+    check_same_result(u1, u2);
+
+    std::vector<cpc_sketch> other_seed;
+    other_seed.push_back(cpc_sketch(11, 123));
+    CPPUNIT_ASSERT_THROW(u2.update(other_seed.begin(), other_seed.end()), std::invalid_argument);
+  }
+
+  void multiple_threads() {
+    const uint8_t lg_k = 20;
+    cpc_union u1(lg_k);
+    cpc_union u4(lg_k);
+    u4.set_num_threads(4);
+    CPPUNIT_ASSERT_THROW(u4.set_num_threads(0), std::invalid_argument);
+    int value = 0;
+    for (int i = 0; i < 3; i++) {
+      cpc_sketch s(lg_k + i % 2); // the odd ones are downsampled
+      const int n = 1 << (lg_k + 2 * i); // pinned and sliding
+      for (int j = 0; j < n; j++) s.update(value++);
+      u1.update(s);
+      u4.update(s);
+    }
+    auto sp1(u1.get_result());
+    auto sp4(u4.get_result());
+    CPPUNIT_ASSERT_EQUAL(sp1->get_num_coupons(), sp4->get_num_coupons());
+    CPPUNIT_ASSERT_EQUAL(sp1->get_estimate(), sp4->get_estimate());
+    CPPUNIT_ASSERT(sp4->validate());
+    auto data1 = sp1->serialize();
+    auto data4 = sp4->serialize();
+    CPPUNIT_ASSERT_EQUAL(data1.second, data4.second);
+    CPPUNIT_ASSERT(std::memcmp(data1.first.get(), data4.first.get(), data1.second) == 0);
+  }
+
+  void reset() {
+    cpc_union u(11);
+    cpc_sketch s1(10); // reduces lg_k of the union
+    for (int i = 0; i < 10000; i++) s1.update(i);
+    u.update(s1);
+    u.reset();
+    auto sp(u.get_result());
+    CPPUNIT_ASSERT(sp->is_empty());
+
+    cpc_sketch s2(11);
+    for (int i = 0; i < 100; i++) s2.update(i);
+    u.update(s2);
+    cpc_union fresh(11);
+    fresh.update(s2);
+    check_same_result(fresh, u);
+  }
+
+  void no_allocations_in_steady_state() {
+    std::vector<cpc_sketch> sketches;
+    for (int i = 0; i < 3; i++) {
+      sketches.push_back(cpc_sketch(11));
+      for (int j = 0; j < 20000; j++) sketches.back().update(i * 20000 + j); // sliding
+    }
+    counting_memory_resource resource;
+    cpc_union u(11, DEFAULT_SEED, &resource);
+    u.update(sketches[0]);
+    u.update(sketches[1]);
+    const unsigned num_allocations = resource.num_allocations;
+    for (int i = 0; i < 3; i++) {
+      u.reset();
+      for (const cpc_sketch& sketch: sketches) u.update(sketch);
+    }
+    CPPUNIT_ASSERT_EQUAL(num_allocations, resource.num_allocations);
+    cpc_union expected(11);
+    for (const cpc_sketch& sketch: sketches) expected.update(sketch);
+    check_same_result(expected, u);
+  }
+
+  void no_allocations_in_steady_state_from_bytes() {
+    // a sliding source first, so that the others are merged into the bit matrix
+    typedef std::pair<ptr_with_deleter, const size_t> serialized;
+    std::vector<serialized> images;
+    const int sizes[] = {20000, 100, 500, 3000}; // sliding, sparse, hybrid, pinned
+    int value = 0;
+    for (int n: sizes) {
+      cpc_sketch s(11);
+      for (int i = 0; i < n; i++) s.update(value++);
+      images.push_back(s.serialize());
+    }
+    counting_memory_resource resource;
+    cpc_union u(11, DEFAULT_SEED, &resource);
+    for (const serialized& image: images) u.update(image.first.get(), image.second);
+    const unsigned num_allocations = resource.num_allocations;
+    for (int i = 0; i < 3; i++) {
+      u.reset();
+      for (const serialized& image: images) u.update(image.first.get(), image.second);
+    }
+    CPPUNIT_ASSERT_EQUAL(num_allocations, resource.num_allocations);
+    cpc_union expected(11);
+    for (const serialized& image: images) expected.update(image.first.get(), image.second);
+    check_same_result(expected, u);
+  }
+
+  void scratch_kept_between_sparse_and_sliding() {
+    // the bulk sparse path needs a small part of the scratch buffer that merging a sliding source needs
+    std::vector<cpc_sketch> sparse;
+    int value = 0;
+    for (int i = 0; i < 10; i++) {
+      sparse.push_back(cpc_sketch(11));
+      for (int j = 0; j < 5; j++) sparse.back().update(value++);
+    }
+    cpc_sketch sliding(11);
+    for (int i = 0; i < 20000; i++) sliding.update(value++);
+    counting_memory_resource resource;
+    cpc_union u(11, DEFAULT_SEED, &resource);
+    u.update(sparse.begin(), sparse.end());
+    u.update(sliding);
+    const unsigned num_k_row_allocations = resource.num_allocations_of(sizeof(uint64_t) << 11);
+    for (int i = 0; i < 3; i++) {
+      u.reset();
+      u.update(sparse.begin(), sparse.end());
+      u.update(sliding);
+    }
+    CPPUNIT_ASSERT_EQUAL(num_k_row_allocations, resource.num_allocations_of(sizeof(uint64_t) << 11));
+  }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(cpc_union_test);
@@ -10,6 +10,8 @@
 #include <algorithm>
 #include <iterator>
 #include <cmath>
+#include <functional>
+#include <type_traits>
 
 namespace datasketches {
 
@@ -53,10 +55,13 @@ private:
   uint64_t* values;
   uint16_t* states;
 
+  static inline size_t hash(const T& key);
+  static inline uint64_t fmix64(uint64_t h);
   inline bool is_active(uint32_t probe) const;
+  inline uint32_t find(const T& key, size_t hash) const;
   void subtract_and_keep_positive_only(uint64_t amount);
   void hash_delete(uint32_t probe);
-  uint32_t internal_adjust_or_insert(const T& key, uint64_t value);
+  uint32_t internal_adjust_or_insert(const T& key, size_t hash, uint64_t value);
   uint64_t resize_or_purge_if_needed();
   void resize(uint8_t new_lg_size);
   uint64_t purge();
@@ -187,7 +192,7 @@ reverse_purge_hash_map<T, H, E, A>& reverse_purge_hash_map<T, H, E, A>::operator
 template<typename T, typename H, typename E, typename A>
 uint64_t reverse_purge_hash_map<T, H, E, A>::adjust_or_insert(const T& key, uint64_t value) {
   const uint32_t num_active_before = num_active;
-  const uint32_t index = internal_adjust_or_insert(key, value);
+  const uint32_t index = internal_adjust_or_insert(key, hash(key), value);
   if (num_active > num_active_before) {
     new (&keys[index]) T(key);
     return resize_or_purge_if_needed();
@@ -198,7 +203,7 @@ uint64_t reverse_purge_hash_map<T, H, E, A>::adjust_or_insert(const T& key, uint
 template<typename T, typename H, typename E, typename A>
 uint64_t reverse_purge_hash_map<T, H, E, A>::adjust_or_insert(T&& key, uint64_t value) {
   const uint32_t num_active_before = num_active;
-  const uint32_t index = internal_adjust_or_insert(key, value);
+  const uint32_t index = internal_adjust_or_insert(key, hash(key), value);
   if (num_active > num_active_before) {
     new (&keys[index]) T(std::move(key));
     return resize_or_purge_if_needed();
@@ -208,13 +213,8 @@ uint64_t reverse_purge_hash_map<T, H, E, A>::adjust_or_insert(T&& key, uint64_t
 
 template<typename T, typename H, typename E, typename A>
 uint64_t reverse_purge_hash_map<T, H, E, A>::get(const T& key) const {
-  const uint32_t mask = (1 << lg_cur_size) - 1;
-  uint32_t probe = H()(key) & mask;
-  while (is_active(probe)) {
-    if (E()(keys[probe], key)) return values[probe];
-    probe = (probe + 1) & mask;
-  }
-  return 0;
+  const uint32_t probe = find(key, hash(key));
+  return is_active(probe) ? values[probe] : 0;
 }
 
 template<typename T, typename H, typename E, typename A>
@@ -250,11 +250,39 @@ typename reverse_purge_hash_map<T, H, E, A>::const_iterator reverse_purge_hash_m
   return reverse_purge_hash_map<T, H, E, A>::const_iterator(this, 1 << lg_cur_size, num_active);
 }
 
+// std::hash of an integer is the integer itself in common implementations,
+// so sequential or strided keys would fill long runs of slots next to each other
+template<typename T, typename H, typename E, typename A>
+size_t reverse_purge_hash_map<T, H, E, A>::hash(const T& key) {
+  const size_t h = H()(key);
+  return std::is_integral<T>::value ? fmix64(h) : h;
+}
+
+// the finalizer of MurmurHash3, which spreads every bit of the input over all bits of the output
+template<typename T, typename H, typename E, typename A>
+uint64_t reverse_purge_hash_map<T, H, E, A>::fmix64(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
 template<typename T, typename H, typename E, typename A>
 bool reverse_purge_hash_map<T, H, E, A>::is_active(uint32_t index) const {
   return states[index] > 0;
 }
 
+// the slot of the key, or the inactive slot that ends its run if the key is not there
+template<typename T, typename H, typename E, typename A>
+uint32_t reverse_purge_hash_map<T, H, E, A>::find(const T& key, size_t hash) const {
+  const uint32_t mask = (1 << lg_cur_size) - 1;
+  uint32_t probe = hash & mask;
+  while (is_active(probe) and !E()(keys[probe], key)) probe = (probe + 1) & mask;
+  return probe;
+}
+
 template<typename T, typename H, typename E, typename A>
 void reverse_purge_hash_map<T, H, E, A>::subtract_and_keep_positive_only(uint64_t amount) {
   // starting from the back, find the first empty cell,
@@ -316,9 +344,9 @@ void reverse_purge_hash_map<T, H, E, A>::hash_delete(uint32_t delete_index) {
 }
 
 template<typename T, typename H, typename E, typename A>
-uint32_t reverse_purge_hash_map<T, H, E, A>::internal_adjust_or_insert(const T& key, uint64_t value) {
+uint32_t reverse_purge_hash_map<T, H, E, A>::internal_adjust_or_insert(const T& key, size_t hash, uint64_t value) {
   const uint32_t mask = (1 << lg_cur_size) - 1;
-  uint32_t index = H()(key) & mask;
+  uint32_t index = hash & mask;
   uint16_t drift = 1;
   while (is_active(index)) {
     if (E()(keys[index], key)) {
@@ -203,7 +203,7 @@ class frequent_items_sketch_test: public CppUnit::TestFixture {
     std::ifstream is;
     is.exceptions(std::ios::failbit | std::ios::badbit);
     is.open(testBinaryInputPath + "longs_sketch_from_java.bin", std::ios::binary);
-    auto sketch = frequent_items_sketch<long long>::deserialize(is);
+    auto sketch = frequent_items_sketch<int64_t>::deserialize(is);
     CPPUNIT_ASSERT(!sketch.is_empty());
     CPPUNIT_ASSERT_EQUAL(4ULL, sketch.get_total_weight());
     CPPUNIT_ASSERT_EQUAL(4U, sketch.get_num_active_items());
@@ -242,7 +242,7 @@ class frequent_items_sketch_test: public CppUnit::TestFixture {
   }
 
   void serialize_deserialize_long64_stream() {
-    frequent_items_sketch<long long> sketch1(3);
+    frequent_items_sketch<int64_t> sketch1(3);
     sketch1.update(1, 1);
     sketch1.update(2, 2);
     sketch1.update(3, 3);
@@ -251,7 +251,7 @@ class frequent_items_sketch_test: public CppUnit::TestFixture {
 
     std::stringstream s(std::ios::in | std::ios::out | std::ios::binary);
     sketch1.serialize(s);
-    auto sketch2 = frequent_items_sketch<long long>::deserialize(s);
+    auto sketch2 = frequent_items_sketch<int64_t>::deserialize(s);
     CPPUNIT_ASSERT(!sketch2.is_empty());
     CPPUNIT_ASSERT_EQUAL(15ULL, sketch2.get_total_weight());
     CPPUNIT_ASSERT_EQUAL(5U, sketch2.get_num_active_items());
@@ -263,7 +263,7 @@ class frequent_items_sketch_test: public CppUnit::TestFixture {
   }
 
   void serialize_deserialize_long64_bytes() {
-    frequent_items_sketch<long long> sketch1(3);
+    frequent_items_sketch<int64_t> sketch1(3);
     sketch1.update(1, 1);
     sketch1.update(2, 2);
     sketch1.update(3, 3);
@@ -271,7 +271,7 @@ class frequent_items_sketch_test: public CppUnit::TestFixture {
     sketch1.update(5, 5);
 
     auto p = sketch1.serialize();
-    auto sketch2 = frequent_items_sketch<long long>::deserialize(p.first.get(), p.second);
+    auto sketch2 = frequent_items_sketch<int64_t>::deserialize(p.first.get(), p.second);
     CPPUNIT_ASSERT(!sketch2.is_empty());
     CPPUNIT_ASSERT_EQUAL(15ULL, sketch2.get_total_weight());
     CPPUNIT_ASSERT_EQUAL(5U, sketch2.get_num_active_items());
@@ -16,6 +16,7 @@ class reverse_purge_hash_map_test: public CppUnit::TestFixture {
   CPPUNIT_TEST(empty);
   CPPUNIT_TEST(one_item);
   CPPUNIT_TEST(iterator);
+  CPPUNIT_TEST(strided_keys);
   CPPUNIT_TEST_SUITE_END();
 
   void empty() {
@@ -39,6 +40,15 @@ class reverse_purge_hash_map_test: public CppUnit::TestFixture {
     CPPUNIT_ASSERT_EQUAL(11, sum);
   }
 
+  void strided_keys() {
+    // without mixing std::hash these would all start probing at slot 0 and exceed the drift limit
+    reverse_purge_hash_map<int64_t> map(11, 11);
+    const int64_t num_keys = 1500;
+    for (int64_t i = 0; i < num_keys; i++) map.adjust_or_insert(i << 11, i + 1);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint32_t>(num_keys), map.get_num_active());
+    for (int64_t i = 0; i < num_keys; i++) CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(i + 1), map.get(i << 11));
+  }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(reverse_purge_hash_map_test);
@@ -18,6 +18,11 @@ public:
   static Hll6Array* convertToHll6(const HllArray& srcHllArr);
   static Hll8Array* convertToHll8(const HllArray& srcHllArr);
 
+  // Builds an array from register values (one per slot, 0 if empty) that were derived from
+  // another sketch, such as CPC. The HIP accumulator cannot be recovered, so the result is
+  // marked out of order.
+  static HllArray* convertFromRegisters(int lgConfigK, TgtHllType tgtHllType, const uint8_t* registers);
+
 private:
   static int curMinAndNum(const HllArray& hllArr);
 };
@@ -50,6 +50,54 @@ Hll4Array* Conversions::convertToHll4(const HllArray& srcHllArr) {
   return hll4Array;
 }
 
+HllArray* Conversions::convertFromRegisters(const int lgConfigK, const TgtHllType tgtHllType,
+                                            const uint8_t* registers) {
+  const int configK = 1 << lgConfigK;
+  std::unique_ptr<HllArray> hllArray(HllArray::newHll(lgConfigK, tgtHllType));
+  hllArray->putOutOfOrderFlag(true);
+
+  // only HLL_4 stores values relative to the minimum
+  int curMin = 0;
+  int numAtCurMin = 0;
+  if (tgtHllType == HLL_4) {
+    curMin = 64;
+    for (int slotNo = 0; slotNo < configK; ++slotNo) {
+      if (registers[slotNo] < curMin) {
+        curMin = registers[slotNo];
+        numAtCurMin = 1;
+      } else if (registers[slotNo] == curMin) {
+        ++numAtCurMin;
+      }
+    }
+  }
+
+  AuxHashMap* auxHashMap = nullptr;
+  for (int slotNo = 0; slotNo < configK; ++slotNo) {
+    const int value = registers[slotNo];
+    if (value == HllUtil::EMPTY) {
+      if (tgtHllType != HLL_4) { ++numAtCurMin; }
+      continue;
+    }
+    HllArray::hipAndKxQIncrementalUpdate(*hllArray, 0, value);
+    if (tgtHllType != HLL_4) {
+      hllArray->putSlot(slotNo, value);
+    } else if (value >= (curMin + 15)) {
+      hllArray->putSlot(slotNo, HllUtil::AUX_TOKEN);
+      if (auxHashMap == nullptr) {
+        auxHashMap = new AuxHashMap(HllUtil::LG_AUX_ARR_INTS[lgConfigK], lgConfigK);
+        static_cast<Hll4Array*>(hllArray.get())->putAuxHashMap(auxHashMap);
+      }
+      auxHashMap->mustAdd(slotNo, value);
+    } else {
+      hllArray->putSlot(slotNo, value - curMin);
+    }
+  }
+
+  hllArray->putCurMin(curMin);
+  hllArray->putNumAtCurMin(numAtCurMin);
+  return hllArray.release();
+}
+
 int Conversions::curMinAndNum(const HllArray& hllArr) {
   int curMin = 64;
   int numAtCurMin = 0;
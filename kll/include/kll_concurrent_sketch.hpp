@@ -0,0 +1,201 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#ifndef KLL_CONCURRENT_SKETCH_HPP_
+#define KLL_CONCURRENT_SKETCH_HPP_
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <stdexcept>
+
+#include "kll_sketch.hpp"
+
+namespace datasketches {
+
+/*
+ * A KLL sketch that many threads can update and query at once.
+ *
+ * Each writer thread appends to a buffer of its own. A full buffer is handed over to a background
+ * thread through a lock-free list, and this thread adds it to the shared sketch with a bulk update.
+ * So updates do not contend with each other, and the items of a thread become visible to the queries
+ * in batches of buffer_size: up to buffer_size - 1 items of each writer may not be visible yet.
+ * A writer can call flush() to hand over what it has. This also happens when a writer thread exits.
+ *
+ * Readers get an immutable snapshot of the shared sketch with the sorted view already built,
+ * which can be queried from any number of threads. The snapshot is shared until the sketch changes.
+ *
+ * The calls to update() and flush() must not outlive this object, but the writer threads may:
+ * they keep the state they share with the sketch, so the hand-over when they exit never touches
+ * a destroyed sketch (the items are dropped then). A thread owns its buffers, which go away when it exits.
+ */
+template <typename T>
+class kll_concurrent_sketch {
+  public:
+    static const uint32_t DEFAULT_BUFFER_SIZE = 1024;
+
+    explicit kll_concurrent_sketch(uint16_t k = kll_sketch<T>::DEFAULT_K, uint32_t buffer_size = DEFAULT_BUFFER_SIZE) :
+    sketch_(k), state_(std::make_shared<shared_state>(buffer_size)), version_(0), snapshot_version_(0) {
+      if (buffer_size == 0) throw std::invalid_argument("buffer_size must be > 0");
+      compactor_ = std::thread(&kll_concurrent_sketch::run_compactor, this);
+    }
+
+    kll_concurrent_sketch(const kll_concurrent_sketch&) = delete;
+    kll_concurrent_sketch& operator=(const kll_concurrent_sketch&) = delete;
+
+    ~kll_concurrent_sketch() {
+      state_->closed = true;
+      {
+        std::lock_guard<std::mutex> lock(state_->wake_mutex);
+        state_->stop = true;
+      }
+      state_->wake.notify_one();
+      compactor_.join();
+      delete_batches(state_->pending.exchange(nullptr));
+    }
+
+    // safe to call from any thread
+    void update(const T& value) {
+      std::vector<T>& items(get_local_items());
+      items.push_back(value);
+      if (items.size() == state_->buffer_size) hand_off(*state_, items);
+    }
+
+    // hands over the items of the calling thread, so that the next snapshot includes them
+    void flush() {
+      std::vector<T>& items(get_local_items());
+      if (!items.empty()) hand_off(*state_, items);
+    }
+
+    // includes all items handed over so far
+    std::shared_ptr<const kll_sketch<T>> get_snapshot() {
+      std::lock_guard<std::mutex> lock(sketch_mutex_);
+      apply_pending();
+      if (!snapshot_ or snapshot_version_ != version_) {
+        std::shared_ptr<kll_sketch<T>> snapshot(std::make_shared<kll_sketch<T>>(sketch_));
+        // built here, so that the queries only read the snapshot
+        if (!snapshot->is_empty()) snapshot->get_sorted_view();
+        snapshot_ = snapshot;
+        snapshot_version_ = version_;
+      }
+      return snapshot_;
+    }
+
+  private:
+    // a full buffer on its way to the shared sketch
+    struct batch {
+      std::vector<T> items;
+      batch* next;
+    };
+
+    // what the writers need to hand over their items, kept alive by them after the sketch is destroyed
+    struct shared_state {
+      explicit shared_state(uint32_t buffer_size): buffer_size(buffer_size), pending(nullptr), closed(false), stop(false) {}
+      ~shared_state() { delete_batches(pending.exchange(nullptr)); }
+      const uint32_t buffer_size;
+      std::atomic<batch*> pending; // lock-free, taken as a whole by the compactor
+      std::atomic<bool> closed; // the sketch is being destroyed
+      std::mutex wake_mutex;
+      std::condition_variable wake;
+      bool stop; // guarded by wake_mutex
+    };
+
+    // the buffers of one thread for all sketches it updated
+    struct thread_buffers {
+      struct entry {
+        std::shared_ptr<shared_state> state;
+        std::vector<T> items;
+      };
+      std::vector<entry> entries;
+
+      ~thread_buffers() {
+        for (entry& e: entries) {
+          if (!e.state->closed and !e.items.empty()) hand_off(*e.state, e.items);
+        }
+      }
+    };
+
+    kll_sketch<T> sketch_;
+    std::shared_ptr<shared_state> state_;
+    std::mutex sketch_mutex_; // guards sketch_ and the snapshot
+    uint64_t version_;
+    std::shared_ptr<const kll_sketch<T>> snapshot_;
+    uint64_t snapshot_version_;
+    std::thread compactor_;
+
+    static thread_buffers& get_thread_buffers() {
+      static thread_local thread_buffers buffers;
+      return buffers;
+    }
+
+    std::vector<T>& get_local_items() {
+      thread_buffers& buffers(get_thread_buffers());
+      for (typename thread_buffers::entry& e: buffers.entries) {
+        if (e.state == state_) return e.items;
+      }
+      // the first update from this thread, a good time to forget the sketches that were destroyed
+      buffers.entries.erase(std::remove_if(buffers.entries.begin(), buffers.entries.end(),
+          [](const typename thread_buffers::entry& e) { return e.state->closed.load(); }), buffers.entries.end());
+      buffers.entries.push_back({state_, std::vector<T>()});
+      std::vector<T>& items(buffers.entries.back().items);
+      items.reserve(state_->buffer_size);
+      return items;
+    }
+
+    static void hand_off(shared_state& state, std::vector<T>& items) {
+      batch* b(new batch);
+      b->items.swap(items);
+      items.reserve(state.buffer_size);
+      b->next = state.pending.load(std::memory_order_relaxed);
+      while (!state.pending.compare_exchange_weak(b->next, b, std::memory_order_release, std::memory_order_relaxed));
+      state.wake.notify_one();
+    }
+
+    static void delete_batches(batch* list) {
+      while (list != nullptr) {
+        batch* next(list->next);
+        delete list;
+        list = next;
+      }
+    }
+
+    // must be called with sketch_mutex_ held
+    void apply_pending() {
+      batch* list(state_->pending.exchange(nullptr, std::memory_order_acquire));
+      if (list == nullptr) return;
+      while (list != nullptr) {
+        sketch_.update(list->items.data(), list->items.size());
+        batch* next(list->next);
+        delete list;
+        list = next;
+      }
+      version_++;
+    }
+
+    void run_compactor() {
+      shared_state& state(*state_);
+      std::unique_lock<std::mutex> wake_lock(state.wake_mutex);
+      while (!state.stop) {
+        // writers do not take the lock to notify, so a notification can be missed while not waiting
+        state.wake.wait_for(wake_lock, std::chrono::milliseconds(10));
+        if (state.pending.load(std::memory_order_relaxed) == nullptr) continue;
+        wake_lock.unlock();
+        {
+          std::lock_guard<std::mutex> lock(sketch_mutex_);
+          apply_pending();
+        }
+        wake_lock.lock();
+      }
+    }
+};
+
+} /* namespace datasketches */
+
+#endif // KLL_CONCURRENT_SKETCH_HPP_
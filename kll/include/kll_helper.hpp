@@ -9,10 +9,63 @@
 #include <random>
 #include <stdexcept>
 #include <algorithm>
+#include <vector>
+#include <utility>
+#include <memory>
+#include <type_traits>
+#include <string>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define KLL_SSE2
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace datasketches {
 
-static std::independent_bits_engine<std::mt19937, 1, uint32_t> random_bit;
+/*
+ * A small and fast source of random bits for choosing which half of the items survives a compaction.
+ * Each sketch has its own, so that sketches on different threads do not share any state,
+ * and a sketch with a given seed compacts the same way every time.
+ * Each step of splitmix64 gives 64 bits, which are used one at a time.
+ */
+class kll_random_bits {
+  public:
+    explicit kll_random_bits(uint64_t seed) : state_(seed), bits_(0), num_bits_(0) {}
+
+    uint32_t operator()() {
+      if (num_bits_ == 0) {
+        bits_ = next();
+        num_bits_ = 64;
+      }
+      const uint32_t bit(bits_ & 1);
+      bits_ >>= 1;
+      num_bits_--;
+      return bit;
+    }
+
+    // different for every call, so that sketches without a given seed do not make the same choices
+    static uint64_t default_seed() {
+      static thread_local kll_random_bits seeds(std::random_device{}());
+      return seeds.next();
+    }
+
+  private:
+    uint64_t state_;
+    uint64_t bits_;
+    uint8_t num_bits_;
+
+    uint64_t next() {
+      uint64_t z = (state_ += 0x9e3779b97f4a7c15ULL);
+      z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+      return z ^ (z >> 31);
+    }
+};
 
 #ifdef KLL_VALIDATION
 extern uint32_t kll_next_offset;
@@ -25,6 +78,44 @@ static const uint64_t powers_of_three[] =  {1, 3, 9, 27, 81, 243, 729, 2187, 656
 847288609443, 2541865828329, 7625597484987, 22876792454961, 68630377364883,
 205891132094649};
 
+/*
+ * The bits of an arithmetic item as an unsigned key with the same order as the items,
+ * for sorting them by their digits. Signed integers have the sign bit flipped, negative floating
+ * point numbers have all bits flipped and positive ones the sign bit only (so -0.0 is before 0.0).
+ * NaN has no place in this order, but the sketches drop it on update.
+ */
+template <typename T, typename Enable = void>
+struct kll_radix_key {
+  static const bool is_supported = false;
+};
+
+template <typename T>
+struct kll_radix_key<T, typename std::enable_if<std::is_integral<T>::value and !std::is_same<T, bool>::value>::type> {
+  static const bool is_supported = true;
+  typedef typename std::make_unsigned<T>::type type;
+  static const type flip = std::is_signed<T>::value ? static_cast<type>(1) << (sizeof(T) * 8 - 1) : 0;
+  static type to_key(T item) { return static_cast<type>(item) ^ flip; }
+  static T from_key(type key) { return static_cast<T>(key ^ flip); }
+};
+
+template <typename T>
+struct kll_radix_key<T, typename std::enable_if<std::is_floating_point<T>::value and (sizeof(T) == 4 or sizeof(T) == 8)>::type> {
+  static const bool is_supported = true;
+  typedef typename std::conditional<sizeof(T) == 4, uint32_t, uint64_t>::type type;
+  static const type sign_bit = static_cast<type>(1) << (sizeof(T) * 8 - 1);
+  static type to_key(T item) {
+    type bits;
+    memcpy(&bits, &item, sizeof(T));
+    return bits ^ ((bits & sign_bit) ? ~static_cast<type>(0) : sign_bit);
+  }
+  static T from_key(type key) {
+    const type bits(key ^ ((key & sign_bit) ? sign_bit : ~static_cast<type>(0)));
+    T item;
+    memcpy(&item, &bits, sizeof(T));
+    return item;
+  }
+};
+
 class kll_helper {
   public:
     static bool is_even(uint32_t value) {
@@ -92,6 +183,111 @@ class kll_helper {
       return total;
     }
 
+    /*
+     * Updates min and max with the given values using the same comparisons as item by item
+     * updates (value < min, max < value), so a NaN never replaces a number
+     */
+    template <typename T>
+    static void update_min_max(const T* values, size_t size, T& min, T& max) {
+      for (size_t i = 0; i < size; i++) {
+        if (values[i] < min) min = values[i];
+        if (max < values[i]) max = values[i];
+      }
+    }
+
+    // MINPS(a, b) is (a < b ? a : b) and MAXPS(a, b) is (a > b ? a : b), which match the comparisons above
+    static void update_min_max(const float* values, size_t size, float& min, float& max) {
+      size_t i = 0;
+    #ifdef KLL_SSE2
+      if (size >= 8) {
+        __m128 min1 = _mm_set1_ps(min);
+        __m128 max1 = _mm_set1_ps(max);
+        __m128 min2 = min1;
+        __m128 max2 = max1;
+        for (; i + 8 <= size; i += 8) {
+          const __m128 v1 = _mm_loadu_ps(values + i);
+          const __m128 v2 = _mm_loadu_ps(values + i + 4);
+          min1 = _mm_min_ps(v1, min1);
+          max1 = _mm_max_ps(v1, max1);
+          min2 = _mm_min_ps(v2, min2);
+          max2 = _mm_max_ps(v2, max2);
+        }
+        float lanes[8];
+        _mm_storeu_ps(lanes, min1);
+        _mm_storeu_ps(lanes + 4, min2);
+        for (int j = 0; j < 8; j++) if (lanes[j] < min) min = lanes[j];
+        _mm_storeu_ps(lanes, max1);
+        _mm_storeu_ps(lanes + 4, max2);
+        for (int j = 0; j < 8; j++) if (max < lanes[j]) max = lanes[j];
+      }
+    #endif
+      update_min_max<float>(values + i, size - i, min, max);
+    }
+
+    static void update_min_max(const double* values, size_t size, double& min, double& max) {
+      size_t i = 0;
+    #ifdef KLL_SSE2
+      if (size >= 4) {
+        __m128d min1 = _mm_set1_pd(min);
+        __m128d max1 = _mm_set1_pd(max);
+        __m128d min2 = min1;
+        __m128d max2 = max1;
+        for (; i + 4 <= size; i += 4) {
+          const __m128d v1 = _mm_loadu_pd(values + i);
+          const __m128d v2 = _mm_loadu_pd(values + i + 2);
+          min1 = _mm_min_pd(v1, min1);
+          max1 = _mm_max_pd(v1, max1);
+          min2 = _mm_min_pd(v2, min2);
+          max2 = _mm_max_pd(v2, max2);
+        }
+        double lanes[4];
+        _mm_storeu_pd(lanes, min1);
+        _mm_storeu_pd(lanes + 2, min2);
+        for (int j = 0; j < 4; j++) if (lanes[j] < min) min = lanes[j];
+        _mm_storeu_pd(lanes, max1);
+        _mm_storeu_pd(lanes + 2, max2);
+        for (int j = 0; j < 4; j++) if (max < lanes[j]) max = lanes[j];
+      }
+    #endif
+      update_min_max<double>(values + i, size - i, min, max);
+    }
+
+    /*
+     * Same as std::lower_bound. For arithmetic types the search has no data-dependent branches,
+     * so that the comparison becomes a conditional move instead of a mispredicted jump.
+     */
+    template <typename T>
+    static typename std::enable_if<std::is_arithmetic<T>::value, const T*>::type
+    lower_bound(const T* first, const T* last, const T& value) {
+      size_t length(last - first);
+      if (length == 0) return first;
+      while (length > 1) {
+        const size_t half(length / 2);
+        first = (first[half] < value) ? first + half : first;
+        length -= half;
+      }
+      return first + (*first < value);
+    }
+
+    template <typename T>
+    static typename std::enable_if<!std::is_arithmetic<T>::value, const T*>::type
+    lower_bound(const T* first, const T* last, const T& value) {
+      return std::lower_bound(first, last, value);
+    }
+
+    // NaN values cannot be ordered, and no value is less than NaN
+    template <typename T>
+    static typename std::enable_if<std::is_floating_point<T>::value, bool>::type
+    is_nan(const T& value) {
+      return std::isnan(value);
+    }
+
+    template <typename T>
+    static typename std::enable_if<!std::is_floating_point<T>::value, bool>::type
+    is_nan(const T&) {
+      return false;
+    }
+
     /*
      * This version is for floating point types
      * Checks the sequential validity of the given array of values.
@@ -124,8 +320,59 @@ class kll_helper {
       }
     }
 
+    /*
+     * Sorts level zero before it is compacted or queried. Integral and floating point items are sorted
+     * by an LSD radix sort of their keys (see kll_radix_key), one byte per pass, which is faster than
+     * std::sort unless the level is small. Passes in which all keys have the same byte are skipped.
+     * Small levels and other types use std::sort.
+     */
+    template <typename T>
+    static typename std::enable_if<kll_radix_key<T>::is_supported, void>::type
+    sort_items(T* first, T* last) {
+      const uint32_t size(last - first);
+      if (size < RADIX_SORT_MIN_ITEMS_PER_BYTE * sizeof(T)) {
+        std::sort(first, last);
+        return;
+      }
+      typedef kll_radix_key<T> radix_key;
+      typedef typename radix_key::type key_type;
+      const uint8_t num_digits(sizeof(key_type));
+      std::unique_ptr<key_type[]> buffer(new key_type[2 * size]);
+      key_type* keys(buffer.get());
+      key_type* keys_tmp(buffer.get() + size);
+      uint32_t counts[sizeof(key_type)][256];
+      memset(counts, 0, sizeof(counts));
+      for (uint32_t i = 0; i < size; i++) {
+        const key_type key(radix_key::to_key(first[i]));
+        keys[i] = key;
+        for (uint8_t d = 0; d < num_digits; d++) counts[d][(key >> (d * 8)) & 0xff]++;
+      }
+      for (uint8_t d = 0; d < num_digits; d++) {
+        const uint8_t shift(d * 8);
+        uint32_t* digit_counts(counts[d]);
+        if (digit_counts[(keys[0] >> shift) & 0xff] == size) continue;
+        uint32_t offset(0);
+        for (uint32_t i = 0; i < 256; i++) {
+          const uint32_t count(digit_counts[i]);
+          digit_counts[i] = offset;
+          offset += count;
+        }
+        for (uint32_t i = 0; i < size; i++) {
+          keys_tmp[digit_counts[(keys[i] >> shift) & 0xff]++] = keys[i];
+        }
+        std::swap(keys, keys_tmp);
+      }
+      for (uint32_t i = 0; i < size; i++) first[i] = radix_key::from_key(keys[i]);
+    }
+
     template <typename T>
-    static void randomly_halve_down(T* buf, uint32_t start, uint32_t length) {
+    static typename std::enable_if<!kll_radix_key<T>::is_supported, void>::type
+    sort_items(T* first, T* last) {
+      std::sort(first, last);
+    }
+
+    template <typename T>
+    static void randomly_halve_down(T* buf, uint32_t start, uint32_t length, kll_random_bits& random_bit) {
       if (!is_even(length)) throw std::invalid_argument("length must be even");
       const uint32_t half_length(length / 2);
     #ifdef KLL_VALIDATION
@@ -135,13 +382,13 @@ class kll_helper {
     #endif
       uint32_t j(start + offset);
       for (uint32_t i = start; i < (start + half_length); i++) {
-        buf[i] = std::move(buf[j]);
+        if (i != j) buf[i] = std::move(buf[j]); // a self-move may leave the item empty (std::string does)
         j += 2;
       }
     }
 
     template <typename T>
-    static void randomly_halve_up(T* buf, uint32_t start, uint32_t length) {
+    static void randomly_halve_up(T* buf, uint32_t start, uint32_t length, kll_random_bits& random_bit) {
       if (!is_even(length)) throw std::invalid_argument("length must be even");
       const uint32_t half_length(length / 2);
     #ifdef KLL_VALIDATION
@@ -151,13 +398,44 @@ class kll_helper {
     #endif
       uint32_t j((start + length) - 1 - offset);
       for (uint32_t i = (start + length) - 1; i >= (start + half_length); i--) {
-        buf[i] = std::move(buf[j]);
+        if (i != j) buf[i] = std::move(buf[j]);
         j -= 2;
       }
     }
 
+    /*
+     * For arithmetic types the merge has no data-dependent branches: both items are read,
+     * and the comparison picks which one is written and which input advances.
+     * This is faster unless the order of the inputs is very predictable.
+     * c may overlap b as long as it starts before b (as in the compaction), since both
+     * items are read before the write, and the write does not get ahead of b.
+     */
     template <typename T>
-    static void merge_sorted_arrays(const T* buf_a, uint32_t start_a, uint32_t len_a, const T* buf_b, uint32_t start_b, uint32_t len_b, T* buf_c, uint32_t start_c) {
+    static typename std::enable_if<std::is_arithmetic<T>::value, void>::type
+    merge_sorted_arrays(const T* buf_a, uint32_t start_a, uint32_t len_a, const T* buf_b, uint32_t start_b, uint32_t len_b, T* buf_c, uint32_t start_c) {
+      const T* a_items(buf_a + start_a);
+      const T* b_items(buf_b + start_b);
+      T* c_items(buf_c + start_c);
+      uint32_t a(0);
+      uint32_t b(0);
+      uint32_t c(0);
+      while (a < len_a and b < len_b) {
+        const T item_a(a_items[a]);
+        const T item_b(b_items[b]);
+        const bool take_a(item_a < item_b);
+        c_items[c++] = take_a ? item_a : item_b;
+        a += take_a;
+        b += !take_a;
+      }
+      while (a < len_a) c_items[c++] = a_items[a++];
+      if (c_items + c != b_items + b) { // otherwise the rest of b is in place already
+        while (b < len_b) c_items[c++] = b_items[b++];
+      }
+    }
+
+    template <typename T>
+    static typename std::enable_if<!std::is_arithmetic<T>::value, void>::type
+    merge_sorted_arrays(const T* buf_a, uint32_t start_a, uint32_t len_a, const T* buf_b, uint32_t start_b, uint32_t len_b, T* buf_c, uint32_t start_c) {
       const uint32_t len_c(len_a + len_b);
       const uint32_t lim_a(start_a + len_a);
       const uint32_t lim_b(start_b + len_b);
@@ -184,6 +462,39 @@ class kll_helper {
       if (a != lim_a || b != lim_b) throw std::logic_error("inconsistent state");
     }
 
+    /*
+     * Merges the given sorted ranges into out, and returns the end of the output.
+     * A binary heap keeps the ranges ordered by their next item.
+     */
+    template <typename T>
+    static T* k_way_merge(std::vector<std::pair<const T*, const T*>>& runs, T* out) {
+      if (runs.size() == 0) return out;
+      if (runs.size() == 1) return std::copy(runs[0].first, runs[0].second, out);
+      if (runs.size() == 2) {
+        const uint32_t len_a(runs[0].second - runs[0].first);
+        const uint32_t len_b(runs[1].second - runs[1].first);
+        merge_sorted_arrays(runs[0].first, 0, len_a, runs[1].first, 0, len_b, out, 0);
+        return out + len_a + len_b;
+      }
+      // the heap comparator is "greater" to put the smallest item on top
+      auto greater = [](const std::pair<const T*, const T*>& a, const std::pair<const T*, const T*>& b) {
+        return *b.first < *a.first;
+      };
+      std::make_heap(runs.begin(), runs.end(), greater);
+      auto heap_end = runs.end();
+      while (heap_end != runs.begin()) {
+        std::pop_heap(runs.begin(), heap_end, greater);
+        auto& run = *(heap_end - 1);
+        *out++ = *run.first++;
+        if (run.first == run.second) {
+          --heap_end;
+        } else {
+          std::push_heap(runs.begin(), heap_end, greater);
+        }
+      }
+      return out;
+    }
+
     struct compress_result {
       uint8_t final_num_levels;
       uint32_t final_capacity;
@@ -215,7 +526,7 @@ class kll_helper {
      */
     template <typename T>
     static compress_result general_compress(uint16_t k, uint8_t m, uint8_t num_levels_in, T* in_buf,
-            uint32_t* in_levels, T* out_buf, uint32_t* out_levels, bool is_level_zero_sorted)
+            uint32_t* in_levels, T* out_buf, uint32_t* out_levels, bool is_level_zero_sorted, kll_random_bits& random_bit)
     {
       if (num_levels_in == 0) throw std::invalid_argument("num_levels_in == 0"); // things are too weird if zero levels are allowed
       uint8_t num_levels(num_levels_in);
@@ -261,13 +572,13 @@ class kll_helper {
 
           // level zero might not be sorted, so we must sort it if we wish to compact it
           if ((cur_level == 0) and !is_level_zero_sorted) {
-            std::sort(&in_buf[adj_beg], &in_buf[adj_beg + adj_pop]);
+            sort_items(&in_buf[adj_beg], &in_buf[adj_beg + adj_pop]);
           }
 
           if (pop_above == 0) { // Level above is empty, so halve up
-            randomly_halve_up(in_buf, adj_beg, adj_pop);
+            randomly_halve_up(in_buf, adj_beg, adj_pop, random_bit);
           } else { // Level above is nonempty, so halve down, then merge up
-            randomly_halve_down(in_buf, adj_beg, adj_pop);
+            randomly_halve_down(in_buf, adj_beg, adj_pop, random_bit);
             merge_sorted_arrays(in_buf, adj_beg, half_adj_pop, in_buf, raw_lim, pop_above, in_buf, adj_beg + half_adj_pop);
           }
 
@@ -301,8 +612,193 @@ class kll_helper {
       return result;
     }
 
-#ifdef KLL_VALIDATION
+    /*
+     * A compact form of a level of integral or floating point items for serialization.
+     * The items are mapped to their keys (see kll_radix_key), which have the same order, so a sorted level
+     * is stored as its first key and the differences between neighbors, and an unsorted one
+     * as its smallest key and the differences from it. The differences are bit packed in blocks
+     * of COMPRESSION_BLOCK_SIZE, each as wide as its largest difference needs, so an outlier
+     * costs bits only in its own block. The low bits that are zero in all differences of a block
+     * are dropped, which is what makes floating point items with few significant digits small
+     * (the differences of their keys end with the unused bits of the mantissa).
+     * Layout: the base key, then for each block the width and the number of dropped bits (1 byte each)
+     * and the packed bits. The bytes are passed to write(const char*, size_t) in pieces.
+     */
+    template <typename T, typename W>
+    static typename std::enable_if<kll_radix_key<T>::is_supported, void>::type
+    compress_items(const T* items, uint32_t size, bool is_sorted, W write) {
+      if (size == 0) return;
+      typedef kll_radix_key<T> radix_key;
+      typedef typename radix_key::type key_type;
+      key_type base(radix_key::to_key(items[0]));
+      if (!is_sorted) {
+        for (uint32_t i = 1; i < size; i++) base = std::min(base, radix_key::to_key(items[i]));
+      }
+      write(reinterpret_cast<const char*>(&base), sizeof(base));
+      // a sorted level starts with the first item, which is the base
+      key_type previous(base);
+      uint64_t deltas[COMPRESSION_BLOCK_SIZE];
+      char packed[2 + COMPRESSION_BLOCK_SIZE * sizeof(uint64_t) + sizeof(uint64_t)];
+      for (uint32_t block = is_sorted ? 1 : 0; block < size; block += COMPRESSION_BLOCK_SIZE) {
+        const uint32_t count(size - block < COMPRESSION_BLOCK_SIZE ? size - block : COMPRESSION_BLOCK_SIZE);
+        uint64_t all_bits(0);
+        for (uint32_t i = 0; i < count; i++) {
+          const key_type key(radix_key::to_key(items[block + i]));
+          deltas[i] = static_cast<key_type>(key - previous);
+          all_bits |= deltas[i];
+          if (is_sorted) previous = key;
+        }
+        const uint8_t shift(trailing_zeros(all_bits));
+        const uint8_t width(bit_width(all_bits >> shift));
+        if (shift > 0) {
+          for (uint32_t i = 0; i < count; i++) deltas[i] >>= shift;
+        }
+        packed[0] = width;
+        packed[1] = shift;
+        const size_t length(pack_bits(deltas, count, width, packed + 2));
+        write(packed, 2 + length);
+      }
+    }
+
+    // an upper bound of the bytes that compress_items() writes for the given number of items
+    template <typename T>
+    static size_t max_compressed_size(uint32_t size) {
+      if (size == 0) return 0;
+      const size_t num_blocks((size + COMPRESSION_BLOCK_SIZE - 1) / COMPRESSION_BLOCK_SIZE);
+      return sizeof(T) * (static_cast<size_t>(size) + 1) + 2 * num_blocks;
+    }
+
+    // reads what compress_items() wrote, and returns the end, or throws if that is past the given end
+    template <typename T>
+    static typename std::enable_if<kll_radix_key<T>::is_supported, const char*>::type
+    uncompress_items(const char* ptr, const char* end, uint32_t size, bool is_sorted, T* items) {
+      if (size == 0) return ptr;
+      typedef kll_radix_key<T> radix_key;
+      typedef typename radix_key::type key_type;
+      key_type base;
+      check_compressed_size(ptr, end, sizeof(base));
+      memcpy(&base, ptr, sizeof(base));
+      ptr += sizeof(base);
+      if (is_sorted) items[0] = radix_key::from_key(base);
+      key_type key(base);
+      uint64_t deltas[COMPRESSION_BLOCK_SIZE];
+      // a copy of the packed bits with room for reading whole words at the end
+      char packed[COMPRESSION_BLOCK_SIZE * sizeof(uint64_t) + sizeof(uint64_t)];
+      for (uint32_t block = is_sorted ? 1 : 0; block < size; block += COMPRESSION_BLOCK_SIZE) {
+        const uint32_t count(size - block < COMPRESSION_BLOCK_SIZE ? size - block : COMPRESSION_BLOCK_SIZE);
+        check_compressed_size(ptr, end, 2);
+        const uint8_t width(ptr[0]);
+        const uint8_t shift(ptr[1]);
+        ptr += 2;
+        if (width + shift > sizeof(key_type) * 8) {
+          throw std::invalid_argument("Possible corruption: bit width " + std::to_string(width) + " and shift " + std::to_string(shift));
+        }
+        const size_t length((static_cast<size_t>(count) * width + 7) / 8);
+        check_compressed_size(ptr, end, length);
+        memcpy(packed, ptr, length);
+        memset(packed + length, 0, sizeof(uint64_t));
+        ptr += length;
+        unpack_bits(packed, count, width, deltas);
+        if (is_sorted) {
+          for (uint32_t i = 0; i < count; i++) {
+            key += static_cast<key_type>(deltas[i] << shift);
+            items[block + i] = radix_key::from_key(key);
+          }
+        } else {
+          for (uint32_t i = 0; i < count; i++) items[block + i] = radix_key::from_key(static_cast<key_type>(base + (deltas[i] << shift)));
+        }
+      }
+      return ptr;
+    }
+
+    template <typename T, typename W>
+    static typename std::enable_if<!kll_radix_key<T>::is_supported, void>::type
+    compress_items(const T*, uint32_t, bool, W) {
+      throw std::invalid_argument("compressed serialization is not supported for this type of items");
+    }
+
+    template <typename T>
+    static typename std::enable_if<!kll_radix_key<T>::is_supported, const char*>::type
+    uncompress_items(const char*, const char*, uint32_t, bool, T*) {
+      throw std::invalid_argument("compressed serialization is not supported for this type of items");
+    }
+
   private:
+    // std::sort is faster below this many items per pass of the radix sort (measured with random items)
+    static const uint32_t RADIX_SORT_MIN_ITEMS_PER_BYTE = 32;
+
+    static const uint32_t COMPRESSION_BLOCK_SIZE = 128;
+
+#if defined(_MSC_VER)
+    static uint8_t bit_width(uint64_t value) {
+      unsigned long index;
+      return _BitScanReverse64(&index, value) ? index + 1 : 0;
+    }
+
+    static uint8_t trailing_zeros(uint64_t value) {
+      unsigned long index;
+      return _BitScanForward64(&index, value) ? index : 0;
+    }
+#else
+    static uint8_t bit_width(uint64_t value) {
+      return value == 0 ? 0 : 64 - __builtin_clzll(value);
+    }
+
+    static uint8_t trailing_zeros(uint64_t value) {
+      return value == 0 ? 0 : __builtin_ctzll(value);
+    }
+#endif
+
+    /*
+     * Little endian from the lowest bit, a whole word at a time, and returns the number of bytes used.
+     * Writes up to 8 bytes past them.
+     */
+    static size_t pack_bits(const uint64_t* values, uint32_t count, uint8_t width, char* ptr) {
+      if (width == 0) return 0;
+      char* const start(ptr);
+      uint64_t buffer(0);
+      uint8_t num_bits(0);
+      for (uint32_t i = 0; i < count; i++) {
+        buffer |= values[i] << num_bits;
+        num_bits += width;
+        if (num_bits >= 64) {
+          memcpy(ptr, &buffer, sizeof(buffer));
+          ptr += sizeof(buffer);
+          num_bits -= 64;
+          // the high bits of the value that did not fit
+          buffer = num_bits > 0 ? values[i] >> (width - num_bits) : 0;
+        }
+      }
+      memcpy(ptr, &buffer, sizeof(buffer));
+      return (ptr - start) + (num_bits + 7) / 8;
+    }
+
+    // reads up to 8 bytes past the packed bits
+    static void unpack_bits(const char* ptr, uint32_t count, uint8_t width, uint64_t* values) {
+      if (width == 0) {
+        std::fill(values, values + count, 0);
+        return;
+      }
+      const uint64_t mask(width == 64 ? ~static_cast<uint64_t>(0) : (static_cast<uint64_t>(1) << width) - 1);
+      uint64_t position(0);
+      for (uint32_t i = 0; i < count; i++) {
+        const char* word_ptr(ptr + (position >> 3));
+        const uint8_t offset(position & 7);
+        uint64_t word;
+        memcpy(&word, word_ptr, sizeof(word));
+        uint64_t value(word >> offset);
+        // the bits beyond the word
+        if (offset + width > 64) value |= static_cast<uint64_t>(static_cast<unsigned char>(word_ptr[8])) << (64 - offset);
+        values[i] = value & mask;
+        position += width;
+      }
+    }
+
+    static void check_compressed_size(const char* ptr, const char* end, size_t size) {
+      if (static_cast<size_t>(end - ptr) < size) throw std::invalid_argument("Possible corruption: compressed items are truncated");
+    }
+
+#ifdef KLL_VALIDATION
 
     static uint32_t deterministic_offset() {
       const uint32_t result(kll_next_offset);
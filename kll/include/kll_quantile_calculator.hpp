@@ -8,25 +8,37 @@
 
 #include <memory>
 #include <cmath>
+#include <algorithm>
+#include <type_traits>
 #include <assert.h>
 
+#include "kll_helper.hpp"
+
 namespace datasketches {
 
+/*
+ * A sorted view of the items retained by a sketch with the cumulative weights
+ * that answers the quantile and rank queries with binary searches.
+ * It does not change after it is built, so the sketch keeps it until the next update or merge.
+ */
 template <typename T>
 class kll_quantile_calculator {
   public:
-    // assumes that all levels are sorted including level 0
-    kll_quantile_calculator(const T* items, const uint32_t* levels, uint8_t num_levels, uint64_t n) {
+    // assumes that all levels except level 0 are sorted
+    kll_quantile_calculator(const T* items, const uint32_t* levels, uint8_t num_levels, uint64_t n, bool is_level_zero_sorted) {
       n_ = n;
-      const uint32_t num_items(levels[num_levels] - levels[0]);
-      items_ = new T[num_items];
-      weights_ = new uint64_t[num_items + 1]; // one more is intentional
+      num_items_ = levels[num_levels] - levels[0];
+      items_ = new T[num_items_];
+      weights_ = new uint64_t[num_items_ + 1]; // one more is intentional
       levels_ = new uint32_t[num_levels + 1];
-      populate_from_sketch(items, num_items, levels, num_levels);
-      blocky_tandem_merge_sort(items_, weights_, num_items, levels_, num_levels_);
-      convert_to_preceding_cummulative(weights_, num_items + 1);
+      populate_from_sketch(items, num_items_, levels, num_levels, is_level_zero_sorted);
+      blocky_tandem_merge_sort(items_, weights_, num_items_, levels_, num_levels_);
+      convert_to_preceding_cummulative(weights_, num_items_ + 1);
     }
 
+    kll_quantile_calculator(const kll_quantile_calculator&) = delete;
+    kll_quantile_calculator& operator=(const kll_quantile_calculator&) = delete;
+
     ~kll_quantile_calculator() {
       delete [] items_;
       delete [] weights_;
@@ -37,15 +49,51 @@ class kll_quantile_calculator {
       return approximately_answer_positional_query(pos_of_phi(fraction, n_));
     }
 
+    // the total weight of the retained items that are less than the given value
+    uint64_t get_weight_less_than(const T& value) const {
+      const T* position = kll_helper::lower_bound(items_, items_ + num_items_, value);
+      return weights_[position - items_];
+    }
+
+    /*
+     * The same for many values in one walk over the items.
+     * order is the permutation of the values that sorts them, or nullptr if they are sorted already.
+     * Each search gallops forward from the previous position, so this takes O(m log(n/m)) comparisons
+     * for m values and n items, which is never worse than m binary searches or a full merge.
+     */
+    void get_weights_less_than(const T* values, const uint32_t* order, uint32_t size, uint64_t* weights) const {
+      const T* end(items_ + num_items_);
+      const T* position(items_);
+      for (uint32_t i = 0; i < size; i++) {
+        const uint32_t index(order == nullptr ? i : order[i]);
+        const T& value(values[index]);
+        size_t step(1);
+        const T* bound(position);
+        while (bound < end and *bound < value) {
+          position = bound + 1;
+          bound = (static_cast<size_t>(end - bound) > step) ? bound + step : end;
+          step *= 2;
+        }
+        position = kll_helper::lower_bound(position, bound, value);
+        weights[index] = weights_[position - items_];
+      }
+    }
+
+    uint64_t get_n() const {
+      return n_;
+    }
+
   private:
     uint64_t n_;
+    uint32_t num_items_;
     T* items_;
     uint64_t* weights_;
     uint32_t* levels_;
     uint8_t num_levels_;
 
-    void populate_from_sketch(const T* items, uint32_t num_items, const uint32_t* levels, uint8_t num_levels) {
+    void populate_from_sketch(const T* items, uint32_t num_items, const uint32_t* levels, uint8_t num_levels, bool is_level_zero_sorted) {
       std::copy(&items[levels[0]], &items[levels[num_levels]], items_);
+      if (!is_level_zero_sorted) kll_helper::sort_items(items_, &items_[levels[1] - levels[0]]);
       uint8_t src_level(0);
       uint8_t dst_level(0);
       uint64_t weight(1);
@@ -76,7 +124,7 @@ class kll_quantile_calculator {
     static void convert_to_preceding_cummulative(uint64_t* weights, uint32_t weights_size) {
       uint64_t subtotal(0);
       for (uint32_t i = 0; i < weights_size; i++) {
-        const uint32_t new_subtotal = subtotal + weights[i];
+        const uint64_t new_subtotal = subtotal + weights[i];
         weights[i] = subtotal;
         subtotal = new_subtotal;
       }
@@ -140,6 +188,37 @@ class kll_quantile_calculator {
       auto i_src_2 = from_index_2;
       auto i_dst = from_index_1;
 
+      tandem_merge_loop(items_src, weights_src, items_dst, weights_dst, i_src_1, to_index_1, i_src_2, to_index_2, i_dst);
+      if (i_src_1 < to_index_1) {
+        std::copy(&items_src[i_src_1], &items_src[to_index_1], &items_dst[i_dst]);
+        std::copy(&weights_src[i_src_1], &weights_src[to_index_1], &weights_dst[i_dst]);
+      } else if (i_src_2 < to_index_2) {
+        std::copy(&items_src[i_src_2], &items_src[to_index_2], &items_dst[i_dst]);
+        std::copy(&weights_src[i_src_2], &weights_src[to_index_2], &weights_dst[i_dst]);
+      }
+    }
+
+    // the common part of both ranges, without data-dependent branches for arithmetic types (see kll_helper::merge_sorted_arrays())
+    template <typename TT = T>
+    static typename std::enable_if<std::is_arithmetic<TT>::value, void>::type
+    tandem_merge_loop(const T* items_src, const uint64_t* weights_src, T* items_dst, uint64_t* weights_dst,
+        uint32_t& i_src_1, uint32_t to_index_1, uint32_t& i_src_2, uint32_t to_index_2, uint32_t& i_dst) {
+      while ((i_src_1 < to_index_1) and (i_src_2 < to_index_2)) {
+        const T item_1(items_src[i_src_1]);
+        const T item_2(items_src[i_src_2]);
+        const bool take_1(item_1 < item_2);
+        items_dst[i_dst] = take_1 ? item_1 : item_2;
+        weights_dst[i_dst] = take_1 ? weights_src[i_src_1] : weights_src[i_src_2];
+        i_src_1 += take_1;
+        i_src_2 += !take_1;
+        i_dst++;
+      }
+    }
+
+    template <typename TT = T>
+    static typename std::enable_if<!std::is_arithmetic<TT>::value, void>::type
+    tandem_merge_loop(const T* items_src, const uint64_t* weights_src, T* items_dst, uint64_t* weights_dst,
+        uint32_t& i_src_1, uint32_t to_index_1, uint32_t& i_src_2, uint32_t to_index_2, uint32_t& i_dst) {
       while ((i_src_1 < to_index_1) and (i_src_2 < to_index_2)) {
         if (items_src[i_src_1] < items_src[i_src_2]) {
           items_dst[i_dst] = items_src[i_src_1];
@@ -152,13 +231,6 @@ class kll_quantile_calculator {
         }
         i_dst++;
       }
-      if (i_src_1 < to_index_1) {
-        std::copy(&items_src[i_src_1], &items_src[to_index_1], &items_dst[i_dst]);
-        std::copy(&weights_src[i_src_1], &weights_src[to_index_1], &weights_dst[i_dst]);
-      } else if (i_src_2 < to_index_2) {
-        std::copy(&items_src[i_src_2], &items_src[to_index_2], &items_dst[i_dst]);
-        std::copy(&weights_src[i_src_2], &weights_src[to_index_2], &weights_dst[i_dst]);
-      }
     }
 
 };
@@ -11,6 +11,11 @@
 #include <iostream>
 #include <iomanip>
 #include <functional>
+#include <vector>
+#include <thread>
+#include <exception>
+#include <utility>
+#include <type_traits>
 #include <string.h>
 
 #include "kll_quantile_calculator.hpp"
@@ -161,6 +166,9 @@ typedef std::unique_ptr<void, std::function<void(void*)>> ptr_with_deleter;
 // forward-declarations
 template <typename T, typename A> class kll_sketch;
 template <typename T, typename A> std::ostream& operator<<(std::ostream& os, kll_sketch<T, A> const& sketch);
+template <typename T> class kll_sketch_view;
+template <typename T, uint16_t K, uint8_t LG_MAX_N> class kll_sketch_fixed;
+class kll_string_sketch;
 
 template <typename T, typename A = std::allocator<void>>
 class kll_sketch {
@@ -173,7 +181,9 @@ class kll_sketch {
     static const uint16_t MIN_K = DEFAULT_M;
     static const uint16_t MAX_K = (1 << 16) - 1; // serialized as an uint16_t
 
-    explicit kll_sketch(uint16_t k = DEFAULT_K) : alloc_t(AllocT()), alloc_u32(AllocU32()) {
+    // the seed determines the random choices of compaction, a different one is used for every sketch by default
+    explicit kll_sketch(uint16_t k = DEFAULT_K, uint64_t seed = kll_random_bits::default_seed()) :
+    random_bit_(seed), alloc_t(AllocT()), alloc_u32(AllocU32()) {
       if (k < MIN_K or k > MAX_K) {
         throw std::invalid_argument("K must be >= " + std::to_string(MIN_K) + " and <= " + std::to_string(MAX_K) + ": " + std::to_string(k));
       }
@@ -185,8 +195,7 @@ class kll_sketch {
       levels_size_ = 2;
       levels_ = new (alloc_u32.allocate(2)) uint32_t[2] {k_, k_};
       items_size_ = k_;
-      items_ = alloc_t.allocate(items_size_);
-      for (unsigned i = 0; i < items_size_; i++) alloc_t.construct(&items_[i], T());
+      items_ = alloc_t.allocate(items_size_); // see copy_items()
       if (std::is_floating_point<T>::value) {
         min_value_ = std::numeric_limits<T>::quiet_NaN();
         max_value_ = std::numeric_limits<T>::quiet_NaN();
@@ -194,7 +203,7 @@ class kll_sketch {
       is_level_zero_sorted_ = false;
     }
 
-    kll_sketch(const kll_sketch& other) : alloc_t(AllocT()), alloc_u32(AllocU32()) {
+    kll_sketch(const kll_sketch& other) : random_bit_(other.random_bit_), alloc_t(AllocT()), alloc_u32(AllocU32()) {
       k_ = other.k_;
       m_ = other.m_;
       min_k_ = other.min_k_;
@@ -205,12 +214,31 @@ class kll_sketch {
       std::copy(&other.levels_[0], &other.levels_[levels_size_], levels_);
       items_size_ = other.items_size_;
       items_ = alloc_t.allocate(items_size_);
-      for (unsigned i = 0; i < items_size_; i++) alloc_t.construct(&items_[i], other.items_[i]);
+      copy_items(&other.items_[levels_[0]], &other.items_[items_size_], &items_[levels_[0]]);
       min_value_ = other.min_value_;
       max_value_ = other.max_value_;
       is_level_zero_sorted_ = other.is_level_zero_sorted_;
+      if (other.deferred_.enabled) {
+        // the work left by deamortized updates is copied and finished in the copy
+        copy_deferred_work(other.deferred_);
+        flush();
+      }
     }
 
+    // takes the buffers of the other sketch, which can only be destroyed or assigned to afterwards
+    kll_sketch(kll_sketch&& other) noexcept(std::is_nothrow_move_constructible<T>::value) :
+    k_(other.k_), m_(other.m_), min_k_(other.min_k_), n_(other.n_), num_levels_(other.num_levels_),
+    levels_(other.levels_), levels_size_(other.levels_size_), items_(other.items_), items_size_(other.items_size_),
+    min_value_(std::move(other.min_value_)), max_value_(std::move(other.max_value_)),
+    is_level_zero_sorted_(other.is_level_zero_sorted_), random_bit_(other.random_bit_),
+    sorted_view_(std::move(other.sorted_view_)), deferred_(other.deferred_),
+    alloc_t(std::move(other.alloc_t)), alloc_u32(std::move(other.alloc_u32)) {
+      other.levels_ = nullptr;
+      other.items_ = nullptr;
+      other.deferred_ = deferred_compaction();
+    }
+
+    // takes other by value, so this is a copy or a move assignment
     kll_sketch& operator=(kll_sketch other) {
       std::swap(k_, other.k_);
       std::swap(m_, other.m_);
@@ -224,16 +252,59 @@ class kll_sketch {
       std::swap(min_value_, other.min_value_);
       std::swap(max_value_, other.max_value_);
       std::swap(is_level_zero_sorted_, other.is_level_zero_sorted_);
+      std::swap(random_bit_, other.random_bit_);
+      std::swap(sorted_view_, other.sorted_view_);
+      std::swap(deferred_, other.deferred_);
       return *this;
     }
 
     ~kll_sketch() {
-      alloc_u32.deallocate(levels_, levels_size_);
-      for (unsigned i = 0; i < items_size_; i++) alloc_t.destroy(&items_[i]);
+      release_deferred_work();
+      if (items_ == nullptr) return; // moved from
+      destroy_items(&items_[levels_[0]], &items_[items_size_]);
       alloc_t.deallocate(items_, items_size_);
+      alloc_u32.deallocate(levels_, levels_size_);
     }
 
+    // NaN is ignored, as it has no place in the order of the items
     void update(const T& value) {
+      insert(value);
+    }
+
+    // the same, but the value is moved into the sketch
+    void update(T&& value) {
+      insert(std::move(value));
+    }
+
+    // Equivalent to updating with each value in turn, but level zero is filled in chunks
+    // between compactions, and min and max are computed over the whole array (using SIMD for float and double)
+    void update(const T* values, size_t size) {
+      // the runs between NaN values, which are dropped as by update(value)
+      while (size > 0) {
+        size_t run(0);
+        while (run < size and !kll_helper::is_nan(values[run])) run++;
+        update_without_nan(values, run);
+        if (run < size) run++;
+        values += run;
+        size -= run;
+      }
+    }
+
+    /*
+     * Equivalent to updating with the value weight times, for data that is aggregated into (value, count) pairs.
+     * The value is inserted once into level h for every bit h that is set in the weight, since an item
+     * in level h stands for 2^h updates, so this takes O(log(weight)) insertions instead of weight updates.
+     * Levels above zero are kept sorted, so each of these insertions shifts the levels below by one slot.
+     * In the deamortized mode the pending work is finished first, and the compactions are not deferred.
+     */
+    void update(const T& value, uint64_t weight) {
+      if (weight == 0 or kll_helper::is_nan(value)) return;
+      if (weight == 1) {
+        update(value);
+        return;
+      }
+      flush();
+      sorted_view_.reset();
       if (is_empty()) {
         min_value_ = value;
         max_value_ = value;
@@ -241,12 +312,43 @@ class kll_sketch {
         if (value < min_value_) min_value_ = value;
         if (max_value_ < value) max_value_ = value;
       }
-      if (levels_[0] == 0) compress_while_updating();
-      n_++;
-      is_level_zero_sorted_ = false;
-      const uint32_t next_pos(levels_[0] - 1);
-      levels_[0] = next_pos;
-      items_[next_pos] = value;
+      for (uint8_t level = 0; weight > 0; level++) {
+        if (weight & 1) insert_into_level(value, level);
+        weight >>= 1;
+      }
+    }
+
+    /*
+     * In the deamortized mode a compaction is not done at once when level zero fills up.
+     * It is done a few items at a time over the following updates, while these updates are kept
+     * in a separate buffer of k items. This includes growing the buffer for a new top level and sorting
+     * level zero (with a heap sort, which can be stopped at any point). The work done in each update
+     * is chosen so that the compaction finishes well before the buffer fills up, so the cost of an update
+     * is bounded by a small constant instead of the size of the sketch, at the price of a higher average.
+     * Merging and copying first finish any work that is left (a copy finishes it in the copy), but queries
+     * and serialization do not change the sketch: they throw std::logic_error while a compaction
+     * is in progress, so call flush() after the updates.
+     * Given the same seed, the compactions are the same as without this mode.
+     */
+    void set_deamortized(bool deamortized) {
+      if (deamortized == deferred_.enabled) return;
+      if (deamortized) {
+        deferred_.staged = alloc_t.allocate(k_); // constructed as items are staged
+        deferred_.enabled = true;
+      } else {
+        flush();
+        release_deferred_work();
+        deferred_ = deferred_compaction();
+      }
+    }
+
+    bool is_deamortized() const {
+      return deferred_.enabled;
+    }
+
+    // finishes the compaction that deamortized updates left in progress, if any
+    void flush() {
+      if (deferred_.enabled) do_deferred_work(std::numeric_limits<uint32_t>::max());
     }
 
     void merge(const kll_sketch& other) {
@@ -254,10 +356,17 @@ class kll_sketch {
       if (m_ != other.m_) {
         throw std::invalid_argument("incompatible M: " + std::to_string(m_) + " and " + std::to_string(other.m_));
       }
+      if (other.is_work_pending()) {
+        merge(kll_sketch(other)); // a finished copy
+        return;
+      }
+      sorted_view_.reset();
+      flush();
       const uint64_t final_n(n_ + other.n_);
       for (uint32_t i = other.levels_[0]; i < other.levels_[1]; i++) {
         update(other.items_[i]);
       }
+      flush();
       if (other.num_levels_ >= 2) {
         merge_higher_levels(other, final_n);
       }
@@ -270,6 +379,70 @@ class kll_sketch {
       assert_correct_total_weight();
     }
 
+    /*
+     * Merges many sketches at once, which is much faster than merging them one by one
+     * since all of them are combined level by level and compacted only once.
+     */
+    void merge(const kll_sketch* const* others, size_t num_others) {
+      flush();
+      // finished copies of the deamortized sketches that have work in progress
+      std::vector<kll_sketch> finished;
+      finished.reserve(std::count_if(others, others + num_others, [](const kll_sketch* other) { return other->is_work_pending(); }));
+      std::vector<const kll_sketch*> sources;
+      uint64_t final_n(n_);
+      uint8_t provisional_num_levels(num_levels_);
+      uint32_t tmp_space_needed(get_num_retained());
+      for (size_t i = 0; i < num_others; i++) {
+        const kll_sketch& other = *others[i];
+        if (other.is_empty()) continue;
+        if (m_ != other.m_) {
+          throw std::invalid_argument("incompatible M: " + std::to_string(m_) + " and " + std::to_string(other.m_));
+        }
+        if (other.is_work_pending()) {
+          finished.push_back(other);
+          sources.push_back(&finished.back());
+        } else {
+          sources.push_back(&other);
+        }
+        final_n += other.n_;
+        provisional_num_levels = std::max(provisional_num_levels, sources.back()->num_levels_);
+        tmp_space_needed += sources.back()->get_num_retained();
+      }
+      if (sources.empty()) return;
+      if (sources.size() == 1) {
+        merge(*sources[0]);
+        return;
+      }
+      sorted_view_.reset();
+      const bool was_empty(is_empty());
+      merge_many(sources.data(), sources.size(), final_n, provisional_num_levels, tmp_space_needed);
+      is_level_zero_sorted_ = false;
+      for (const kll_sketch* other: sources) {
+        if (other->is_estimation_mode()) min_k_ = std::min(min_k_, other->min_k_);
+      }
+      if (was_empty) {
+        min_value_ = sources[0]->min_value_;
+        max_value_ = sources[0]->max_value_;
+      }
+      for (const kll_sketch* other: sources) {
+        if (other->min_value_ < min_value_) min_value_ = other->min_value_;
+        if (max_value_ < other->max_value_) max_value_ = other->max_value_;
+      }
+      n_ = final_n;
+      assert_correct_total_weight();
+    }
+
+    // merges a range of sketches at once, see above
+    template<typename InputIt>
+    void merge(InputIt first, InputIt last) {
+      std::vector<const kll_sketch*> others;
+      for (InputIt it = first; it != last; ++it) {
+        const kll_sketch& other = *it;
+        others.push_back(&other);
+      }
+      merge(others.data(), others.size());
+    }
+
     bool is_empty() const {
       return n_ == 0;
     }
@@ -279,10 +452,12 @@ class kll_sketch {
     }
 
     uint32_t get_num_retained() const {
+      check_no_work_pending();
       return levels_[num_levels_] - levels_[0];
     }
 
     bool is_estimation_mode() const {
+      check_no_work_pending();
       return num_levels_ > 1;
     }
 
@@ -318,14 +493,11 @@ class kll_sketch {
       if ((fraction < 0.0) or (fraction > 1.0)) {
         throw std::invalid_argument("Fraction cannot be less than zero or greater than 1.0");
       }
-      // has side effect of sorting level zero if needed
-      auto quantile_calculator(const_cast<kll_sketch*>(this)->get_quantile_calculator());
-      return quantile_calculator->get_quantile(fraction);
+      return get_sorted_view().get_quantile(fraction);
     }
 
     std::unique_ptr<T[]> get_quantiles(const double* fractions, uint32_t size) const {
       if (is_empty()) { return nullptr; }
-      std::unique_ptr<kll_quantile_calculator<T>> quantile_calculator;
       std::unique_ptr<T[]> quantiles(new T[size]);
       for (uint32_t i = 0; i < size; i++) {
         const double fraction = fractions[i];
@@ -334,36 +506,24 @@ class kll_sketch {
         }
         if      (fraction == 0.0) quantiles[i] = min_value_;
         else if (fraction == 1.0) quantiles[i] = max_value_;
-        else {
-          if (!quantile_calculator) {
-            // has side effect of sorting level zero if needed
-            quantile_calculator = const_cast<kll_sketch*>(this)->get_quantile_calculator();
-          }
-          quantiles[i] = quantile_calculator->get_quantile(fraction);
-        }
+        else quantiles[i] = get_sorted_view().get_quantile(fraction);
       }
-      return std::move(quantiles);
+      return quantiles;
     }
 
     double get_rank(const T& value) const {
       if (is_empty()) return std::numeric_limits<double>::quiet_NaN();
-      uint8_t level(0);
-      uint64_t weight(1);
-      uint64_t total(0);
-      while (level < num_levels_) {
-        const auto from_index(levels_[level]);
-        const auto to_index(levels_[level + 1]); // exclusive
-        for (uint32_t i = from_index; i < to_index; i++) {
-          if (items_[i] < value) {
-            total += weight;
-          } else if ((level > 0) or is_level_zero_sorted_) {
-            break; // levels above 0 are sorted, no point comparing further
-          }
-        }
-        level++;
-        weight *= 2;
-      }
-      return (double) total / n_;
+      return (double) get_sorted_view().get_weight_less_than(value) / n_;
+    }
+
+    // the ranks of many values in any order, which is much faster than calling get_rank() for each of them
+    std::unique_ptr<double[]> get_ranks(const T* values, uint32_t size) const {
+      if (is_empty()) return nullptr;
+      std::unique_ptr<uint64_t[]> weights(new uint64_t[size]);
+      get_weights_less_than(values, size, weights.get());
+      std::unique_ptr<double[]> ranks(new double[size]);
+      for (uint32_t i = 0; i < size; i++) ranks[i] = (double) weights[i] / n_;
+      return ranks;
     }
 
     std::unique_ptr<double[]> get_PMF(const T* split_points, uint32_t size) const {
@@ -378,12 +538,27 @@ class kll_sketch {
       return get_normalized_rank_error(min_k_, pmf);
     }
 
+    /*
+     * Returns the retained items in sorted order with their cumulative weights, which the quantile,
+     * rank, PMF and CDF queries use. It is built on the first query and kept until the sketch is
+     * updated or merged into, so repeated queries do not sort again.
+     * Like the queries, this is not safe to call from several threads at once.
+     */
+    const kll_quantile_calculator<T>& get_sorted_view() const {
+      check_no_work_pending();
+      if (!sorted_view_) {
+        sorted_view_.reset(new kll_quantile_calculator<T>(items_, levels_, num_levels_, n_, is_level_zero_sorted_));
+      }
+      return *sorted_view_;
+    }
+
     // this may need to be specialized to return correct size if sizeof(T) does not match the actual serialized size of an item
     // this method is for the user's convenience to predict the sketch size before serialization
     // and is not used in the serialization and deserialization code
     // predicting the size before serialization may not make sense if the item type is not of a fixed size (like string)
     uint32_t get_serialized_size_bytes() const {
       if (is_empty()) { return EMPTY_SIZE_BYTES; }
+      check_no_work_pending();
       return get_serialized_size_bytes(num_levels_, get_num_retained(), get_sizeof_item());
     }
 
@@ -407,39 +582,120 @@ class kll_sketch {
     }
 
     void serialize(std::ostream& os) const {
-      const bool is_single_item = n_ == 1;
-      const uint8_t preamble_ints(is_empty() or is_single_item ? PREAMBLE_INTS_SHORT : PREAMBLE_INTS_FULL);
-      os.write((char*)&preamble_ints, sizeof(preamble_ints));
-      const uint8_t serial_version(is_single_item ? SERIAL_VERSION_2 : SERIAL_VERSION_1);
-      os.write((char*)&serial_version, sizeof(serial_version));
-      const uint8_t family(FAMILY);
-      os.write((char*)&family, sizeof(family));
-      const uint8_t flags_byte(
-          (is_empty() ? 1 << flags::IS_EMPTY : 0)
-        | (is_level_zero_sorted_ ? 1 << flags::IS_LEVEL_ZERO_SORTED : 0)
-        | (is_single_item ? 1 << flags::IS_SINGLE_ITEM : 0)
-      );
-      os.write((char*)&flags_byte, sizeof(flags_byte));
-      os.write((char*)&k_, sizeof(k_));
-      os.write((char*)&m_, sizeof(m_));
-      const uint8_t unused(0);
-      os.write((char*)&unused, sizeof(unused));
+      serialize_to(os, false);
+    }
+
+    std::pair<ptr_with_deleter, const size_t> serialize(unsigned header_size_bytes = 0) const {
+      return serialize_to_bytes(header_size_bytes, false);
+    }
+
+    /*
+     * The same with the items of each level encoded in fewer bytes (see kll_helper::compress_items()),
+     * for integral and floating point items. How much smaller depends on the spread and precision of the items:
+     * a sketch of 1M latencies rounded to microseconds takes 1.4 bytes per retained item instead of 8 as double,
+     * while uniform random doubles still take about 6.6.
+     * deserialize() reads both forms, kll_sketch_view reads the uncompressed form only.
+     * A sketch with less than two items is not compressed.
+     */
+    void serialize_compressed(std::ostream& os) const {
+      static_assert(kll_radix_key<T>::is_supported, "compressed serialization requires integral or floating point items");
+      serialize_to(os, true);
+    }
+
+    std::pair<ptr_with_deleter, const size_t> serialize_compressed(unsigned header_size_bytes = 0) const {
+      static_assert(kll_radix_key<T>::is_supported, "compressed serialization requires integral or floating point items");
+      return serialize_to_bytes(header_size_bytes, true);
+    }
+
+    /*
+     * Writes the same bytes as serialize() to the given buffer, without allocating, and returns their number,
+     * so that many sketches can be packed into one buffer. Throws if the capacity is less than get_serialized_size_bytes().
+     * Only for items of a fixed size, for which that size is exact and is checked before anything is written.
+     */
+    size_t serialize_into(void* dst, size_t capacity) const {
+      static_assert(std::is_arithmetic<T>::value, "the size of the items must be known before they are written");
+      check_no_work_pending();
+      const size_t size = get_serialized_size_bytes();
+      if (capacity < size) {
+        throw std::invalid_argument("Buffer too small: " + std::to_string(capacity) + " bytes, need " + std::to_string(size));
+      }
+      const std::vector<T, AllocT> level_zero(sorted_level_zero());
+      if (write_bytes(static_cast<char*>(dst), false, std::vector<char>(), level_zero) != size) throw std::logic_error("serialized size mismatch");
+      return size;
+    }
+
+    /*
+     * The same bytes as pieces for a gathering write, such as writev() with struct iovec:
+     * everything up to the items is written to the given buffer, and the retained items are referenced in place.
+     * IoVec is any struct with iov_base and iov_len. Fills up to 2 of them and returns how many.
+     * The buffer needs get_serialized_size_bytes() less the size of the retained items,
+     * and the items must not change until they are written.
+     * Since level zero is referenced as it is, it is not sorted as in the other forms, and the flags say whether it is.
+     */
+    template <typename IoVec>
+    unsigned serialize_into(void* dst, size_t capacity, IoVec* iov) const {
+      static_assert(std::is_arithmetic<T>::value, "items can be referenced in place only if they are serialized as they are");
+      check_no_work_pending();
+      const size_t items_size = sizeof(T) * get_num_retained();
+      const size_t size = get_serialized_size_bytes() - items_size;
+      if (capacity < size) {
+        throw std::invalid_argument("Buffer too small: " + std::to_string(capacity) + " bytes, need " + std::to_string(size));
+      }
+      char* ptr = static_cast<char*>(dst);
+      ptr += write_header(ptr, false, is_level_zero_sorted_);
+      if (n_ > 1) {
+        ptr += serialize_items<T>(ptr, &min_value_, 1);
+        ptr += serialize_items<T>(ptr, &max_value_, 1);
+      }
+      if (ptr != static_cast<char*>(dst) + size) throw std::logic_error("serialized size mismatch");
+      iov[0].iov_base = dst;
+      iov[0].iov_len = size;
+      if (items_size == 0) return 1;
+      iov[1].iov_base = const_cast<T*>(&items_[levels_[0]]);
+      iov[1].iov_len = items_size;
+      return 2;
+    }
+
+  private:
+    void serialize_to(std::ostream& os, bool compress) const {
+      check_no_work_pending();
+      serialize_to(os, compress, sorted_level_zero());
+    }
+
+    // level zero is taken from sorted_level_zero()
+    void serialize_to(std::ostream& os, bool compress, const std::vector<T, AllocT>& level_zero) const {
+      const bool is_compressed = compress and n_ > 1;
+      // the fixed part in one write
+      char header[DATA_START + std::numeric_limits<uint8_t>::max() * sizeof(uint32_t)];
+      os.write(header, write_header(header, is_compressed, is_level_zero_sorted_ or !level_zero.empty()));
       if (is_empty()) return;
-      if (!is_single_item) {
-        os.write((char*)&n_, sizeof(n_));
-        os.write((char*)&min_k_, sizeof(min_k_));
-        os.write((char*)&num_levels_, sizeof(num_levels_));
-        os.write((char*)&unused, sizeof(unused));
-        os.write((char*)levels_, sizeof(levels_[0]) * num_levels_);
+      if (n_ > 1) {
         serialize_items<T>(os, &min_value_, 1);
         serialize_items<T>(os, &max_value_, 1);
       }
-      serialize_items<T>(os, &items_[levels_[0]], get_num_retained());
+      if (is_compressed) {
+        const std::vector<char> compressed(compress_levels(level_zero));
+        const uint32_t compressed_size(compressed.size());
+        os.write((char*)&compressed_size, sizeof(compressed_size));
+        os.write(compressed.data(), compressed_size);
+        return;
+      }
+      if (level_zero.empty()) {
+        serialize_items<T>(os, &items_[levels_[0]], get_num_retained());
+      } else {
+        serialize_items<T>(os, level_zero.data(), level_zero.size());
+        serialize_items<T>(os, &items_[levels_[1]], levels_[num_levels_] - levels_[1]);
+      }
     }
 
-    std::pair<ptr_with_deleter, const size_t> serialize(unsigned header_size_bytes = 0) const {
-      const bool is_single_item = n_ == 1;
-      const size_t size = header_size_bytes + get_serialized_size_bytes();
+    std::pair<ptr_with_deleter, const size_t> serialize_to_bytes(unsigned header_size_bytes, bool compress) const {
+      check_no_work_pending();
+      const bool is_compressed = compress and n_ > 1;
+      const std::vector<T, AllocT> level_zero(sorted_level_zero());
+      const std::vector<char> compressed(is_compressed ? compress_levels(level_zero) : std::vector<char>());
+      const size_t size = header_size_bytes + (is_compressed
+          ? get_serialized_size_bytes(num_levels_, 0, get_sizeof_item()) + sizeof(uint32_t) + compressed.size()
+          : get_serialized_size_bytes());
       typedef typename A::template rebind<char>::other AllocChar;
       AllocChar allocator;
       ptr_with_deleter data_ptr(
@@ -447,38 +703,90 @@ class kll_sketch {
         [size](void* ptr) { AllocChar allocator; allocator.deallocate(static_cast<char*>(ptr), size); }
       );
       char* ptr = static_cast<char*>(data_ptr.get()) + header_size_bytes;
+      if (header_size_bytes + write_bytes(ptr, is_compressed, compressed, level_zero) != size) throw std::logic_error("serialized size mismatch");
+      return std::make_pair(std::move(data_ptr), size);
+    }
+
+    // the preamble and the levels, returns the number of bytes
+    size_t write_header(char* ptr, bool is_compressed, bool is_level_zero_sorted) const {
+      char* const start = ptr;
+      const bool is_single_item = n_ == 1;
       const uint8_t preamble_ints(is_empty() or is_single_item ? PREAMBLE_INTS_SHORT : PREAMBLE_INTS_FULL);
       ptr += copy_to_mem(ptr, &preamble_ints, sizeof(preamble_ints));
-      const uint8_t serial_version(is_single_item ? SERIAL_VERSION_2 : SERIAL_VERSION_1);
+      const uint8_t serial_version(is_compressed ? SERIAL_VERSION_3 : is_single_item ? SERIAL_VERSION_2 : SERIAL_VERSION_1);
       ptr += copy_to_mem(ptr, &serial_version, sizeof(serial_version));
       const uint8_t family(FAMILY);
       ptr += copy_to_mem(ptr, &family, sizeof(family));
       const uint8_t flags_byte(
           (is_empty() ? 1 << flags::IS_EMPTY : 0)
-        | (is_level_zero_sorted_ ? 1 << flags::IS_LEVEL_ZERO_SORTED : 0)
+        | (is_level_zero_sorted ? 1 << flags::IS_LEVEL_ZERO_SORTED : 0)
         | (is_single_item ? 1 << flags::IS_SINGLE_ITEM : 0)
+        | (is_compressed ? 1 << flags::IS_COMPRESSED : 0)
       );
       ptr += copy_to_mem(ptr, &flags_byte, sizeof(flags_byte));
       ptr += copy_to_mem(ptr, &k_, sizeof(k_));
       ptr += copy_to_mem(ptr, &m_, sizeof(m_));
       const uint8_t unused(0);
       ptr += copy_to_mem(ptr, &unused, sizeof(unused));
+      if (!is_empty() and !is_single_item) {
+        ptr += copy_to_mem(ptr, &n_, sizeof(n_));
+        ptr += copy_to_mem(ptr, &min_k_, sizeof(min_k_));
+        ptr += copy_to_mem(ptr, &num_levels_, sizeof(num_levels_));
+        ptr += copy_to_mem(ptr, &unused, sizeof(unused));
+        ptr += copy_to_mem(ptr, levels_, sizeof(levels_[0]) * num_levels_);
+      }
+      return ptr - start;
+    }
+
+    // the whole serialized form with level zero taken from sorted_level_zero(), returns the number of bytes
+    size_t write_bytes(char* ptr, bool is_compressed, const std::vector<char>& compressed,
+        const std::vector<T, AllocT>& level_zero) const {
+      char* const start = ptr;
+      ptr += write_header(ptr, is_compressed, is_level_zero_sorted_ or !level_zero.empty());
       if (!is_empty()) {
-        if (!is_single_item) {
-          ptr += copy_to_mem(ptr, &n_, sizeof(n_));
-          ptr += copy_to_mem(ptr, &min_k_, sizeof(min_k_));
-          ptr += copy_to_mem(ptr, &num_levels_, sizeof(num_levels_));
-          ptr += copy_to_mem(ptr, &unused, sizeof(unused));
-          ptr += copy_to_mem(ptr, levels_, sizeof(levels_[0]) * num_levels_);
+        if (n_ > 1) {
           ptr += serialize_items<T>(ptr, &min_value_, 1);
           ptr += serialize_items<T>(ptr, &max_value_, 1);
         }
-        ptr += serialize_items<T>(ptr, &items_[levels_[0]], get_num_retained());
+        if (is_compressed) {
+          const uint32_t compressed_size(compressed.size());
+          ptr += copy_to_mem(ptr, &compressed_size, sizeof(compressed_size));
+          ptr += copy_to_mem(ptr, compressed.data(), compressed_size);
+        } else if (level_zero.empty()) {
+          ptr += serialize_items<T>(ptr, &items_[levels_[0]], get_num_retained());
+        } else {
+          ptr += serialize_items<T>(ptr, level_zero.data(), level_zero.size());
+          ptr += serialize_items<T>(ptr, &items_[levels_[1]], levels_[num_levels_] - levels_[1]);
+        }
       }
-      if (ptr != static_cast<char*>(data_ptr.get()) + size) throw std::logic_error("serialized size mismatch");
-      return std::make_pair(std::move(data_ptr), size);
+      return ptr - start;
     }
 
+    // level zero is taken from sorted_level_zero()
+    std::vector<char> compress_levels(const std::vector<T, AllocT>& level_zero) const {
+      std::vector<char> bytes;
+      const auto append([&bytes](const char* ptr, size_t size) { bytes.insert(bytes.end(), ptr, ptr + size); });
+      if (level_zero.empty()) {
+        kll_helper::compress_items(&items_[levels_[0]], levels_[1] - levels_[0], is_level_zero_sorted_, append);
+      } else {
+        kll_helper::compress_items(level_zero.data(), level_zero.size(), true, append);
+      }
+      for (uint8_t level = 1; level < num_levels_; level++) {
+        kll_helper::compress_items(&items_[levels_[level]], levels_[level + 1] - levels_[level], true, append);
+      }
+      return bytes;
+    }
+
+    // throws if the compressed items do not match the levels
+    void uncompress_levels(const char* ptr, const char* end) {
+      for (uint8_t level = 0; level < num_levels_; level++) {
+        ptr = kll_helper::uncompress_items(ptr, end, levels_[level + 1] - levels_[level], level > 0 or is_level_zero_sorted_, &items_[levels_[level]]);
+      }
+      if (ptr != end) throw std::invalid_argument("Possible corruption: compressed items size mismatch");
+    }
+
+  public:
+
     static std::unique_ptr<kll_sketch<T, A>, std::function<void(kll_sketch<T, A>*)>> deserialize(std::istream& is) {
       uint8_t preamble_ints;
       is.read((char*)&preamble_ints, sizeof(preamble_ints));
@@ -499,14 +807,21 @@ class kll_sketch {
       check_preamble_ints(preamble_ints, flags_byte);
       check_serial_version(serial_version);
       check_family_id(family_id);
+      check_compression(serial_version, flags_byte);
 
       typedef typename std::allocator_traits<A>::template rebind_alloc<kll_sketch<T, A>> AA;
       const bool is_empty(flags_byte & (1 << flags::IS_EMPTY));
-      std::unique_ptr<kll_sketch<T, A>, std::function<void(kll_sketch<T, A>*)>> sketch_ptr(
-          is_empty ? new (AA().allocate(1)) kll_sketch<T, A>(k) : new (AA().allocate(1)) kll_sketch<T, A>(k, flags_byte, is),
-          [](kll_sketch<T, A>* s) { s->~kll_sketch(); AA().deallocate(s, 1); }
-      );
-      return std::move(sketch_ptr);
+      kll_sketch<T, A>* storage(AA().allocate(1));
+      try {
+        std::unique_ptr<kll_sketch<T, A>, std::function<void(kll_sketch<T, A>*)>> sketch_ptr(
+            is_empty ? new (storage) kll_sketch<T, A>(k) : new (storage) kll_sketch<T, A>(k, flags_byte, is),
+            [](kll_sketch<T, A>* s) { s->~kll_sketch(); AA().deallocate(s, 1); }
+        );
+        return sketch_ptr;
+      } catch (...) {
+        AA().deallocate(storage, 1);
+        throw;
+      }
     }
 
     static std::unique_ptr<kll_sketch<T, A>, std::function<void(kll_sketch<T, A>*)>> deserialize(const void* bytes, size_t size) {
@@ -528,14 +843,63 @@ class kll_sketch {
       check_preamble_ints(preamble_ints, flags_byte);
       check_serial_version(serial_version);
       check_family_id(family_id);
+      check_compression(serial_version, flags_byte);
 
       typedef typename std::allocator_traits<A>::template rebind_alloc<kll_sketch<T, A>> AA;
       const bool is_empty(flags_byte & (1 << flags::IS_EMPTY));
-      std::unique_ptr<kll_sketch<T, A>, void(*)(kll_sketch<T, A>*)> sketch_ptr(
-          is_empty ? new (AA().allocate(1)) kll_sketch<T, A>(k) : new (AA().allocate(1)) kll_sketch<T, A>(k, flags_byte, bytes, size),
-          [](kll_sketch<T, A>* s) { s->~kll_sketch(); AA().deallocate(s, 1); }
-      );
-      return std::move(sketch_ptr);
+      kll_sketch<T, A>* storage(AA().allocate(1));
+      try {
+        std::unique_ptr<kll_sketch<T, A>, void(*)(kll_sketch<T, A>*)> sketch_ptr(
+            is_empty ? new (storage) kll_sketch<T, A>(k) : new (storage) kll_sketch<T, A>(k, flags_byte, bytes, size),
+            [](kll_sketch<T, A>* s) { s->~kll_sketch(); AA().deallocate(s, 1); }
+        );
+        return sketch_ptr;
+      } catch (...) {
+        AA().deallocate(storage, 1);
+        throw;
+      }
+    }
+
+    /*
+     * Builds a sketch of a large array using the given number of threads.
+     * Each thread bulk loads a sketch of its own part of the array, and these are merged
+     * with a single compaction, so the result has the usual error guarantees for the given k.
+     */
+    static kll_sketch build(const T* values, size_t size, unsigned num_threads, uint16_t k = DEFAULT_K) {
+      if (num_threads == 0) throw std::invalid_argument("num_threads must be > 0");
+      // a thread is not worth starting for less than this
+      const size_t min_part_size(1 << 16);
+      const size_t num_parts(std::max(static_cast<size_t>(1), std::min(static_cast<size_t>(num_threads), size / min_part_size)));
+
+      // constructed one by one to get a different seed for each
+      std::vector<kll_sketch> parts;
+      parts.reserve(num_parts);
+      for (size_t i = 0; i < num_parts; i++) parts.emplace_back(k);
+
+      std::vector<std::exception_ptr> errors(num_parts);
+      auto build_part = [&](size_t i) {
+        try {
+          const size_t begin(size * i / num_parts);
+          const size_t end(size * (i + 1) / num_parts);
+          parts[i].update(values + begin, end - begin);
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+      };
+      {
+        thread_joiner started; // joins even if starting a thread throws
+        started.threads.reserve(num_parts - 1);
+        for (size_t i = 1; i < num_parts; i++) started.threads.emplace_back(build_part, i);
+        build_part(0);
+      }
+      for (const std::exception_ptr& error: errors) {
+        if (error) std::rethrow_exception(error);
+      }
+
+      std::vector<const kll_sketch*> others;
+      for (size_t i = 1; i < num_parts; i++) others.push_back(&parts[i]);
+      parts[0].merge(others.data(), others.size());
+      return std::move(parts[0]);
     }
 
     /*
@@ -552,6 +916,9 @@ class kll_sketch {
     }
 
     friend std::ostream& operator<< <T, A>(std::ostream& os, kll_sketch<T, A> const& sketch);
+    friend class kll_sketch_view<T>; // reads the serialized layout in place
+    template <typename, uint16_t, uint8_t> friend class kll_sketch_fixed; // writes the serialized layout
+    friend class kll_string_sketch; // moves the strings its items refer to
 
 #ifdef KLL_VALIDATION
     uint8_t get_num_levels() { return num_levels_; }
@@ -576,9 +943,18 @@ class kll_sketch {
 
     static const uint8_t SERIAL_VERSION_1 = 1;
     static const uint8_t SERIAL_VERSION_2 = 2;
+    static const uint8_t SERIAL_VERSION_3 = 3; // compressed items
     static const uint8_t FAMILY = 15;
 
-    enum flags { IS_EMPTY, IS_LEVEL_ZERO_SORTED, IS_SINGLE_ITEM };
+    enum flags { IS_EMPTY, IS_LEVEL_ZERO_SORTED, IS_SINGLE_ITEM, IS_COMPRESSED };
+
+    // joins the threads on destruction, so that none is left joinable when build() throws
+    struct thread_joiner {
+      std::vector<std::thread> threads;
+      ~thread_joiner() {
+        for (std::thread& thread: threads) if (thread.joinable()) thread.join();
+      }
+    };
 
     static const uint8_t PREAMBLE_INTS_SHORT = 2; // for empty and single item
     static const uint8_t PREAMBLE_INTS_FULL = 5;
@@ -595,95 +971,273 @@ class kll_sketch {
     T min_value_;
     T max_value_;
     bool is_level_zero_sorted_;
+    kll_random_bits random_bit_;
+    mutable std::unique_ptr<kll_quantile_calculator<T>> sorted_view_; // built on demand, reset by any change
+
+    // the state of a compaction in the deamortized mode, see set_deamortized()
+    enum compaction_phase { IDLE, GROW, SORT, HALVE, MERGE, SHIFT };
+    static const uint32_t MIN_DEFERRED_WORK = 32; // items moved per update at least
+
+    struct deferred_compaction {
+      bool enabled = false;
+      T* staged = nullptr; // a queue of k items that arrived while level zero was full
+      uint32_t first_staged = 0;
+      uint32_t num_staged = 0;
+      uint32_t work_per_update = MIN_DEFERRED_WORK;
+      compaction_phase phase = IDLE;
+      uint32_t pos = 0; // the progress within the phase
+      uint8_t level = 0;
+      T* grow_buf = nullptr;
+      uint32_t grow_size = 0;
+      uint32_t delta_cap = 0;
+      uint32_t raw_beg = 0;
+      uint32_t raw_lim = 0;
+      uint32_t pop_above = 0;
+      uint32_t adj_beg = 0;
+      uint32_t adj_pop = 0;
+      uint32_t offset = 0;
+      uint32_t merge_a = 0;
+      uint32_t merge_b = 0;
+      uint32_t shift_size = 0; // the number of items in the levels below
+    } deferred_;
 
     AllocT alloc_t;
     AllocU32 alloc_u32;
 
     // for deserialization
     // the common part of the preamble was read and compatibility checks were done
-    kll_sketch(uint16_t k, uint8_t flags_byte, std::istream& is) : alloc_t(AllocT()), alloc_u32(AllocU32()) {
+    kll_sketch(uint16_t k, uint8_t flags_byte, std::istream& is) :
+    levels_(nullptr), items_(nullptr), random_bit_(kll_random_bits::default_seed()), alloc_t(AllocT()), alloc_u32(AllocU32()) {
       k_ = k;
       m_ = DEFAULT_M;
-      const bool is_single_item(flags_byte & (1 << flags::IS_SINGLE_ITEM)); // used in serial version 2
-      if (is_single_item) {
-        n_ = 1;
-        min_k_ = k_;
-        num_levels_ = 1;
-      } else {
-        is.read((char*)&n_, sizeof(n_));
-        is.read((char*)&min_k_, sizeof(min_k_));
-        is.read((char*)&num_levels_, sizeof(num_levels_));
-        uint8_t unused;
-        is.read((char*)&unused, sizeof(unused));
-      }
-      levels_ = alloc_u32.allocate(num_levels_ + 1);
-      levels_size_ = num_levels_ + 1;
-      const uint32_t capacity(kll_helper::compute_total_capacity(k_, m_, num_levels_));
-      if (is_single_item) {
-        levels_[0] = capacity - 1;
-      } else {
-        // the last integer in levels_ is not serialized because it can be derived
-        is.read((char*)levels_, sizeof(levels_[0]) * num_levels_);
-      }
-      levels_[num_levels_] = capacity;
-      if (!is_single_item) {
-        deserialize_items<T>(is, &min_value_, 1);
-        deserialize_items<T>(is, &max_value_, 1);
-      }
-      items_ = alloc_t.allocate(capacity);
-      items_size_ = capacity;
-      for (unsigned i = 0; i < items_size_; i++) alloc_t.construct(&items_[i], T());
-      const auto num_items(levels_[num_levels_] - levels_[0]);
-      deserialize_items<T>(is, &items_[levels_[0]], num_items);
-      if (is_single_item) {
-        min_value_ = items_[levels_[0]];
-        max_value_ = items_[levels_[0]];
+      uint32_t num_constructed(0);
+      try {
+        const bool is_single_item(flags_byte & (1 << flags::IS_SINGLE_ITEM)); // used in serial version 2
+        if (is_single_item) {
+          n_ = 1;
+          min_k_ = k_;
+          num_levels_ = 1;
+        } else {
+          is.read((char*)&n_, sizeof(n_));
+          is.read((char*)&min_k_, sizeof(min_k_));
+          is.read((char*)&num_levels_, sizeof(num_levels_));
+          uint8_t unused;
+          is.read((char*)&unused, sizeof(unused));
+        }
+        if (num_levels_ == 0) throw std::invalid_argument("Possible corruption: zero levels");
+        levels_ = alloc_u32.allocate(num_levels_ + 1);
+        levels_size_ = num_levels_ + 1;
+        const uint32_t capacity(kll_helper::compute_total_capacity(k_, m_, num_levels_));
+        if (is_single_item) {
+          levels_[0] = capacity - 1;
+        } else {
+          // the last integer in levels_ is not serialized because it can be derived
+          is.read((char*)levels_, sizeof(levels_[0]) * num_levels_);
+        }
+        levels_[num_levels_] = capacity;
+        check_levels();
+        if (!is_single_item) {
+          deserialize_items<T>(is, &min_value_, 1);
+          deserialize_items<T>(is, &max_value_, 1);
+        }
+        const bool is_compressed(flags_byte & (1 << flags::IS_COMPRESSED));
+        uint32_t compressed_size(0);
+        if (is_compressed) {
+          is.read((char*)&compressed_size, sizeof(compressed_size));
+          check_compressed_size(compressed_size);
+        }
+        items_ = alloc_t.allocate(capacity);
+        items_size_ = capacity;
+        // deserialize_items() assigns to the items, unless they are copied with memcpy
+        if (!std::is_trivially_copyable<T>::value) {
+          for (unsigned i = levels_[0]; i < items_size_; i++, num_constructed++) alloc_t.construct(&items_[i], T());
+        }
+        is_level_zero_sorted_ = (flags_byte & (1 << flags::IS_LEVEL_ZERO_SORTED)) > 0; // needed to uncompress level zero
+        const auto num_items(levels_[num_levels_] - levels_[0]);
+        if (is_compressed) {
+          std::unique_ptr<char[]> compressed(new char[compressed_size]);
+          is.read(compressed.get(), compressed_size);
+          uncompress_levels(compressed.get(), compressed.get() + compressed_size);
+        } else {
+          deserialize_items<T>(is, &items_[levels_[0]], num_items);
+        }
+        if (is_single_item) {
+          min_value_ = items_[levels_[0]];
+          max_value_ = items_[levels_[0]];
+        }
+      } catch (...) {
+        release_partially_deserialized(num_constructed);
+        throw;
       }
-      is_level_zero_sorted_ = (flags_byte & (1 << flags::IS_LEVEL_ZERO_SORTED)) > 0;
     }
 
     // for deserialization
     // the common part of the preamble was read and compatibility checks were done
-    kll_sketch(uint16_t k, uint8_t flags_byte, const void* bytes, size_t size) : alloc_t(AllocT()), alloc_u32(AllocU32()) {
+    kll_sketch(uint16_t k, uint8_t flags_byte, const void* bytes, size_t size) :
+    levels_(nullptr), items_(nullptr), random_bit_(kll_random_bits::default_seed()), alloc_t(AllocT()), alloc_u32(AllocU32()) {
       k_ = k;
       m_ = DEFAULT_M;
-      const bool is_single_item(flags_byte & (1 << flags::IS_SINGLE_ITEM)); // used in serial version 2
-      const char* ptr = static_cast<const char*>(bytes) + DATA_START_SINGLE_ITEM;
-      if (is_single_item) {
-        n_ = 1;
-        min_k_ = k_;
-        num_levels_ = 1;
-      } else {
-        ptr += copy_from_mem(ptr, &n_, sizeof(n_));
-        ptr += copy_from_mem(ptr, &min_k_, sizeof(min_k_));
-        ptr += copy_from_mem(ptr, &num_levels_, sizeof(num_levels_));
-        ptr++; // skip unused byte
-      }
-      levels_ = alloc_u32.allocate(num_levels_ + 1);
-      levels_size_ = num_levels_ + 1;
-      const uint32_t capacity(kll_helper::compute_total_capacity(k_, m_, num_levels_));
-      if (is_single_item) {
-        levels_[0] = capacity - 1;
+      uint32_t num_constructed(0);
+      try {
+        const bool is_single_item(flags_byte & (1 << flags::IS_SINGLE_ITEM)); // used in serial version 2
+        const char* ptr = static_cast<const char*>(bytes) + DATA_START_SINGLE_ITEM;
+        if (is_single_item) {
+          n_ = 1;
+          min_k_ = k_;
+          num_levels_ = 1;
+        } else {
+          ptr += copy_from_mem(ptr, &n_, sizeof(n_));
+          ptr += copy_from_mem(ptr, &min_k_, sizeof(min_k_));
+          ptr += copy_from_mem(ptr, &num_levels_, sizeof(num_levels_));
+          ptr++; // skip unused byte
+        }
+        if (num_levels_ == 0) throw std::invalid_argument("Possible corruption: zero levels");
+        levels_ = alloc_u32.allocate(num_levels_ + 1);
+        levels_size_ = num_levels_ + 1;
+        const uint32_t capacity(kll_helper::compute_total_capacity(k_, m_, num_levels_));
+        if (is_single_item) {
+          levels_[0] = capacity - 1;
+        } else {
+          // the last integer in levels_ is not serialized because it can be derived
+          ptr += copy_from_mem(ptr, levels_, sizeof(levels_[0]) * num_levels_);
+        }
+        levels_[num_levels_] = capacity;
+        check_levels();
+        if (!is_single_item) {
+          ptr += deserialize_items<T>(ptr, &min_value_, 1);
+          ptr += deserialize_items<T>(ptr, &max_value_, 1);
+        }
+        const bool is_compressed(flags_byte & (1 << flags::IS_COMPRESSED));
+        uint32_t compressed_size(0);
+        if (is_compressed) {
+          ptr += copy_from_mem(ptr, &compressed_size, sizeof(compressed_size));
+          if (compressed_size > static_cast<size_t>(static_cast<const char*>(bytes) + size - ptr)) {
+            throw std::invalid_argument("Possible corruption: compressed items are truncated");
+          }
+          check_compressed_size(compressed_size);
+        }
+        items_ = alloc_t.allocate(capacity);
+        items_size_ = capacity;
+        // deserialize_items() assigns to the items, unless they are copied with memcpy
+        if (!std::is_trivially_copyable<T>::value) {
+          for (unsigned i = levels_[0]; i < items_size_; i++, num_constructed++) alloc_t.construct(&items_[i], T());
+        }
+        is_level_zero_sorted_ = (flags_byte & (1 << flags::IS_LEVEL_ZERO_SORTED)) > 0; // needed to uncompress level zero
+        const auto num_items(levels_[num_levels_] - levels_[0]);
+        if (is_compressed) {
+          uncompress_levels(ptr, ptr + compressed_size);
+          ptr += compressed_size;
+        } else {
+          ptr += deserialize_items<T>(ptr, &items_[levels_[0]], num_items);
+        }
+        if (is_single_item) {
+          min_value_ = items_[levels_[0]];
+          max_value_ = items_[levels_[0]];
+        }
+        if (ptr != static_cast<const char*>(bytes) + size) throw std::logic_error("deserialized size mismatch");
+      } catch (...) {
+        release_partially_deserialized(num_constructed);
+        throw;
+      }
+    }
+
+    // the levels of a serialized sketch, with the capacity as the last one
+    void check_levels() const {
+      for (uint8_t level = 0; level < num_levels_; level++) {
+        if (levels_[level] > levels_[level + 1]) throw std::invalid_argument("Possible corruption: invalid levels");
+      }
+    }
+
+    // checked before anything is allocated for the compressed items
+    void check_compressed_size(uint32_t compressed_size) const {
+      size_t max_size(0);
+      for (uint8_t level = 0; level < num_levels_; level++) {
+        max_size += kll_helper::max_compressed_size<T>(levels_[level + 1] - levels_[level]);
+      }
+      if (compressed_size > max_size) {
+        throw std::invalid_argument("Possible corruption: compressed size " + std::to_string(compressed_size)
+            + " is more than " + std::to_string(max_size));
+      }
+    }
+
+    // frees what a deserializing constructor allocated, when it throws
+    void release_partially_deserialized(uint32_t num_constructed) {
+      if (items_ != nullptr) {
+        destroy_items(&items_[levels_[0]], &items_[levels_[0] + num_constructed]);
+        alloc_t.deallocate(items_, items_size_);
+      }
+      if (levels_ != nullptr) alloc_u32.deallocate(levels_, levels_size_);
+    }
+
+    template <typename TT>
+    void insert(TT&& value) {
+      if (kll_helper::is_nan(value)) return; // NaN has no place in the order of the items
+      sorted_view_.reset();
+      if (is_empty()) {
+        min_value_ = value;
+        max_value_ = value;
       } else {
-        // the last integer in levels_ is not serialized because it can be derived
-        ptr += copy_from_mem(ptr, levels_, sizeof(levels_[0]) * num_levels_);
+        if (value < min_value_) min_value_ = value;
+        if (max_value_ < value) max_value_ = value;
+      }
+      if (deferred_.enabled) {
+        update_deamortized(std::forward<TT>(value));
+        return;
       }
-      levels_[num_levels_] = capacity;
-      if (!is_single_item) {
-        ptr += deserialize_items<T>(ptr, &min_value_, 1);
-        ptr += deserialize_items<T>(ptr, &max_value_, 1);
+      if (levels_[0] == 0) compress_while_updating();
+      n_++;
+      is_level_zero_sorted_ = false;
+      const uint32_t next_pos(levels_[0] - 1);
+      levels_[0] = next_pos;
+      alloc_t.construct(&items_[next_pos], std::forward<TT>(value));
+    }
+
+    void update_without_nan(const T* values, size_t size) {
+      if (size == 0) return;
+      if (deferred_.enabled) {
+        for (size_t i = 0; i < size; i++) update(values[i]);
+        return;
       }
-      items_ = alloc_t.allocate(capacity);
-      items_size_ = capacity;
-      for (unsigned i = 0; i < items_size_; i++) alloc_t.construct(&items_[i], T());
-      const auto num_items(levels_[num_levels_] - levels_[0]);
-      ptr += deserialize_items<T>(ptr, &items_[levels_[0]], num_items);
-      if (is_single_item) {
-        min_value_ = items_[levels_[0]];
-        max_value_ = items_[levels_[0]];
+      sorted_view_.reset();
+      if (is_empty()) {
+        min_value_ = values[0];
+        max_value_ = values[0];
+      }
+      kll_helper::update_min_max(values, size, min_value_, max_value_);
+      is_level_zero_sorted_ = false;
+      while (size > 0) {
+        if (levels_[0] == 0) compress_while_updating();
+        const uint32_t chunk = static_cast<uint32_t>(std::min(size, static_cast<size_t>(levels_[0])));
+        levels_[0] -= chunk;
+        copy_items(values, values + chunk, &items_[levels_[0]]);
+        n_ += chunk;
+        values += chunk;
+        size -= chunk;
       }
-      is_level_zero_sorted_ = (flags_byte & (1 << flags::IS_LEVEL_ZERO_SORTED)) > 0;
-      if (ptr != static_cast<const char*>(bytes) + size) throw std::logic_error("deserialized size mismatch");
+    }
+
+    // inserts an item of weight 2^level, keeping the levels above zero sorted
+    void insert_into_level(const T& value, uint8_t level) {
+      while (num_levels_ <= level) add_empty_top_level();
+      if (levels_[0] == 0) compress_while_updating();
+      n_ += static_cast<uint64_t>(1) << level;
+      if (level == 0) {
+        levels_[0]--;
+        alloc_t.construct(&items_[levels_[0]], value);
+        is_level_zero_sorted_ = false;
+        return;
+      }
+      // the items before the position move down into the free slot below level zero
+      T* const pos(std::upper_bound(&items_[levels_[level]], &items_[levels_[level + 1]], value));
+      T* const free_slot(&items_[levels_[0] - 1]);
+      if (free_slot + 1 == pos) {
+        alloc_t.construct(free_slot, value);
+      } else {
+        alloc_t.construct(free_slot, std::move(*(free_slot + 1)));
+        std::move(free_slot + 2, pos, free_slot + 1);
+        *(pos - 1) = value;
+      }
+      for (uint8_t lvl = 0; lvl <= level; lvl++) levels_[lvl]--;
     }
 
     // The following code is only valid in the special case of exactly reaching capacity while updating.
@@ -695,9 +1249,10 @@ class kll_sketch {
       // grows the buffer and shifts the data and also the boundaries of the data and grows the
       // levels array and increments numLevels_
       if (level == (num_levels_ - 1)) {
-        add_empty_top_level_to_completely_full_sketch();
+        add_empty_top_level();
       }
 
+      const uint32_t level_zero_beg(levels_[0]);
       const uint32_t raw_beg(levels_[level]);
       const uint32_t raw_lim(levels_[level + 1]);
       // +2 is OK because we already added a new top level if necessary
@@ -710,18 +1265,18 @@ class kll_sketch {
 
       // level zero might not be sorted, so we must sort it if we wish to compact it
       if (level == 0) {
-        std::sort(&items_[adj_beg], &items_[adj_beg + adj_pop]);
+        kll_helper::sort_items(&items_[adj_beg], &items_[adj_beg + adj_pop]);
       }
       if (pop_above == 0) {
-        kll_helper::randomly_halve_up(items_, adj_beg, adj_pop);
+        kll_helper::randomly_halve_up(items_, adj_beg, adj_pop, random_bit_);
       } else {
-        kll_helper::randomly_halve_down(items_, adj_beg, adj_pop);
+        kll_helper::randomly_halve_down(items_, adj_beg, adj_pop, random_bit_);
         kll_helper::merge_sorted_arrays(items_, adj_beg, half_adj_pop, items_, raw_lim, pop_above, items_, adj_beg + half_adj_pop);
       }
       levels_[level + 1] -= half_adj_pop; // adjust boundaries of the level above
       if (odd_pop) {
         levels_[level] = levels_[level + 1] - 1; // the current level now contains one item
-        items_[levels_[level]] = items_[raw_beg]; // namely this leftover guy
+        items_[levels_[level]] = std::move(items_[raw_beg]); // namely this leftover guy
       } else {
         levels_[level] = levels_[level + 1]; // the current level is now empty
       }
@@ -738,6 +1293,262 @@ class kll_sketch {
           levels_[lvl] += half_adj_pop;
         }
       }
+      destroy_items(&items_[level_zero_beg], &items_[levels_[0]]); // the freed slots
+    }
+
+    template <typename TT>
+    void update_deamortized(TT&& value) {
+      deferred_compaction& d(deferred_);
+      if (d.phase == IDLE and d.num_staged == 0 and levels_[0] > 0) {
+        levels_[0]--;
+        alloc_t.construct(&items_[levels_[0]], std::forward<TT>(value));
+      } else {
+        // the pace of the work should prevent this, but it is cheaper to check than to prove
+        if (d.num_staged == k_) do_deferred_work(std::numeric_limits<uint32_t>::max());
+        alloc_t.construct(&d.staged[(d.first_staged + d.num_staged) % k_], std::forward<TT>(value));
+        d.num_staged++;
+      }
+      n_++;
+      is_level_zero_sorted_ = false;
+      do_deferred_work(d.work_per_update);
+    }
+
+    // the work is a number of items moved, or steps of the heap sort
+    void do_deferred_work(uint32_t work) {
+      deferred_compaction& d(deferred_);
+      while (true) {
+        if (d.phase != IDLE) {
+          work = advance_compaction(work);
+          if (work == 0) return;
+        }
+        if (d.num_staged == 0 or work == 0) return;
+        if (levels_[0] == 0) {
+          start_compaction();
+          continue;
+        }
+        const uint32_t num(std::min(std::min(d.num_staged, levels_[0]), work));
+        // in the order of arrival, so that level zero is the same as if they were not staged
+        for (uint32_t i = 0; i < num; i++) {
+          levels_[0]--;
+          alloc_t.construct(&items_[levels_[0]], std::move(d.staged[d.first_staged]));
+          alloc_t.destroy(&d.staged[d.first_staged]);
+          d.first_staged = (d.first_staged + 1) % k_;
+          d.num_staged--;
+        }
+        work -= num;
+      }
+    }
+
+    // the same as compress_while_updating(), but the work is only planned here
+    void start_compaction() {
+      deferred_compaction& d(deferred_);
+      d.level = find_level_to_compact();
+      const uint32_t pop(levels_[d.level + 1] - levels_[d.level]);
+      uint32_t total_work(pop * 2 + 1);
+      if (d.level == 0) total_work += pop * 2 * sort_step_work(pop);
+      else total_work += levels_[d.level] - levels_[0];
+      if (d.level < num_levels_ - 1) total_work += levels_[d.level + 2] - levels_[d.level + 1];
+      d.pos = 0;
+      if (d.level == num_levels_ - 1) {
+        // as in add_empty_top_level(), except that the items are moved later
+        if (levels_size_ < (num_levels_ + 2)) {
+          uint32_t* new_levels(alloc_u32.allocate(num_levels_ + 2));
+          std::copy(&levels_[0], &levels_[levels_size_], new_levels);
+          alloc_u32.deallocate(levels_, levels_size_);
+          levels_ = new_levels;
+          levels_size_ = num_levels_ + 2;
+        }
+        d.delta_cap = kll_helper::level_capacity(k_, num_levels_ + 1, 0, m_);
+        d.grow_size = levels_[num_levels_] + d.delta_cap;
+        d.grow_buf = alloc_t.allocate(d.grow_size);
+        d.pos = d.delta_cap; // the slots of the new level zero stay free
+        total_work += d.grow_size - d.delta_cap;
+        d.phase = GROW;
+      } else {
+        start_halving();
+      }
+      // finish before the staged items fill half of the free space in the buffer
+      const uint32_t free_slots((k_ - d.num_staged) / 2);
+      const uint32_t work_per_slot(free_slots == 0 ? total_work : (total_work + free_slots - 1) / free_slots);
+      d.work_per_update = work_per_slot > MIN_DEFERRED_WORK ? work_per_slot : MIN_DEFERRED_WORK;
+    }
+
+    static uint32_t sort_step_work(uint32_t num_items) {
+      uint32_t work(1);
+      while (num_items >>= 1) work++;
+      return work;
+    }
+
+    void start_halving() {
+      deferred_compaction& d(deferred_);
+      d.raw_beg = levels_[d.level];
+      d.raw_lim = levels_[d.level + 1];
+      // +2 is OK because a new top level was added if necessary
+      d.pop_above = levels_[d.level + 2] - d.raw_lim;
+      const uint32_t raw_pop(d.raw_lim - d.raw_beg);
+      const bool odd_pop(kll_helper::is_odd(raw_pop));
+      d.adj_beg = odd_pop ? d.raw_beg + 1 : d.raw_beg;
+      d.adj_pop = odd_pop ? raw_pop - 1 : raw_pop;
+      d.shift_size = d.raw_beg - levels_[0];
+      d.pos = 0;
+      d.phase = d.level == 0 ? SORT : HALVE;
+    }
+
+    // does at most the given amount of work, and returns what is left of it if the compaction is done
+    uint32_t advance_compaction(uint32_t work) {
+      deferred_compaction& d(deferred_);
+      while (work > 0) {
+        const uint32_t half_adj_pop(d.adj_pop / 2); // set up after growing
+        switch (d.phase) {
+          case GROW: {
+            alloc_t.construct(&d.grow_buf[d.pos], std::move(items_[d.pos - d.delta_cap]));
+            if (++d.pos == d.grow_size) {
+              destroy_items(&items_[levels_[0]], &items_[items_size_]);
+              alloc_t.deallocate(items_, items_size_);
+              items_ = d.grow_buf;
+              items_size_ = d.grow_size;
+              d.grow_buf = nullptr;
+              for (uint8_t i = 0; i <= num_levels_; i++) levels_[i] += d.delta_cap;
+              num_levels_++;
+              levels_[num_levels_] = items_size_;
+              start_halving();
+            }
+            break;
+          }
+          case SORT: {
+            // level zero is heap sorted one step at a time
+            T* first(&items_[d.adj_beg]);
+            if (d.pos < d.adj_pop) std::push_heap(first, first + d.pos + 1);
+            else std::pop_heap(first, first + 2 * d.adj_pop - d.pos);
+            if (++d.pos == 2 * d.adj_pop) {
+              d.pos = 0;
+              d.phase = HALVE;
+            }
+            // a step of the heap sort takes about as long as moving log2(n) items
+            work -= std::min(work - 1, sort_step_work(d.adj_pop) - 1);
+            break;
+          }
+          case HALVE: {
+            if (d.pos == 0) d.offset = random_bit_();
+            if (d.pos < half_adj_pop) {
+              // as in kll_helper::randomly_halve_up() and randomly_halve_down()
+              // the first item may stay where it is, which must not be a self-move
+              if (d.pop_above == 0) {
+                const uint32_t last(d.adj_beg + d.adj_pop - 1);
+                if (d.pos + d.offset > 0) items_[last - d.pos] = std::move(items_[last - d.offset - 2 * d.pos]);
+              } else {
+                if (d.pos + d.offset > 0) items_[d.adj_beg + d.pos] = std::move(items_[d.adj_beg + d.offset + 2 * d.pos]);
+              }
+              d.pos++;
+            }
+            if (d.pos == half_adj_pop) {
+              d.merge_a = 0;
+              d.merge_b = 0;
+              d.phase = MERGE;
+            }
+            break;
+          }
+          case MERGE: {
+            // as in kll_helper::merge_sorted_arrays() of the kept half and the level above,
+            // the rest of the level above is in place once the kept half is used up
+            if (d.pop_above > 0 and d.merge_a < half_adj_pop) {
+              const uint32_t a(d.adj_beg + d.merge_a);
+              const uint32_t b(d.raw_lim + d.merge_b);
+              T& out(items_[d.adj_beg + half_adj_pop + d.merge_a + d.merge_b]);
+              if (d.merge_b < d.pop_above and !(items_[a] < items_[b])) {
+                out = std::move(items_[b]);
+                d.merge_b++;
+              } else {
+                out = std::move(items_[a]);
+                d.merge_a++;
+              }
+              break;
+            }
+            const uint8_t level(d.level);
+            levels_[level + 1] -= half_adj_pop;
+            if (d.adj_beg != d.raw_beg) {
+              levels_[level] = levels_[level + 1] - 1;
+              items_[levels_[level]] = std::move(items_[d.raw_beg]);
+            } else {
+              levels_[level] = levels_[level + 1];
+            }
+            if (level == 0) destroy_items(&items_[d.raw_beg], &items_[levels_[0]]); // the freed slots
+            d.pos = 0;
+            d.phase = SHIFT;
+            break;
+          }
+          case SHIFT: {
+            // the levels below move up to give the freed space to level zero
+            if (d.pos < d.shift_size) {
+              const uint32_t from(d.raw_beg - 1 - d.pos);
+              items_[from + half_adj_pop] = std::move(items_[from]);
+              d.pos++;
+            }
+            if (d.pos == d.shift_size) {
+              if (d.level > 0) {
+                const uint32_t level_zero_beg(levels_[0]);
+                for (uint8_t lvl = 0; lvl < d.level; lvl++) levels_[lvl] += half_adj_pop;
+                destroy_items(&items_[level_zero_beg], &items_[levels_[0]]); // the freed slots
+              }
+              d.phase = IDLE;
+              return work - 1;
+            }
+            break;
+          }
+          case IDLE:
+            return work;
+        }
+        work--;
+      }
+      return 0;
+    }
+
+    bool is_work_pending() const {
+      return deferred_.phase != IDLE or deferred_.num_staged > 0;
+    }
+
+    // const methods leave the work of deamortized updates to flush()
+    void check_no_work_pending() const {
+      if (is_work_pending()) throw std::logic_error("a deamortized compaction is in progress, call flush() first");
+    }
+
+    // the items of a sketch in the middle of a compaction are those from levels_[0] to the end of the buffer
+    // (some of them moved from), plus the ones moved to the grown buffer so far and the staged ones
+    void copy_deferred_work(const deferred_compaction& other) {
+      deferred_ = other;
+      deferred_.staged = alloc_t.allocate(k_);
+      for (uint32_t i = 0; i < other.num_staged; i++) {
+        const uint32_t slot((other.first_staged + i) % k_);
+        alloc_t.construct(&deferred_.staged[slot], other.staged[slot]);
+      }
+      if (other.grow_buf != nullptr) {
+        deferred_.grow_buf = alloc_t.allocate(other.grow_size);
+        copy_items(&other.grow_buf[other.delta_cap], &other.grow_buf[other.pos], &deferred_.grow_buf[other.delta_cap]);
+      }
+    }
+
+    // level zero is serialized sorted, so that kll_sketch_view can merge the levels without sorting
+    // (the order of the items does not change what the sketch is). The sketch itself is left as it is,
+    // since a const sketch may be serialized by many threads at once (see kll_concurrent_sketch::get_snapshot()).
+    // Returns a sorted copy of level zero, or nothing if it is sorted already.
+    std::vector<T, AllocT> sorted_level_zero() const {
+      if (is_level_zero_sorted_ or n_ < 2) return std::vector<T, AllocT>();
+      std::vector<T, AllocT> level_zero(&items_[levels_[0]], &items_[levels_[1]]);
+      kll_helper::sort_items(level_zero.data(), level_zero.data() + level_zero.size());
+      return level_zero;
+    }
+
+    // the items are left as they are if the buffer is being grown
+    void release_deferred_work() {
+      deferred_compaction& d(deferred_);
+      if (d.grow_buf != nullptr) {
+        destroy_items(&d.grow_buf[d.delta_cap], &d.grow_buf[d.pos]);
+        alloc_t.deallocate(d.grow_buf, d.grow_size);
+      }
+      if (d.staged != nullptr) {
+        for (uint32_t i = 0; i < d.num_staged; i++) alloc_t.destroy(&d.staged[(d.first_staged + i) % k_]);
+        alloc_t.deallocate(d.staged, k_);
+      }
     }
 
     uint8_t find_level_to_compact() const {
@@ -753,11 +1564,12 @@ class kll_sketch {
       }
     }
 
-    void add_empty_top_level_to_completely_full_sketch() {
+    // the buffer grows by the capacity of the new level zero, which is usually done when it is completely full,
+    // but a weighted update may need a level that does not exist yet
+    void add_empty_top_level() {
       const uint32_t cur_total_cap(levels_[num_levels_]);
 
       // make sure that we are following a certain growth scheme
-      assert (levels_[0] == 0);
       assert (items_size_ == cur_total_cap);
 
       // note that merging MIGHT over-grow levels_, in which case we might not have to grow it here
@@ -773,11 +1585,10 @@ class kll_sketch {
       const uint32_t new_total_cap(cur_total_cap + delta_cap);
 
       T* new_buf(alloc_t.allocate(new_total_cap));
-      for (unsigned i = 0; i < new_total_cap; i++) alloc_t.construct(&new_buf[i], T());
 
       // move (and shift) the current data into the new buffer
-      std::move(&items_[levels_[0]], &items_[levels_[0] + cur_total_cap], &new_buf[levels_[0] + delta_cap]);
-      for (unsigned i = 0; i < items_size_; i++) alloc_t.destroy(&items_[i]);
+      move_items(&items_[levels_[0]], &items_[cur_total_cap], &new_buf[levels_[0] + delta_cap]);
+      destroy_items(&items_[levels_[0]], &items_[items_size_]);
       alloc_t.deallocate(items_, items_size_);
       items_ = new_buf;
       items_size_ = new_total_cap;
@@ -793,85 +1604,38 @@ class kll_sketch {
       levels_[num_levels_] = new_total_cap; // initialize the new "extra" index at the top
     }
 
-    void sort_level_zero() {
-      if (!is_level_zero_sorted_) {
-        std::sort(&items_[levels_[0]], &items_[levels_[1]]);
-        is_level_zero_sorted_ = true;
-      }
-    }
-
-    std::unique_ptr<kll_quantile_calculator<T>> get_quantile_calculator() {
-      sort_level_zero();
-      std::unique_ptr<kll_quantile_calculator<T>> quantile_calculator(new kll_quantile_calculator<T>(items_, levels_, num_levels_, n_));
-      return std::move(quantile_calculator);
-    }
-
     std::unique_ptr<double[]> get_PMF_or_CDF(const T* split_points, uint32_t size, bool is_CDF) const {
       if (is_empty()) return nullptr;
       kll_helper::validate_values(split_points, size);
+      std::unique_ptr<uint64_t[]> weights(new uint64_t[size]);
+      get_sorted_view().get_weights_less_than(split_points, nullptr, size, weights.get()); // split points are sorted
       std::unique_ptr<double[]> buckets(new double[size + 1]);
-      std::fill(&buckets.get()[0], &buckets.get()[size + 1], 0);
-      uint8_t level(0);
-      uint64_t weight(1);
-      while (level < num_levels_) {
-        const auto from_index = levels_[level];
-        const auto to_index = levels_[level + 1]; // exclusive
-        if ((level == 0) and !is_level_zero_sorted_) {
-          increment_buckets_unsorted_level(from_index, to_index, weight, split_points, size, buckets.get());
-        } else {
-          increment_buckets_sorted_level(from_index, to_index, weight, split_points, size, buckets.get());
-        }
-        level++;
-        weight *= 2;
-      }
-      // normalize and, if CDF, convert to cumulative
-      if (is_CDF) {
-        double subtotal = 0;
-        for (uint32_t i = 0; i <= size; i++) {
-          subtotal += buckets[i];
-          buckets[i] = subtotal / n_;
-        }
-      } else {
-        for (uint32_t i = 0; i <= size; i++) {
-          buckets[i] /= n_;
-        }
+      uint64_t previous_weight(0);
+      for (uint32_t i = 0; i <= size; i++) {
+        const uint64_t weight(i < size ? weights[i] : n_);
+        buckets[i] = (double) (is_CDF ? weight : weight - previous_weight) / n_;
+        previous_weight = weight;
       }
       return buckets;
     }
 
-    void increment_buckets_unsorted_level(uint32_t from_index, uint32_t to_index, uint64_t weight,
-        const T* split_points, uint32_t size, double* buckets) const
-    {
-      for (uint32_t i = from_index; i < to_index; i++) {
-        uint32_t j;
-        for (j = 0; j < size; j++) {
-          if (items_[i] < split_points[j]) {
-            break;
-          }
-        }
-        buckets[j] += weight;
-      }
-    }
-
-    void increment_buckets_sorted_level(uint32_t from_index, uint32_t to_index, uint64_t weight,
-        const T* split_points, uint32_t size, double* buckets) const
-    {
-      uint32_t i = from_index;
-      uint32_t j = 0;
-      while ((i <  to_index) and (j < size)) {
-        if (items_[i] < split_points[j]) {
-          buckets[j] += weight; // this sample goes into this bucket
-          i++; // move on to next sample and see whether it also goes into this bucket
-        } else {
-          j++; // no more samples for this bucket
-        }
+    // sorts the values once (unless they are sorted already) and looks them all up in one walk
+    void get_weights_less_than(const T* values, uint32_t size, uint64_t* weights) const {
+      const kll_quantile_calculator<T>& view(get_sorted_view());
+      bool has_nan(false);
+      for (uint32_t i = 0; i < size; i++) has_nan |= kll_helper::is_nan(values[i]);
+      if (!has_nan and std::is_sorted(values, values + size)) {
+        view.get_weights_less_than(values, nullptr, size, weights);
+        return;
       }
-      // now either i == to_index (we are out of samples), or
-      // j == size (we are out of buckets, but there are more samples remaining)
-      // we only need to do something in the latter case
-      if (j == size) {
-        buckets[j] += weight * (to_index - i);
+      std::unique_ptr<uint32_t[]> order(new uint32_t[size]);
+      uint32_t num_ordered(0);
+      for (uint32_t i = 0; i < size; i++) {
+        if (kll_helper::is_nan(values[i])) weights[i] = 0; // as get_rank(NaN)
+        else order[num_ordered++] = i;
       }
+      std::sort(order.get(), order.get() + num_ordered, [values](uint32_t a, uint32_t b) { return values[a] < values[b]; });
+      view.get_weights_less_than(values, order.get(), num_ordered, weights);
     }
 
     void merge_higher_levels(const kll_sketch& other, uint64_t final_n) {
@@ -887,23 +1651,25 @@ class kll_sketch {
 
       // notice that workbuf is being used as both the input and output here
       const kll_helper::compress_result result = kll_helper::general_compress(k_, m_, provisional_num_levels, workbuf.get(),
-          worklevels.get(), workbuf.get(), outlevels.get(), is_level_zero_sorted_);
+          worklevels.get(), workbuf.get(), outlevels.get(), is_level_zero_sorted_, random_bit_);
+      assert (result.final_num_levels <= ub); // can sometimes be much bigger
+      move_from_work_arrays(workbuf.get(), outlevels.get(), result);
+    }
+
+    // transfers the result of general_compress() back into the "self" sketch
+    void move_from_work_arrays(T* workbuf, const uint32_t* outlevels, const kll_helper::compress_result& result) {
       const uint8_t final_num_levels = result.final_num_levels;
       const uint32_t final_capacity = result.final_capacity;
       const uint32_t final_pop = result.final_pop;
 
-      assert (final_num_levels <= ub); // can sometimes be much bigger
-
-      // now we need to transfer the results back into the "self" sketch
+      destroy_items(&items_[levels_[0]], &items_[items_size_]);
       if (final_capacity != items_size_) {
-        for (unsigned i = 0; i < items_size_; i++) alloc_t.destroy(&items_[i]);
         alloc_t.deallocate(items_, items_size_);
         items_ = alloc_t.allocate(final_capacity);
         items_size_ = final_capacity;
-        for (unsigned i = 0; i < items_size_; i++) alloc_t.construct(&items_[i], T());
       }
       const uint32_t free_space_at_bottom = final_capacity - final_pop;
-      std::move(&workbuf[outlevels[0]], &workbuf[outlevels[0] + final_pop], &items_[free_space_at_bottom]);
+      move_items(&workbuf[outlevels[0]], &workbuf[outlevels[0] + final_pop], &items_[free_space_at_bottom]);
       const uint32_t the_shift(free_space_at_bottom - outlevels[0]);
 
       if (levels_size_ < (final_num_levels + 1)) {
@@ -919,6 +1685,49 @@ class kll_sketch {
       num_levels_ = final_num_levels;
     }
 
+    /*
+     * Merges other sketches into this one with a single compaction pass.
+     * Level zero of all sketches is concatenated, and each level above is a k-way merge of
+     * the same level of all sketches, then general_compress() brings the result within capacity.
+     */
+    void merge_many(const kll_sketch* const* others, size_t num_others, uint64_t final_n, uint8_t provisional_num_levels,
+        uint32_t tmp_space_needed) {
+      const std::unique_ptr<T[]> workbuf(new T[tmp_space_needed]);
+      const uint8_t ub = kll_helper::ub_on_num_levels(final_n);
+      const std::unique_ptr<uint32_t[]> worklevels(new uint32_t[ub + 2]); // ub+1 does not work
+      const std::unique_ptr<uint32_t[]> outlevels(new uint32_t[ub + 2]);
+
+      worklevels[0] = 0;
+      T* out = &workbuf[0];
+      out = std::move(&items_[levels_[0]], &items_[levels_[0] + safe_level_size(0)], out);
+      for (size_t i = 0; i < num_others; i++) {
+        const kll_sketch& other = *others[i];
+        out = std::copy(&other.items_[other.levels_[0]], &other.items_[other.levels_[0] + other.safe_level_size(0)], out);
+      }
+      worklevels[1] = out - &workbuf[0];
+
+      std::vector<std::pair<const T*, const T*>> runs;
+      for (uint8_t lvl = 1; lvl < provisional_num_levels; lvl++) {
+        runs.clear();
+        if (safe_level_size(lvl) > 0) runs.push_back(std::make_pair(&items_[levels_[lvl]], &items_[levels_[lvl + 1]]));
+        for (size_t i = 0; i < num_others; i++) {
+          const kll_sketch& other = *others[i];
+          if (other.safe_level_size(lvl) > 0) {
+            runs.push_back(std::make_pair(&other.items_[other.levels_[lvl]], &other.items_[other.levels_[lvl + 1]]));
+          }
+        }
+        out = kll_helper::k_way_merge(runs, out);
+        worklevels[lvl + 1] = out - &workbuf[0];
+      }
+      if (worklevels[provisional_num_levels] != tmp_space_needed) throw std::logic_error("inconsistent state");
+
+      // notice that workbuf is being used as both the input and output here
+      const kll_helper::compress_result result = kll_helper::general_compress(k_, m_, provisional_num_levels, workbuf.get(),
+          worklevels.get(), workbuf.get(), outlevels.get(), false, random_bit_);
+      assert (result.final_num_levels <= ub);
+      move_from_work_arrays(workbuf.get(), outlevels.get(), result);
+    }
+
     void populate_work_arrays(const kll_sketch& other, T* workbuf, uint32_t* worklevels, uint8_t provisional_num_levels) {
       worklevels[0] = 0;
 
@@ -958,6 +1767,46 @@ class kll_sketch {
       return levels_[num_levels_] - levels_[1];
     }
 
+    /*
+     * Only the slots from levels_[0] to the end of items_ hold constructed items.
+     * The free slots below level zero are raw storage: the items are constructed there as they arrive,
+     * and destroyed when a compaction frees their slots. These construct the items in free slots
+     * (with memcpy if possible) and destroy them.
+     */
+    template <typename TT = T>
+    typename std::enable_if<std::is_trivially_copyable<TT>::value, void>::type
+    copy_items(const T* first, const T* last, T* dst) {
+      if (first != last) memcpy(dst, first, sizeof(T) * (last - first));
+    }
+
+    template <typename TT = T>
+    typename std::enable_if<!std::is_trivially_copyable<TT>::value, void>::type
+    copy_items(const T* first, const T* last, T* dst) {
+      for (; first != last; ++first, ++dst) alloc_t.construct(dst, *first);
+    }
+
+    template <typename TT = T>
+    typename std::enable_if<std::is_trivially_copyable<TT>::value, void>::type
+    move_items(T* first, T* last, T* dst) {
+      copy_items(first, last, dst);
+    }
+
+    template <typename TT = T>
+    typename std::enable_if<!std::is_trivially_copyable<TT>::value, void>::type
+    move_items(T* first, T* last, T* dst) {
+      for (; first != last; ++first, ++dst) alloc_t.construct(dst, std::move(*first));
+    }
+
+    template <typename TT = T>
+    typename std::enable_if<std::is_trivially_destructible<TT>::value, void>::type
+    destroy_items(T*, T*) {}
+
+    template <typename TT = T>
+    typename std::enable_if<!std::is_trivially_destructible<TT>::value, void>::type
+    destroy_items(T* first, T* last) {
+      for (; first != last; ++first) alloc_t.destroy(first);
+    }
+
     static uint32_t get_serialized_size_bytes(uint8_t num_levels, uint32_t num_items, uint32_t sizeof_item) {
       if (num_levels == 1 and num_items == 1) {
         return DATA_START_SINGLE_ITEM + sizeof_item;
@@ -991,13 +1840,23 @@ class kll_sketch {
     }
 
     static void check_serial_version(uint8_t serial_version) {
-      if (serial_version != SERIAL_VERSION_1 and serial_version != SERIAL_VERSION_2) {
+      if (serial_version != SERIAL_VERSION_1 and serial_version != SERIAL_VERSION_2 and serial_version != SERIAL_VERSION_3) {
         throw std::invalid_argument("Possible corruption: serial version mismatch: expected "
-            + std::to_string(SERIAL_VERSION_1) + " or " + std::to_string(SERIAL_VERSION_2)
+            + std::to_string(SERIAL_VERSION_1) + ", " + std::to_string(SERIAL_VERSION_2) + " or " + std::to_string(SERIAL_VERSION_3)
             + ", got " + std::to_string(serial_version));
       }
     }
 
+    // only sketches with more than one item are compressed, and older versions reject them by the serial version
+    static void check_compression(uint8_t serial_version, uint8_t flags_byte) {
+      const bool is_compressed(flags_byte & (1 << flags::IS_COMPRESSED));
+      const bool is_full(!(flags_byte & ((1 << flags::IS_EMPTY) | (1 << flags::IS_SINGLE_ITEM))));
+      if (is_compressed != (serial_version == SERIAL_VERSION_3) or (is_compressed and !is_full)) {
+        throw std::invalid_argument("Possible corruption: compression flag does not match serial version "
+            + std::to_string(serial_version));
+      }
+    }
+
     static void check_family_id(uint8_t family_id) {
       if (family_id != FAMILY) {
         throw std::invalid_argument("Possible corruption: family mismatch: expected "
@@ -0,0 +1,447 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#ifndef KLL_SKETCH_FIXED_HPP_
+#define KLL_SKETCH_FIXED_HPP_
+
+#include <memory>
+#include <vector>
+#include <limits>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+#include "kll_sketch.hpp"
+#include "kll_helper.hpp"
+#include "kll_quantile_calculator.hpp"
+
+namespace datasketches {
+
+/*
+ * The same as kll_helper::level_capacity() for the level at the given depth below the top level,
+ * but usable at compile time. Beyond depth 30, k * (2/3)^depth is below the minimum width for any k.
+ */
+constexpr uint64_t kll_power_of_three(uint8_t power) {
+  return power == 0 ? 1 : 3 * kll_power_of_three(power - 1);
+}
+
+constexpr uint32_t kll_depth_capacity(uint16_t k, uint8_t m, uint8_t depth) {
+  return depth > 30 ? m
+      : ((((static_cast<uint64_t>(k) << 1) << depth) / kll_power_of_three(depth) + 1) >> 1) > m
+      ? static_cast<uint32_t>((((static_cast<uint64_t>(k) << 1) << depth) / kll_power_of_three(depth) + 1) >> 1)
+      : m;
+}
+
+// the same as kll_helper::compute_total_capacity()
+constexpr uint32_t kll_total_capacity(uint16_t k, uint8_t m, uint8_t num_levels) {
+  return num_levels == 0 ? 0 : kll_total_capacity(k, m, num_levels - 1) + kll_depth_capacity(k, m, num_levels - 1);
+}
+
+template <size_t... I> struct kll_index_sequence {};
+template <size_t N, size_t... I> struct kll_make_index_sequence: kll_make_index_sequence<N - 1, N - 1, I...> {};
+template <size_t... I> struct kll_make_index_sequence<0, I...> { typedef kll_index_sequence<I...> type; };
+
+// the capacity of a level by its depth, and the total capacity by the number of levels
+template <uint16_t K, uint8_t M, typename Indices> struct kll_capacity_tables;
+
+template <uint16_t K, uint8_t M, size_t... I>
+struct kll_capacity_tables<K, M, kll_index_sequence<I...>> {
+  static constexpr uint32_t depth_capacity[sizeof...(I)] = { kll_depth_capacity(K, M, I)... };
+  static constexpr uint32_t total_capacity[sizeof...(I)] = { kll_total_capacity(K, M, I)... };
+};
+
+template <uint16_t K, uint8_t M, size_t... I>
+constexpr uint32_t kll_capacity_tables<K, M, kll_index_sequence<I...>>::depth_capacity[sizeof...(I)];
+
+template <uint16_t K, uint8_t M, size_t... I>
+constexpr uint32_t kll_capacity_tables<K, M, kll_index_sequence<I...>>::total_capacity[sizeof...(I)];
+
+/*
+ * A KLL sketch with k fixed at compile time, for up to 2^LG_MAX_N items.
+ *
+ * It compacts exactly like kll_sketch with the same k, but the level capacities come from tables
+ * computed at compile time, and the items are stored in the object itself, in a buffer large enough for
+ * the most levels that 2^LG_MAX_N items can make (an item in level h stands for 2^h of them).
+ * The levels are kept at the end of the buffer, and level zero grows down from them,
+ * so adding a level only moves the bound of the free space and no items are moved.
+ * Updates allocate nothing. A merge takes temporary heap space for the combined levels, serialization
+ * a sorted copy of level zero unless it is sorted already, and the first query builds the sorted view
+ * as kll_sketch does.
+ *
+ * The buffer takes a little less than 3 * K + 8 * LG_MAX_N items, for instance 777 floats (3108 bytes)
+ * with the default K of 200 and LG_MAX_N of 32. An update or merge that would go beyond 2^LG_MAX_N items
+ * throws std::length_error and leaves the sketch as it was.
+ *
+ * The serialized form is the same as that of kll_sketch<T>, which can deserialize it.
+ */
+template <typename T, uint16_t K = kll_sketch<T>::DEFAULT_K, uint8_t LG_MAX_N = 32>
+class kll_sketch_fixed {
+  static_assert(K >= kll_sketch<T>::MIN_K, "K is too small");
+  static_assert(LG_MAX_N <= 60, "LG_MAX_N is too large");
+
+  public:
+    static const uint8_t M = kll_sketch<T>::DEFAULT_M;
+    static const uint8_t MAX_NUM_LEVELS = LG_MAX_N + 1;
+
+    explicit kll_sketch_fixed(uint64_t seed = kll_random_bits::default_seed()) :
+    n_(0), num_levels_(1), is_level_zero_sorted_(false), random_bit_(seed) {
+      levels_[0] = CAPACITY;
+      levels_[1] = CAPACITY;
+      if (std::is_floating_point<T>::value) {
+        min_value_ = std::numeric_limits<T>::quiet_NaN();
+        max_value_ = std::numeric_limits<T>::quiet_NaN();
+      }
+    }
+
+    // NaN is ignored, as by kll_sketch
+    void update(const T& value) {
+      if (kll_helper::is_nan(value)) return;
+      check_room(1);
+      sorted_view_.reset();
+      if (is_empty()) {
+        min_value_ = value;
+        max_value_ = value;
+      } else {
+        if (value < min_value_) min_value_ = value;
+        if (max_value_ < value) max_value_ = value;
+      }
+      if (levels_[0] == get_free_space_begin()) compress_while_updating();
+      n_++;
+      is_level_zero_sorted_ = false;
+      levels_[0]--;
+      items_[levels_[0]] = value;
+    }
+
+    // the same as kll_sketch::update(const T*, size_t)
+    void update(const T* values, size_t size) {
+      if (size > MAX_N - n_) {
+        // only the items that are not NaN count
+        uint64_t count(0);
+        for (size_t i = 0; i < size; i++) if (!kll_helper::is_nan(values[i])) count++;
+        check_room(count);
+      }
+      while (size > 0) {
+        size_t run(0);
+        while (run < size and !kll_helper::is_nan(values[run])) run++;
+        update_without_nan(values, run);
+        if (run < size) run++;
+        values += run;
+        size -= run;
+      }
+    }
+
+    void merge(const kll_sketch_fixed& other) {
+      if (other.is_empty()) return;
+      check_room(other.n_);
+      const uint64_t final_n(n_ + other.n_);
+      sorted_view_.reset();
+      const bool was_empty(is_empty());
+      for (uint32_t i = other.levels_[0]; i < other.levels_[1]; i++) {
+        update(other.items_[i]);
+      }
+      if (other.num_levels_ >= 2) {
+        merge_higher_levels(other, final_n);
+      }
+      n_ = final_n;
+      if (was_empty or other.min_value_ < min_value_) min_value_ = other.min_value_;
+      if (was_empty or max_value_ < other.max_value_) max_value_ = other.max_value_;
+    }
+
+    bool is_empty() const {
+      return n_ == 0;
+    }
+
+    uint16_t get_k() const {
+      return K;
+    }
+
+    uint64_t get_n() const {
+      return n_;
+    }
+
+    uint32_t get_num_retained() const {
+      return CAPACITY - levels_[0];
+    }
+
+    bool is_estimation_mode() const {
+      return num_levels_ > 1;
+    }
+
+    T get_min_value() const {
+      if (is_empty()) return get_empty_value();
+      return min_value_;
+    }
+
+    T get_max_value() const {
+      if (is_empty()) return get_empty_value();
+      return max_value_;
+    }
+
+    T get_quantile(double fraction) const {
+      if (is_empty()) return get_empty_value();
+      if (fraction == 0.0) return min_value_;
+      if (fraction == 1.0) return max_value_;
+      if ((fraction < 0.0) or (fraction > 1.0)) {
+        throw std::invalid_argument("Fraction cannot be less than zero or greater than 1.0");
+      }
+      return get_sorted_view().get_quantile(fraction);
+    }
+
+    double get_rank(const T& value) const {
+      if (is_empty()) return std::numeric_limits<double>::quiet_NaN();
+      return (double) get_sorted_view().get_weight_less_than(value) / n_;
+    }
+
+    std::unique_ptr<double[]> get_PMF(const T* split_points, uint32_t size) const {
+      return get_PMF_or_CDF(split_points, size, false);
+    }
+
+    std::unique_ptr<double[]> get_CDF(const T* split_points, uint32_t size) const {
+      return get_PMF_or_CDF(split_points, size, true);
+    }
+
+    static double get_normalized_rank_error(bool pmf) {
+      return kll_sketch<T>::get_normalized_rank_error(K, pmf);
+    }
+
+    // see kll_sketch::get_sorted_view()
+    const kll_quantile_calculator<T>& get_sorted_view() const {
+      if (!sorted_view_) {
+        sorted_view_.reset(new kll_quantile_calculator<T>(items_, levels_, num_levels_, n_, is_level_zero_sorted_));
+      }
+      return *sorted_view_;
+    }
+
+    // in the format of kll_sketch<T>::serialize()
+    void serialize(std::ostream& os) const {
+      typedef kll_sketch<T> sketch;
+      const std::vector<T> level_zero(sorted_level_zero());
+      const bool is_single_item = n_ == 1;
+      const uint8_t preamble_ints(is_empty() or is_single_item ? sketch::PREAMBLE_INTS_SHORT : sketch::PREAMBLE_INTS_FULL);
+      os.write((char*)&preamble_ints, sizeof(preamble_ints));
+      const uint8_t serial_version(is_single_item ? sketch::SERIAL_VERSION_2 : sketch::SERIAL_VERSION_1);
+      os.write((char*)&serial_version, sizeof(serial_version));
+      const uint8_t family(sketch::FAMILY);
+      os.write((char*)&family, sizeof(family));
+      const uint8_t flags_byte(
+          (is_empty() ? 1 << sketch::flags::IS_EMPTY : 0)
+        | (is_level_zero_sorted_ or !level_zero.empty() ? 1 << sketch::flags::IS_LEVEL_ZERO_SORTED : 0)
+        | (is_single_item ? 1 << sketch::flags::IS_SINGLE_ITEM : 0)
+      );
+      os.write((char*)&flags_byte, sizeof(flags_byte));
+      const uint16_t k(K);
+      os.write((char*)&k, sizeof(k));
+      const uint8_t m(M);
+      os.write((char*)&m, sizeof(m));
+      const uint8_t unused(0);
+      os.write((char*)&unused, sizeof(unused));
+      if (is_empty()) return;
+      if (!is_single_item) {
+        os.write((char*)&n_, sizeof(n_));
+        os.write((char*)&k, sizeof(k)); // min k
+        os.write((char*)&num_levels_, sizeof(num_levels_));
+        os.write((char*)&unused, sizeof(unused));
+        // kll_sketch has a buffer of the total capacity of its levels, which ends where this one does
+        const uint32_t offset(get_free_space_begin());
+        for (uint8_t level = 0; level < num_levels_; level++) {
+          const uint32_t level_begin(levels_[level] - offset);
+          os.write((char*)&level_begin, sizeof(level_begin));
+        }
+        serialize_items<T>(os, &min_value_, 1);
+        serialize_items<T>(os, &max_value_, 1);
+      }
+      if (level_zero.empty()) {
+        serialize_items<T>(os, &items_[levels_[0]], get_num_retained());
+      } else {
+        serialize_items<T>(os, level_zero.data(), level_zero.size());
+        serialize_items<T>(os, &items_[levels_[1]], levels_[num_levels_] - levels_[1]);
+      }
+    }
+
+  private:
+    void update_without_nan(const T* values, size_t size) {
+      if (size == 0) return;
+      sorted_view_.reset();
+      if (is_empty()) {
+        min_value_ = values[0];
+        max_value_ = values[0];
+      }
+      kll_helper::update_min_max(values, size, min_value_, max_value_);
+      is_level_zero_sorted_ = false;
+      while (size > 0) {
+        if (levels_[0] == get_free_space_begin()) compress_while_updating();
+        const uint32_t chunk = static_cast<uint32_t>(std::min(size, static_cast<size_t>(levels_[0] - get_free_space_begin())));
+        levels_[0] -= chunk;
+        std::copy(values, values + chunk, &items_[levels_[0]]);
+        n_ += chunk;
+        values += chunk;
+        size -= chunk;
+      }
+    }
+
+    // see kll_sketch::sorted_level_zero()
+    std::vector<T> sorted_level_zero() const {
+      if (is_level_zero_sorted_ or n_ < 2) return std::vector<T>();
+      std::vector<T> level_zero(&items_[levels_[0]], &items_[levels_[1]]);
+      kll_helper::sort_items(level_zero.data(), level_zero.data() + level_zero.size());
+      return level_zero;
+    }
+
+    typedef kll_capacity_tables<K, M, typename kll_make_index_sequence<MAX_NUM_LEVELS + 1>::type> capacities;
+    static constexpr uint32_t CAPACITY = capacities::total_capacity[MAX_NUM_LEVELS];
+    static constexpr uint64_t MAX_N = static_cast<uint64_t>(1) << LG_MAX_N;
+
+    uint64_t n_;
+    uint8_t num_levels_;
+    uint32_t levels_[MAX_NUM_LEVELS + 2]; // the compaction looks at the start of the level above the top one
+    T items_[CAPACITY];
+    T min_value_;
+    T max_value_;
+    bool is_level_zero_sorted_;
+    kll_random_bits random_bit_;
+    mutable std::shared_ptr<kll_quantile_calculator<T>> sorted_view_; // shared by copies until one of them changes
+
+    void check_room(uint64_t count) const {
+      if (count > MAX_N - n_) throw std::length_error("the sketch is configured for at most 2^" + std::to_string(LG_MAX_N) + " items");
+    }
+
+    // the items below this are free, the total capacity of the levels lies above
+    uint32_t get_free_space_begin() const {
+      return CAPACITY - capacities::total_capacity[num_levels_];
+    }
+
+    uint8_t find_level_to_compact() const {
+      uint8_t level(0);
+      while (true) {
+        const uint32_t pop(levels_[level + 1] - levels_[level]);
+        if (pop >= capacities::depth_capacity[num_levels_ - level - 1]) return level;
+        level++;
+      }
+    }
+
+    void add_empty_top_level() {
+      if (num_levels_ == MAX_NUM_LEVELS) {
+        throw std::length_error("the sketch is configured for at most 2^" + std::to_string(LG_MAX_N) + " items");
+      }
+      num_levels_++;
+      levels_[num_levels_] = CAPACITY;
+    }
+
+    // as kll_sketch::compress_while_updating(), but a new top level takes no moves
+    void compress_while_updating() {
+      const uint8_t level(find_level_to_compact());
+      if (level == (num_levels_ - 1)) add_empty_top_level();
+
+      const uint32_t raw_beg(levels_[level]);
+      const uint32_t raw_lim(levels_[level + 1]);
+      const uint32_t pop_above(levels_[level + 2] - raw_lim);
+      const uint32_t raw_pop(raw_lim - raw_beg);
+      const bool odd_pop(kll_helper::is_odd(raw_pop));
+      const uint32_t adj_beg(odd_pop ? raw_beg + 1 : raw_beg);
+      const uint32_t adj_pop(odd_pop ? raw_pop - 1 : raw_pop);
+      const uint32_t half_adj_pop(adj_pop / 2);
+
+      if (level == 0) {
+        kll_helper::sort_items(&items_[adj_beg], &items_[adj_beg + adj_pop]);
+      }
+      if (pop_above == 0) {
+        kll_helper::randomly_halve_up(items_, adj_beg, adj_pop, random_bit_);
+      } else {
+        kll_helper::randomly_halve_down(items_, adj_beg, adj_pop, random_bit_);
+        kll_helper::merge_sorted_arrays(items_, adj_beg, half_adj_pop, items_, raw_lim, pop_above, items_, adj_beg + half_adj_pop);
+      }
+      levels_[level + 1] -= half_adj_pop;
+      if (odd_pop) {
+        levels_[level] = levels_[level + 1] - 1;
+        items_[levels_[level]] = std::move(items_[raw_beg]);
+      } else {
+        levels_[level] = levels_[level + 1];
+      }
+
+      if (level > 0) {
+        const uint32_t amount(raw_beg - levels_[0]);
+        std::move_backward(&items_[levels_[0]], &items_[levels_[0] + amount], &items_[levels_[0] + half_adj_pop + amount]);
+        for (uint8_t lvl = 0; lvl < level; lvl++) {
+          levels_[lvl] += half_adj_pop;
+        }
+      }
+    }
+
+    uint32_t safe_level_size(uint8_t level) const {
+      if (level >= num_levels_) return 0;
+      return levels_[level + 1] - levels_[level];
+    }
+
+    // as kll_sketch::merge_higher_levels(), the result is placed at the end of the buffer
+    void merge_higher_levels(const kll_sketch_fixed& other, uint64_t final_n) {
+      const uint32_t tmp_space_needed(get_num_retained() + other.levels_[other.num_levels_] - other.levels_[1]);
+      const std::unique_ptr<T[]> workbuf(new T[tmp_space_needed]);
+      const uint8_t ub = kll_helper::ub_on_num_levels(final_n);
+      const std::unique_ptr<uint32_t[]> worklevels(new uint32_t[ub + 2]);
+      const std::unique_ptr<uint32_t[]> outlevels(new uint32_t[ub + 2]);
+      const uint8_t provisional_num_levels = std::max(num_levels_, other.num_levels_);
+
+      worklevels[0] = 0;
+      const uint32_t self_pop_zero(safe_level_size(0));
+      std::move(&items_[levels_[0]], &items_[levels_[0] + self_pop_zero], &workbuf[0]);
+      worklevels[1] = self_pop_zero;
+      for (uint8_t lvl = 1; lvl < provisional_num_levels; lvl++) {
+        const uint32_t self_pop = safe_level_size(lvl);
+        const uint32_t other_pop = other.safe_level_size(lvl);
+        worklevels[lvl + 1] = worklevels[lvl] + self_pop + other_pop;
+        if (other_pop == 0) {
+          std::move(&items_[levels_[lvl]], &items_[levels_[lvl] + self_pop], &workbuf[worklevels[lvl]]);
+        } else if (self_pop == 0) {
+          std::copy(&other.items_[other.levels_[lvl]], &other.items_[other.levels_[lvl] + other_pop], &workbuf[worklevels[lvl]]);
+        } else {
+          kll_helper::merge_sorted_arrays(items_, levels_[lvl], self_pop, other.items_,
+              other.levels_[lvl], other_pop, workbuf.get(), worklevels[lvl]);
+        }
+      }
+
+      const kll_helper::compress_result result = kll_helper::general_compress(K, M, provisional_num_levels, workbuf.get(),
+          worklevels.get(), workbuf.get(), outlevels.get(), is_level_zero_sorted_, random_bit_);
+      // at most MAX_NUM_LEVELS, since final_n is at most MAX_N
+      const uint32_t first(CAPACITY - result.final_pop);
+      std::move(&workbuf[outlevels[0]], &workbuf[outlevels[0] + result.final_pop], &items_[first]);
+      for (uint8_t lvl = 0; lvl <= result.final_num_levels; lvl++) {
+        levels_[lvl] = outlevels[lvl] - outlevels[0] + first;
+      }
+      num_levels_ = result.final_num_levels;
+    }
+
+    std::unique_ptr<double[]> get_PMF_or_CDF(const T* split_points, uint32_t size, bool is_CDF) const {
+      if (is_empty()) return nullptr;
+      kll_helper::validate_values(split_points, size);
+      std::unique_ptr<uint64_t[]> weights(new uint64_t[size]);
+      get_sorted_view().get_weights_less_than(split_points, nullptr, size, weights.get());
+      std::unique_ptr<double[]> buckets(new double[size + 1]);
+      uint64_t previous_weight(0);
+      for (uint32_t i = 0; i <= size; i++) {
+        const uint64_t weight(i < size ? weights[i] : n_);
+        buckets[i] = (double) (is_CDF ? weight : weight - previous_weight) / n_;
+        previous_weight = weight;
+      }
+      return buckets;
+    }
+
+    static T get_empty_value() {
+      if (std::is_floating_point<T>::value) {
+        return std::numeric_limits<T>::quiet_NaN();
+      }
+      throw std::runtime_error("getting quantiles from empty sketch is not supported for this type of values");
+    }
+};
+
+template <typename T, uint16_t K, uint8_t LG_MAX_N>
+constexpr uint32_t kll_sketch_fixed<T, K, LG_MAX_N>::CAPACITY;
+
+template <typename T, uint16_t K, uint8_t LG_MAX_N>
+constexpr uint64_t kll_sketch_fixed<T, K, LG_MAX_N>::MAX_N;
+
+} /* namespace datasketches */
+
+#endif // KLL_SKETCH_FIXED_HPP_
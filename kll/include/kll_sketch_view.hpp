@@ -0,0 +1,336 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#ifndef KLL_SKETCH_VIEW_HPP_
+#define KLL_SKETCH_VIEW_HPP_
+
+#include <type_traits>
+#include <limits>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <string.h>
+
+#include "kll_sketch.hpp"
+#include "kll_helper.hpp"
+
+namespace datasketches {
+
+/*
+ * A read-only view of a serialized KLL sketch that answers the queries directly from the bytes,
+ * without deserializing the sketch or allocating memory. This is meant for scanning many sketches
+ * (for instance, memory-mapped from a file), where deserializing each of them would dominate.
+ *
+ * Only fixed-size item types are supported, since the items are read in place.
+ * The view does not copy the bytes, so they must outlive it. They need not be aligned.
+ *
+ * get_rank(), get_PMF() and get_CDF() take a binary search per level (and a scan of level 0 if it
+ * was not sorted when serialized). get_quantile() walks the levels in sorted order up to the
+ * requested position, comparing the next item of each level, so it takes up to the number of
+ * retained items times the number of levels. kll_sketch sorts level 0 when it serializes (except in the
+ * gathering serialize_into(), which references its items in place), but other writers may not: with an unsorted level 0, each of its items that get_quantile() passes
+ * takes a scan of the whole level, which is quadratic in its size (some 40000 reads for k = 200).
+ * Such images are better deserialized if many quantiles are needed.
+ */
+template <typename T>
+class kll_sketch_view {
+  static_assert(std::is_trivially_copyable<T>::value, "kll_sketch_view requires a fixed-size item type");
+  typedef kll_sketch<T> sketch;
+
+  public:
+    // size may be larger than the serialized sketch, as when the sketches are stored one after another
+    kll_sketch_view(const void* bytes, size_t size) {
+      if (size < sketch::EMPTY_SIZE_BYTES) {
+        throw std::invalid_argument("Possible corruption: insufficient size " + std::to_string(size));
+      }
+      const char* ptr = static_cast<const char*>(bytes);
+      const uint8_t preamble_ints(ptr[0]);
+      const uint8_t serial_version(ptr[1]);
+      const uint8_t family_id(ptr[2]);
+      const uint8_t flags_byte(ptr[3]);
+      memcpy(&k_, ptr + 4, sizeof(k_));
+      const uint8_t m(ptr[6]);
+
+      sketch::check_m(m);
+      sketch::check_preamble_ints(preamble_ints, flags_byte);
+      sketch::check_serial_version(serial_version);
+      sketch::check_family_id(family_id);
+      if (flags_byte & (1 << sketch::flags::IS_COMPRESSED)) {
+        throw std::invalid_argument("compressed sketches cannot be read in place, use kll_sketch::deserialize()");
+      }
+
+      is_level_zero_sorted_ = flags_byte & (1 << sketch::flags::IS_LEVEL_ZERO_SORTED);
+      min_k_ = k_;
+      levels_ = nullptr;
+      offset_ = 0;
+      items_ = nullptr;
+      if (flags_byte & (1 << sketch::flags::IS_EMPTY)) {
+        n_ = 0;
+        num_levels_ = 1;
+        capacity_ = 0;
+        size_bytes_ = sketch::EMPTY_SIZE_BYTES;
+        return;
+      }
+      if (flags_byte & (1 << sketch::flags::IS_SINGLE_ITEM)) {
+        n_ = 1;
+        num_levels_ = 1;
+        capacity_ = 1;
+        items_ = ptr + sketch::DATA_START_SINGLE_ITEM;
+        size_bytes_ = sketch::DATA_START_SINGLE_ITEM + sizeof(T);
+        check_size(size);
+        min_value_ = get_item(0);
+        max_value_ = min_value_;
+        return;
+      }
+
+      if (size < sketch::DATA_START) {
+        throw std::invalid_argument("Possible corruption: insufficient size " + std::to_string(size));
+      }
+      memcpy(&n_, ptr + 8, sizeof(n_));
+      memcpy(&min_k_, ptr + 16, sizeof(min_k_));
+      num_levels_ = ptr[18];
+      if (num_levels_ == 0) throw std::invalid_argument("Possible corruption: zero levels");
+      levels_ = ptr + sketch::DATA_START;
+      const size_t levels_size_bytes(sizeof(uint32_t) * num_levels_);
+      if (size < sketch::DATA_START + levels_size_bytes) {
+        throw std::invalid_argument("Possible corruption: insufficient size " + std::to_string(size));
+      }
+
+      // the last level boundary is not serialized, it is the capacity
+      // the levels are shifted so that the retained items start at index 0
+      const uint32_t capacity(kll_helper::compute_total_capacity(k_, m, num_levels_));
+      offset_ = get_level_bound(0);
+      if (offset_ > capacity) throw std::invalid_argument("Possible corruption: invalid levels");
+      capacity_ = capacity - offset_;
+      for (uint8_t level = 1; level < num_levels_; level++) {
+        if (get_level(level) < get_level(level - 1) or get_level(level) > capacity_) {
+          throw std::invalid_argument("Possible corruption: invalid levels");
+        }
+      }
+
+      const char* min_max_ptr(levels_ + levels_size_bytes);
+      items_ = min_max_ptr + 2 * sizeof(T);
+      size_bytes_ = sketch::DATA_START + levels_size_bytes + sizeof(T) * (2 + capacity_);
+      check_size(size);
+      memcpy(&min_value_, min_max_ptr, sizeof(T));
+      memcpy(&max_value_, min_max_ptr + sizeof(T), sizeof(T));
+    }
+
+    bool is_empty() const {
+      return n_ == 0;
+    }
+
+    uint16_t get_k() const {
+      return k_;
+    }
+
+    uint64_t get_n() const {
+      return n_;
+    }
+
+    uint32_t get_num_retained() const {
+      return capacity_;
+    }
+
+    bool is_estimation_mode() const {
+      return num_levels_ > 1;
+    }
+
+    // the number of bytes that the serialized sketch takes, which may be less than the size given
+    size_t get_serialized_size_bytes() const {
+      return size_bytes_;
+    }
+
+    T get_min_value() const {
+      if (is_empty()) return get_empty_value();
+      return min_value_;
+    }
+
+    T get_max_value() const {
+      if (is_empty()) return get_empty_value();
+      return max_value_;
+    }
+
+    // the same result as get_quantile() of the deserialized sketch
+    T get_quantile(double fraction) const {
+      if (is_empty()) return get_empty_value();
+      if (fraction == 0.0) return min_value_;
+      if (fraction == 1.0) return max_value_;
+      if ((fraction < 0.0) or (fraction > 1.0)) {
+        throw std::invalid_argument("Fraction cannot be less than zero or greater than 1.0");
+      }
+      uint64_t pos(std::floor(fraction * n_));
+      if (pos == n_) pos = n_ - 1;
+
+      // merge the levels on the fly, one cursor per level
+      // if level 0 is not sorted, its next item is found by a scan for the smallest item after the current one
+      uint32_t cursors[UINT8_MAX];
+      for (uint8_t level = 0; level < num_levels_; level++) cursors[level] = get_level(level);
+      const uint32_t level_zero_end(get_level(1));
+      if (!is_level_zero_sorted_) cursors[0] = next_in_level_zero(level_zero_end, level_zero_end);
+      uint64_t weight(0);
+      while (true) {
+        uint8_t min_level(0);
+        bool found(false);
+        T min_item{};
+        for (uint8_t level = 0; level < num_levels_; level++) {
+          if (cursors[level] == get_level(level + 1)) continue;
+          const T item(get_item(cursors[level]));
+          if (!found or item < min_item) {
+            min_item = item;
+            min_level = level;
+            found = true;
+          }
+        }
+        if (!found) return max_value_; // not reached if n matches the levels
+        weight += static_cast<uint64_t>(1) << min_level;
+        if (weight > pos) return min_item;
+        if (min_level == 0 and !is_level_zero_sorted_) {
+          cursors[0] = next_in_level_zero(cursors[0], level_zero_end);
+        } else {
+          cursors[min_level]++;
+        }
+      }
+    }
+
+    // the same result as get_rank() of the deserialized sketch
+    double get_rank(const T& value) const {
+      if (is_empty()) return std::numeric_limits<double>::quiet_NaN();
+      return (double) get_weight_less_than(value) / n_;
+    }
+
+    /*
+     * These write size + 1 values into the given array, the same values as the arrays that
+     * get_PMF() and get_CDF() of the deserialized sketch return. The values are NaN if the sketch is empty.
+     */
+    void get_PMF(const T* split_points, uint32_t size, double* result) const {
+      get_PMF_or_CDF(split_points, size, false, result);
+    }
+
+    void get_CDF(const T* split_points, uint32_t size, double* result) const {
+      get_PMF_or_CDF(split_points, size, true, result);
+    }
+
+    double get_normalized_rank_error(bool pmf) const {
+      return sketch::get_normalized_rank_error(min_k_, pmf);
+    }
+
+  private:
+    const char* levels_; // nullptr unless the sketch has more than one item
+    const char* items_;
+    uint64_t n_;
+    uint16_t k_;
+    uint16_t min_k_;
+    uint8_t num_levels_;
+    uint32_t offset_; // the serialized start of level 0
+    uint32_t capacity_; // the number of retained items
+    size_t size_bytes_;
+    bool is_level_zero_sorted_;
+    T min_value_;
+    T max_value_;
+
+    uint32_t get_level_bound(uint8_t level) const {
+      uint32_t bound;
+      memcpy(&bound, levels_ + sizeof(uint32_t) * level, sizeof(bound));
+      return bound;
+    }
+
+    // the start of the given level counting from the first retained item
+    uint32_t get_level(uint8_t level) const {
+      if (level == num_levels_) return capacity_;
+      if (levels_ == nullptr) return 0;
+      return get_level_bound(level) - offset_;
+    }
+
+    T get_item(uint32_t index) const {
+      T item;
+      memcpy(&item, items_ + sizeof(T) * index, sizeof(T));
+      return item;
+    }
+
+    // the index of the first item in the sorted range [first, last) that is not less than the value
+    uint32_t lower_bound(uint32_t first, uint32_t last, const T& value) const {
+      uint32_t length(last - first);
+      while (length > 0) {
+        const uint32_t half(length / 2);
+        if (get_item(first + half) < value) {
+          first += half + 1;
+          length -= half + 1;
+        } else {
+          length = half;
+        }
+      }
+      return first;
+    }
+
+    uint64_t get_weight_less_than(const T& value) const {
+      uint64_t weight(0);
+      const uint32_t level_zero_end(get_level(1));
+      if (is_level_zero_sorted_) {
+        weight += lower_bound(0, level_zero_end, value);
+      } else {
+        for (uint32_t i = 0; i < level_zero_end; i++) {
+          if (get_item(i) < value) weight++;
+        }
+      }
+      for (uint8_t level = 1; level < num_levels_; level++) {
+        const uint32_t from_index(get_level(level));
+        const uint32_t count(lower_bound(from_index, get_level(level + 1), value) - from_index);
+        weight += static_cast<uint64_t>(count) << level;
+      }
+      return weight;
+    }
+
+    // the next item of an unsorted level 0 in the order of (value, index) after the given index,
+    // which is level_zero_end to start, or level_zero_end if there are no more items
+    uint32_t next_in_level_zero(uint32_t index, uint32_t level_zero_end) const {
+      const bool is_start(index == level_zero_end);
+      const T current(is_start ? T() : get_item(index));
+      uint32_t next(level_zero_end);
+      T next_item{};
+      for (uint32_t i = 0; i < level_zero_end; i++) {
+        const T item(get_item(i));
+        if (!is_start and (item < current or (!(current < item) and i <= index))) continue;
+        if (next == level_zero_end or item < next_item) {
+          next = i;
+          next_item = item;
+        }
+      }
+      return next;
+    }
+
+    void get_PMF_or_CDF(const T* split_points, uint32_t size, bool is_CDF, double* result) const {
+      if (is_empty()) {
+        for (uint32_t i = 0; i <= size; i++) result[i] = std::numeric_limits<double>::quiet_NaN();
+        return;
+      }
+      kll_helper::validate_values(split_points, size);
+      uint64_t previous_weight(0);
+      for (uint32_t i = 0; i <= size; i++) {
+        const uint64_t weight(i < size ? get_weight_less_than(split_points[i]) : n_);
+        result[i] = (double) (is_CDF ? weight : weight - previous_weight) / n_;
+        previous_weight = weight;
+      }
+    }
+
+    void check_size(size_t size) const {
+      if (size < size_bytes_) {
+        throw std::invalid_argument("Possible corruption: insufficient size " + std::to_string(size)
+            + ", expected " + std::to_string(size_bytes_));
+      }
+    }
+
+    static T get_empty_value() {
+      if (std::is_floating_point<T>::value) {
+        return std::numeric_limits<T>::quiet_NaN();
+      }
+      throw std::runtime_error("getting quantiles from empty sketch is not supported for this type of values");
+    }
+
+};
+
+} /* namespace datasketches */
+
+#endif // KLL_SKETCH_VIEW_HPP_
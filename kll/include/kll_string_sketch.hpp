@@ -0,0 +1,336 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#ifndef KLL_STRING_SKETCH_HPP_
+#define KLL_STRING_SKETCH_HPP_
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <stdexcept>
+#include <limits>
+#include <string.h>
+
+#include "kll_sketch.hpp"
+
+namespace datasketches {
+
+/*
+ * A string stored elsewhere, with its first 8 bytes packed big-endian into an integer, zero padded.
+ * Comparing the prefixes compares the strings as far as they go, so most comparisons do not
+ * look at the bytes at all. The order is that of std::string.
+ */
+struct kll_string_ref {
+  uint64_t prefix;
+  const char* data;
+  uint32_t length;
+
+  kll_string_ref(): prefix(0), data(nullptr), length(0) {}
+
+  kll_string_ref(const char* data, uint32_t length): prefix(make_prefix(data, length)), data(data), length(length) {}
+
+  std::string to_string() const {
+    return length == 0 ? std::string() : std::string(data, length);
+  }
+
+  static uint64_t make_prefix(const char* data, uint32_t length) {
+    uint64_t prefix(0);
+    const uint32_t size(length < sizeof(prefix) ? length : sizeof(prefix));
+    for (uint32_t i = 0; i < size; i++) {
+      prefix |= static_cast<uint64_t>(static_cast<unsigned char>(data[i])) << (56 - 8 * i);
+    }
+    return prefix;
+  }
+};
+
+inline bool operator<(const kll_string_ref& a, const kll_string_ref& b) {
+  if (a.prefix != b.prefix) return a.prefix < b.prefix;
+  const uint32_t length(a.length < b.length ? a.length : b.length);
+  if (length > sizeof(a.prefix)) {
+    const int result(memcmp(a.data + sizeof(a.prefix), b.data + sizeof(b.prefix), length - sizeof(a.prefix)));
+    if (result != 0) return result < 0;
+  }
+  return a.length < b.length;
+}
+
+// only the lengths go with the sketch, kll_string_sketch writes the bytes of all strings after it
+template<>
+inline void serialize_items<kll_string_ref>(std::ostream& os, const kll_string_ref* items, unsigned num) {
+  std::unique_ptr<uint32_t[]> lengths(new uint32_t[num]);
+  for (unsigned i = 0; i < num; i++) lengths[i] = items[i].length;
+  os.write((char*)lengths.get(), sizeof(uint32_t) * num);
+}
+
+template<>
+inline void deserialize_items<kll_string_ref>(std::istream& is, kll_string_ref* items, unsigned num) {
+  std::unique_ptr<uint32_t[]> lengths(new uint32_t[num]);
+  is.read((char*)lengths.get(), sizeof(uint32_t) * num);
+  for (unsigned i = 0; i < num; i++) {
+    items[i] = kll_string_ref();
+    items[i].length = lengths[i];
+  }
+}
+
+template<>
+inline uint32_t kll_sketch<kll_string_ref>::get_sizeof_item() {
+  return sizeof(uint32_t);
+}
+
+/*
+ * Holds the bytes of the strings in chunks, which are never moved, so the references stay valid
+ * until the whole arena goes away.
+ */
+class kll_string_arena {
+  public:
+    explicit kll_string_arena(size_t capacity = 0): size_(0), pos_(0), chunk_size_(0) {
+      if (capacity > 0) add_chunk(capacity);
+    }
+
+    const char* store(const char* data, uint32_t length) {
+      if (length == 0) return nullptr;
+      char* ptr(allocate(length));
+      memcpy(ptr, data, length);
+      return ptr;
+    }
+
+    char* allocate(size_t length) {
+      if (pos_ + length > chunk_size_) {
+        // chunks grow with the arena up to a limit
+        const size_t size(size_ < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : size_ > MAX_CHUNK_SIZE ? MAX_CHUNK_SIZE : size_);
+        add_chunk(length > size ? length : size);
+      }
+      char* ptr(chunks_.back().get() + pos_);
+      pos_ += length;
+      size_ += length;
+      return ptr;
+    }
+
+    // the bytes stored so far, including the strings no longer referenced
+    size_t get_size() const {
+      return size_;
+    }
+
+  private:
+    static const size_t MIN_CHUNK_SIZE = 1 << 12;
+    static const size_t MAX_CHUNK_SIZE = 1 << 20;
+
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    size_t size_;
+    size_t pos_;
+    size_t chunk_size_;
+
+    void add_chunk(size_t size) {
+      chunks_.emplace_back(new char[size]);
+      chunk_size_ = size;
+      pos_ = 0;
+    }
+};
+
+/*
+ * A KLL sketch of strings, an alternative to kll_sketch<std::string>.
+ *
+ * The strings are copied into an arena and the sketch keeps kll_string_ref handles to them,
+ * so compactions move 24-byte handles with memcpy, and comparisons look at the 8-byte prefixes first.
+ * The strings dropped by compactions are reclaimed by moving the retained ones to a new arena
+ * once the arena has doubled since the last time this was done, and after merges.
+ *
+ * The serialized form is that of kll_sketch with the lengths of the strings in place of the items,
+ * followed by the bytes of all strings (min, max and the retained ones) in one block.
+ * There is no limit on the length of a string other than 2^32 - 1 bytes.
+ */
+class kll_string_sketch {
+  public:
+    explicit kll_string_sketch(uint16_t k = kll_sketch<kll_string_ref>::DEFAULT_K, uint64_t seed = kll_random_bits::default_seed()) :
+    sketch_(k, seed), packed_size_(0) {}
+
+    kll_string_sketch(const kll_string_sketch& other): sketch_(other.sketch_), packed_size_(0) {
+      pack(); // the handles point to the strings of the other sketch
+    }
+
+    kll_string_sketch(kll_string_sketch&& other) = default;
+
+    kll_string_sketch& operator=(const kll_string_sketch& other) {
+      kll_string_sketch copy(other);
+      return *this = std::move(copy);
+    }
+
+    kll_string_sketch& operator=(kll_string_sketch&& other) = default;
+
+    void update(const std::string& value) {
+      update(value.data(), value.size());
+    }
+
+    void update(const char* data, size_t length) {
+      if (length > std::numeric_limits<uint32_t>::max()) throw std::invalid_argument("strings must be shorter than 2^32 bytes");
+      const uint32_t len(static_cast<uint32_t>(length));
+      sketch_.update(kll_string_ref(arena_.store(data, len), len));
+      if (arena_.get_size() >= 2 * (packed_size_ > MIN_PACKED_SIZE ? packed_size_ : MIN_PACKED_SIZE)) pack();
+    }
+
+    void merge(const kll_string_sketch& other) {
+      sketch_.merge(other.sketch_);
+      pack(); // some handles point to the strings of the other sketch
+    }
+
+    bool is_empty() const {
+      return sketch_.is_empty();
+    }
+
+    uint16_t get_k() const {
+      return sketch_.k_;
+    }
+
+    uint64_t get_n() const {
+      return sketch_.get_n();
+    }
+
+    uint32_t get_num_retained() const {
+      return sketch_.get_num_retained();
+    }
+
+    bool is_estimation_mode() const {
+      return sketch_.is_estimation_mode();
+    }
+
+    std::string get_min_value() const {
+      return sketch_.get_min_value().to_string();
+    }
+
+    std::string get_max_value() const {
+      return sketch_.get_max_value().to_string();
+    }
+
+    std::string get_quantile(double fraction) const {
+      return sketch_.get_quantile(fraction).to_string();
+    }
+
+    double get_rank(const std::string& value) const {
+      return sketch_.get_rank(make_ref(value));
+    }
+
+    std::unique_ptr<double[]> get_PMF(const std::string* split_points, uint32_t size) const {
+      return sketch_.get_PMF(make_refs(split_points, size).data(), size);
+    }
+
+    std::unique_ptr<double[]> get_CDF(const std::string* split_points, uint32_t size) const {
+      return sketch_.get_CDF(make_refs(split_points, size).data(), size);
+    }
+
+    double get_normalized_rank_error(bool pmf) const {
+      return sketch_.get_normalized_rank_error(pmf);
+    }
+
+    uint32_t get_serialized_size_bytes() const {
+      return sketch_.get_serialized_size_bytes() + get_string_bytes();
+    }
+
+    void serialize(std::ostream& os) const {
+      // the strings follow in the order of the lengths, so level zero is sorted once for both
+      const kll_sketch<kll_string_ref>& s(sketch_);
+      const std::vector<kll_string_ref> level_zero(s.sorted_level_zero());
+      s.serialize_to(os, false, level_zero);
+      if (is_empty()) return;
+      std::unique_ptr<char[]> bytes(new char[get_string_bytes()]);
+      char* ptr(bytes.get());
+      const auto write([&ptr](const kll_string_ref& ref) {
+        if (ref.length > 0) memcpy(ptr, ref.data, ref.length);
+        ptr += ref.length;
+      });
+      if (s.n_ > 1) {
+        write(s.min_value_);
+        write(s.max_value_);
+      }
+      const uint32_t rest_begin(level_zero.empty() ? s.levels_[0] : s.levels_[1]);
+      for (const kll_string_ref& ref: level_zero) write(ref);
+      for (uint32_t i = rest_begin; i < s.levels_[s.num_levels_]; i++) write(s.items_[i]);
+      os.write(bytes.get(), ptr - bytes.get());
+    }
+
+    static std::unique_ptr<kll_string_sketch> deserialize(std::istream& is) {
+      auto sketch_ptr(kll_sketch<kll_string_ref>::deserialize(is));
+      std::unique_ptr<kll_string_sketch> sketch(new kll_string_sketch(std::move(*sketch_ptr)));
+      if (sketch->is_empty()) return sketch;
+      // the handles have the lengths only
+      const size_t size(sketch->get_string_bytes());
+      kll_string_arena arena(size);
+      char* ptr(size > 0 ? arena.allocate(size) : nullptr);
+      is.read(ptr, size);
+      sketch->for_each_string([&ptr](kll_string_ref& ref) {
+        ref = kll_string_ref(ref.length > 0 ? ptr : nullptr, ref.length);
+        ptr += ref.length;
+      });
+      kll_sketch<kll_string_ref>& s(sketch->sketch_);
+      if (s.n_ == 1) { // min and max are not serialized
+        s.min_value_ = s.items_[s.levels_[0]];
+        s.max_value_ = s.items_[s.levels_[0]];
+      }
+      sketch->arena_ = std::move(arena);
+      sketch->packed_size_ = size;
+      return sketch;
+    }
+
+  private:
+    static const size_t MIN_PACKED_SIZE = 1 << 16;
+
+    kll_sketch<kll_string_ref> sketch_;
+    kll_string_arena arena_;
+    size_t packed_size_; // the size of the arena after the last packing
+
+    explicit kll_string_sketch(kll_sketch<kll_string_ref>&& sketch): sketch_(std::move(sketch)), packed_size_(0) {}
+
+    static kll_string_ref make_ref(const std::string& value) {
+      if (value.size() > std::numeric_limits<uint32_t>::max()) throw std::invalid_argument("strings must be shorter than 2^32 bytes");
+      return kll_string_ref(value.data(), static_cast<uint32_t>(value.size()));
+    }
+
+    static std::vector<kll_string_ref> make_refs(const std::string* values, uint32_t size) {
+      std::vector<kll_string_ref> refs;
+      refs.reserve(size);
+      for (uint32_t i = 0; i < size; i++) refs.push_back(make_ref(values[i]));
+      return refs;
+    }
+
+    // in the order of serialization: min and max (unless there is a single item) and the retained items
+    template <typename F>
+    void for_each_string(F f) {
+      kll_sketch<kll_string_ref>& s(sketch_);
+      if (s.n_ > 1) {
+        f(s.min_value_);
+        f(s.max_value_);
+      }
+      for (uint32_t i = s.levels_[0]; i < s.levels_[s.num_levels_]; i++) f(s.items_[i]);
+    }
+
+    template <typename F>
+    void for_each_string(F f) const {
+      const_cast<kll_string_sketch*>(this)->for_each_string([&f](const kll_string_ref& ref) { f(ref); });
+    }
+
+    size_t get_string_bytes() const {
+      size_t size(0);
+      for_each_string([&size](const kll_string_ref& ref) { size += ref.length; });
+      return size;
+    }
+
+    // moves the strings that are still referenced to a new arena and drops the old one
+    void pack() {
+      if (is_empty()) return;
+      kll_sketch<kll_string_ref>& s(sketch_);
+      kll_string_arena arena(get_string_bytes());
+      for_each_string([&arena](kll_string_ref& ref) { ref.data = arena.store(ref.data, ref.length); });
+      if (s.n_ == 1) { // min and max are copies of the item
+        s.min_value_ = s.items_[s.levels_[0]];
+        s.max_value_ = s.items_[s.levels_[0]];
+      }
+      s.sorted_view_.reset(); // has copies of the handles
+      arena_ = std::move(arena);
+      packed_size_ = arena_.get_size();
+    }
+};
+
+} /* namespace datasketches */
+
+#endif // KLL_STRING_SKETCH_HPP_
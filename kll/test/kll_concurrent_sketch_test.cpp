@@ -0,0 +1,154 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <vector>
+
+#include "kll_concurrent_sketch.hpp"
+
+namespace datasketches {
+
+class kll_concurrent_sketch_test: public CppUnit::TestFixture {
+
+  CPPUNIT_TEST_SUITE(kll_concurrent_sketch_test);
+  CPPUNIT_TEST(empty);
+  CPPUNIT_TEST(single_thread);
+  CPPUNIT_TEST(many_threads);
+  CPPUNIT_TEST(snapshot_while_updating);
+  CPPUNIT_TEST(handed_over_on_thread_exit);
+  CPPUNIT_TEST(writer_outlives_sketch);
+  CPPUNIT_TEST(snapshot_serialized_by_many_threads);
+  CPPUNIT_TEST_SUITE_END();
+
+  void empty() {
+    kll_concurrent_sketch<float> sketch;
+    auto snapshot(sketch.get_snapshot());
+    CPPUNIT_ASSERT(snapshot->is_empty());
+    CPPUNIT_ASSERT_THROW(kll_concurrent_sketch<float>(200, 0), std::invalid_argument);
+  }
+
+  void single_thread() {
+    kll_concurrent_sketch<float> sketch(200, 100);
+    for (int i = 0; i < 250; i++) sketch.update(i);
+    // the last 50 items are still in the buffer of this thread
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 200, sketch.get_snapshot()->get_n());
+    sketch.flush();
+    auto snapshot(sketch.get_snapshot());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 250, snapshot->get_n());
+    CPPUNIT_ASSERT_EQUAL(0.0f, snapshot->get_min_value());
+    CPPUNIT_ASSERT_EQUAL(249.0f, snapshot->get_max_value());
+    // the same snapshot until there is something new
+    CPPUNIT_ASSERT(snapshot == sketch.get_snapshot());
+  }
+
+  void many_threads() {
+    kll_concurrent_sketch<double> sketch;
+    const int num_threads(4);
+    const int n(100000); // per thread
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&sketch, t, n, num_threads]() {
+        for (int i = 0; i < n; i++) sketch.update(i * num_threads + t);
+        sketch.flush();
+      });
+    }
+    for (std::thread& thread: threads) thread.join();
+
+    auto snapshot(sketch.get_snapshot());
+    const int total(n * num_threads);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) total, snapshot->get_n());
+    CPPUNIT_ASSERT_EQUAL(0.0, snapshot->get_min_value());
+    CPPUNIT_ASSERT_EQUAL((double) total - 1, snapshot->get_max_value());
+    for (int i = 0; i < total; i += total / 100) {
+      CPPUNIT_ASSERT_DOUBLES_EQUAL((double) i / total, snapshot->get_rank(i), snapshot->get_normalized_rank_error(false));
+    }
+  }
+
+  void snapshot_while_updating() {
+    kll_concurrent_sketch<float> sketch(200, 10);
+    std::atomic<bool> done(false);
+    std::thread writer([&sketch, &done]() {
+      for (int i = 0; i < 100000; i++) sketch.update(i);
+      done = true;
+    });
+    // a reader sees a growing sketch and queries each snapshot from several threads
+    uint64_t previous_n(0);
+    while (!done) {
+      auto snapshot(sketch.get_snapshot());
+      CPPUNIT_ASSERT(snapshot->get_n() >= previous_n);
+      previous_n = snapshot->get_n();
+      if (snapshot->is_empty()) continue;
+      std::vector<std::thread> readers;
+      std::atomic<int> num_errors(0);
+      for (int t = 0; t < 2; t++) {
+        readers.emplace_back([snapshot, &num_errors]() {
+          const float median(snapshot->get_quantile(0.5));
+          if (median < snapshot->get_min_value() or snapshot->get_max_value() < median) num_errors++;
+        });
+      }
+      for (std::thread& reader: readers) reader.join();
+      CPPUNIT_ASSERT_EQUAL(0, num_errors.load());
+    }
+    writer.join();
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 100000, sketch.get_snapshot()->get_n());
+  }
+
+  void handed_over_on_thread_exit() {
+    kll_concurrent_sketch<int> sketch(200, 1000);
+    std::thread writer([&sketch]() {
+      for (int i = 0; i < 1500; i++) sketch.update(i);
+    });
+    writer.join();
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1500, sketch.get_snapshot()->get_n());
+  }
+
+  void writer_outlives_sketch() {
+    std::unique_ptr<kll_concurrent_sketch<int>> sketch(new kll_concurrent_sketch<int>(200, 1000));
+    std::atomic<int> stage(0);
+    std::thread writer([&sketch, &stage]() {
+      for (int i = 0; i < 10; i++) sketch->update(i);
+      stage = 1;
+      while (stage != 2) std::this_thread::yield();
+    }); // exits with items in its buffer after the sketch is gone
+    while (stage != 1) std::this_thread::yield();
+    sketch.reset();
+    stage = 2;
+    writer.join();
+
+    // a new sketch of the same type from a new thread
+    kll_concurrent_sketch<int> other(200, 1000);
+    std::thread other_writer([&other]() { other.update(1); });
+    other_writer.join();
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1, other.get_snapshot()->get_n());
+  }
+
+  void snapshot_serialized_by_many_threads() {
+    kll_concurrent_sketch<float> sketch(200, 10);
+    for (int i = 0; i < 1000; i++) sketch.update((float) ((i * 7) % 1000)); // level 0 is not sorted
+    auto snapshot(sketch.get_snapshot());
+    std::vector<std::vector<char>> images(4);
+    std::vector<std::thread> threads;
+    for (std::vector<char>& image: images) {
+      threads.emplace_back([snapshot, &image]() {
+        auto data(snapshot->serialize());
+        const char* bytes(static_cast<const char*>(data.first.get()));
+        image.assign(bytes, bytes + data.second);
+      });
+    }
+    for (std::thread& thread: threads) thread.join();
+    for (const std::vector<char>& image: images) CPPUNIT_ASSERT(image == images[0]);
+    CPPUNIT_ASSERT(images[0][3] & 2); // level 0 sorted in the image
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(kll_concurrent_sketch_test);
+
+} /* namespace datasketches */
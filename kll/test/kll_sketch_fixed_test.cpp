@@ -0,0 +1,181 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <cmath>
+#include <sstream>
+#include <vector>
+
+#include "kll_sketch_fixed.hpp"
+
+namespace datasketches {
+
+class kll_sketch_fixed_test: public CppUnit::TestFixture {
+
+  CPPUNIT_TEST_SUITE(kll_sketch_fixed_test);
+  CPPUNIT_TEST(capacity_tables);
+  CPPUNIT_TEST(empty);
+  CPPUNIT_TEST(estimation_mode);
+  CPPUNIT_TEST(same_as_kll_sketch);
+  CPPUNIT_TEST(bulk_update);
+  CPPUNIT_TEST(merge);
+  CPPUNIT_TEST(serialize_deserialize);
+  CPPUNIT_TEST(too_many_items);
+  CPPUNIT_TEST_SUITE_END();
+
+  void capacity_tables() {
+    for (uint16_t k: {8, 200, 1000, 65535}) {
+      for (uint8_t num_levels = 1; num_levels < 61; num_levels++) {
+        CPPUNIT_ASSERT_EQUAL(kll_helper::compute_total_capacity(k, 8, num_levels), kll_total_capacity(k, 8, num_levels));
+        for (uint8_t height = 0; height < num_levels; height++) {
+          CPPUNIT_ASSERT_EQUAL(kll_helper::level_capacity(k, num_levels, height, 8),
+              kll_depth_capacity(k, 8, num_levels - height - 1));
+        }
+      }
+    }
+    typedef kll_capacity_tables<200, 8, kll_make_index_sequence<4>::type> tables;
+    static_assert(tables::total_capacity[3] == 200 + 133 + 89, "total capacity");
+    CPPUNIT_ASSERT_EQUAL(89u, tables::depth_capacity[2]);
+  }
+
+  void empty() {
+    kll_sketch_fixed<float> sketch;
+    CPPUNIT_ASSERT(sketch.is_empty());
+    CPPUNIT_ASSERT(!sketch.is_estimation_mode());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 0, sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(0u, sketch.get_num_retained());
+    CPPUNIT_ASSERT(std::isnan(sketch.get_rank(0)));
+    CPPUNIT_ASSERT(std::isnan(sketch.get_min_value()));
+    CPPUNIT_ASSERT(std::isnan(sketch.get_quantile(0.5)));
+    const float split_points[1] {0};
+    CPPUNIT_ASSERT(!sketch.get_CDF(split_points, 1));
+  }
+
+  void estimation_mode() {
+    kll_sketch_fixed<float> sketch;
+    const uint32_t n(1000000);
+    for (uint32_t i = 0; i < n; i++) sketch.update(i);
+    CPPUNIT_ASSERT(sketch.is_estimation_mode());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) n, sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(0.0f, sketch.get_min_value());
+    CPPUNIT_ASSERT_EQUAL((float) n - 1, sketch.get_max_value());
+    CPPUNIT_ASSERT(sketch.get_num_retained() < n);
+    for (uint32_t i = 0; i < n; i += n / 100) {
+      CPPUNIT_ASSERT_DOUBLES_EQUAL((double) i / n, sketch.get_rank(i), sketch.get_normalized_rank_error(false));
+    }
+  }
+
+  void same_as_kll_sketch() {
+    // the same compactions and the same random choices give the same items
+    kll_sketch<double> sketch(100, 1);
+    kll_sketch_fixed<double, 100> fixed_sketch(1);
+    for (int i = 0; i < 100000; i++) {
+      const double value((i * 7919) % 100000);
+      sketch.update(value);
+      fixed_sketch.update(value);
+    }
+    CPPUNIT_ASSERT_EQUAL(sketch.get_num_retained(), fixed_sketch.get_num_retained());
+    for (int i = 0; i <= 100; i++) {
+      CPPUNIT_ASSERT_EQUAL(sketch.get_quantile(i / 100.0), fixed_sketch.get_quantile(i / 100.0));
+    }
+  }
+
+  void bulk_update() {
+    const int n(10000);
+    std::vector<int> values(n);
+    for (int i = 0; i < n; i++) values[i] = n - i - 1;
+    kll_sketch_fixed<int> sketch;
+    sketch.update(values.data(), 100);
+    sketch.update(values.data() + 100, n - 100);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) n, sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(0, sketch.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(n - 1, sketch.get_max_value());
+    for (int i = 0; i < n; i += n / 100) {
+      CPPUNIT_ASSERT_DOUBLES_EQUAL((double) i / n, sketch.get_rank(i), sketch.get_normalized_rank_error(false));
+    }
+
+    // NaN is dropped
+    const float float_values[4] {1, std::numeric_limits<float>::quiet_NaN(), 2, std::numeric_limits<float>::quiet_NaN()};
+    kll_sketch_fixed<float> float_sketch;
+    float_sketch.update(float_values, 4);
+    float_sketch.update(float_values[1]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 2, float_sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(2.0f, float_sketch.get_max_value());
+  }
+
+  void merge() {
+    kll_sketch_fixed<float> sketch1;
+    kll_sketch_fixed<float> sketch2;
+    const int n(10000);
+    for (int i = 0; i < n; i++) {
+      sketch1.update(i);
+      sketch2.update(2 * n - i - 1);
+    }
+    // a copy keeps the state of the first sketch
+    const kll_sketch_fixed<float> copy(sketch1);
+    sketch1.merge(sketch2);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) n, copy.get_n());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 2 * n, sketch1.get_n());
+    CPPUNIT_ASSERT_EQUAL(0.0f, sketch1.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(2.0f * n - 1, sketch1.get_max_value());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(n, sketch1.get_quantile(0.5), n * 0.02);
+
+    kll_sketch_fixed<float> sketch3;
+    sketch3.merge(sketch1);
+    CPPUNIT_ASSERT_EQUAL(sketch1.get_n(), sketch3.get_n());
+    CPPUNIT_ASSERT_EQUAL(0.0f, sketch3.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(2.0f * n - 1, sketch3.get_max_value());
+  }
+
+  void serialize_deserialize() {
+    for (int n: {0, 1, 100, 100000}) {
+      kll_sketch_fixed<float> sketch;
+      for (int i = 0; i < n; i++) sketch.update(i);
+      std::stringstream s(std::ios::in | std::ios::out | std::ios::binary);
+      sketch.serialize(s);
+      auto sketch_ptr(kll_sketch<float>::deserialize(s));
+      CPPUNIT_ASSERT_EQUAL(s.tellp(), s.tellg());
+      CPPUNIT_ASSERT_EQUAL(sketch.get_n(), sketch_ptr->get_n());
+      CPPUNIT_ASSERT_EQUAL(sketch.get_num_retained(), sketch_ptr->get_num_retained());
+      if (n == 0) continue;
+      CPPUNIT_ASSERT_EQUAL(sketch.get_min_value(), sketch_ptr->get_min_value());
+      CPPUNIT_ASSERT_EQUAL(sketch.get_max_value(), sketch_ptr->get_max_value());
+      for (int i = 0; i <= 100; i++) {
+        CPPUNIT_ASSERT_EQUAL(sketch.get_quantile(i / 100.0), sketch_ptr->get_quantile(i / 100.0));
+      }
+      // the deserialized sketch keeps going
+      for (int i = 0; i < n; i++) sketch_ptr->update(i);
+      CPPUNIT_ASSERT_EQUAL((uint64_t) 2 * n, sketch_ptr->get_n());
+    }
+  }
+
+  void too_many_items() {
+    kll_sketch_fixed<int, 8, 10> sketch;
+    for (int i = 0; i < 1024; i++) sketch.update(i);
+    kll_sketch_fixed<int, 8, 10> sketch2;
+    sketch2.update(0);
+    CPPUNIT_ASSERT_THROW(sketch.merge(sketch2), std::length_error);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1024, sketch.get_n());
+    CPPUNIT_ASSERT_THROW(sketch.update(1024), std::length_error);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1024, sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(1023, sketch.get_max_value());
+
+    kll_sketch_fixed<float, 8, 10> sketch3;
+    std::vector<float> values(1024, 1.0f);
+    sketch3.update(values.data(), 1000);
+    CPPUNIT_ASSERT_THROW(sketch3.update(values.data(), 25), std::length_error);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1000, sketch3.get_n());
+    values[0] = std::numeric_limits<float>::quiet_NaN(); // not counted
+    sketch3.update(values.data(), 25);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1024, sketch3.get_n());
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(kll_sketch_fixed_test);
+
+} /* namespace datasketches */
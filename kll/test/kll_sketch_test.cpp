@@ -5,11 +5,14 @@
 
 #include <kll_sketch.hpp>
 #include <kll_helper.hpp>
+#include <kll_sketch_view.hpp>
 
 #include <cppunit/TestFixture.h>
 #include <cppunit/extensions/HelperMacros.h>
 #include <cmath>
 #include <cstring>
+#include <random>
+#include <algorithm>
 
 // this is for debug printing of kll_sketch<std::string> using ostream& operator<<()
 namespace std {
@@ -21,6 +24,18 @@ namespace std {
 namespace datasketches {
 
 static const double RANK_EPS_FOR_K_200 = 0.0133;
+
+// counts the live instances to check that the sketch destroys every item it constructs
+struct counted_item {
+  static int num_live;
+  int value;
+  counted_item(int value = 0) : value(value) { num_live++; }
+  counted_item(const counted_item& other) : value(other.value) { num_live++; }
+  counted_item& operator=(const counted_item& other) { value = other.value; return *this; }
+  ~counted_item() { num_live--; }
+  bool operator<(const counted_item& other) const { return value < other.value; }
+};
+int counted_item::num_live = 0;
 static const double NUMERIC_NOISE_TOLERANCE = 1E-6;
 
 #ifdef TEST_BINARY_INPUT_PATH
@@ -87,6 +102,7 @@ class kll_sketch_test: public CppUnit::TestFixture {
   CPPUNIT_TEST(out_of_order_split_points_float);
   CPPUNIT_TEST(out_of_order_split_points_int);
   CPPUNIT_TEST(nan_split_point);
+  CPPUNIT_TEST(nan_dropped);
   CPPUNIT_TEST(merge);
   CPPUNIT_TEST(merge_lower_k);
   CPPUNIT_TEST(merge_exact_mode_lower_k);
@@ -95,6 +111,25 @@ class kll_sketch_test: public CppUnit::TestFixture {
   CPPUNIT_TEST(sketch_of_ints);
   CPPUNIT_TEST(sketch_of_strings);
   CPPUNIT_TEST(copy);
+  CPPUNIT_TEST(bulk_update);
+  CPPUNIT_TEST(bulk_update_exact_mode);
+  CPPUNIT_TEST(seed);
+  CPPUNIT_TEST(sorted_view);
+  CPPUNIT_TEST(get_ranks);
+  CPPUNIT_TEST(merge_many);
+  CPPUNIT_TEST(merge_many_exact_mode);
+  CPPUNIT_TEST(parallel_build);
+  CPPUNIT_TEST(deamortized);
+  CPPUNIT_TEST(deamortized_strings);
+  CPPUNIT_TEST(deamortized_work_in_progress);
+  CPPUNIT_TEST(sort_items);
+  CPPUNIT_TEST(merge_sorted_arrays);
+  CPPUNIT_TEST(move);
+  CPPUNIT_TEST(constructed_items);
+  CPPUNIT_TEST(weighted_update);
+  CPPUNIT_TEST(serialize_deserialize_compressed);
+  CPPUNIT_TEST(serialize_into_buffer);
+  CPPUNIT_TEST(serialize_into_pieces);
   CPPUNIT_TEST_SUITE_END();
 
   void k_limits() {
@@ -376,6 +411,30 @@ class kll_sketch_test: public CppUnit::TestFixture {
     CPPUNIT_ASSERT_THROW(sketch.get_CDF(split_points, 1), std::invalid_argument);
   }
 
+  void nan_dropped() {
+    const float nan(std::numeric_limits<float>::quiet_NaN());
+    kll_sketch<float> sketch;
+    sketch.update(nan);
+    sketch.update(nan, 5);
+    CPPUNIT_ASSERT(sketch.is_empty());
+    // NaN first, in the middle and last
+    const int n(100); // exact mode
+    std::vector<float> values;
+    values.push_back(nan);
+    for (int i = 0; i < n; i++) {
+      values.push_back(i);
+      if (i % 10 == 5) values.push_back(-nan);
+    }
+    values.push_back(nan);
+    sketch.update(values.data(), values.size());
+    sketch.update(nan);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) n, sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(0.0f, sketch.get_min_value());
+    CPPUNIT_ASSERT_EQUAL((float) n - 1, sketch.get_max_value());
+    CPPUNIT_ASSERT_EQUAL((float) n - 1, sketch.get_quantile(0.999));
+    for (int i = 0; i < n; i++) CPPUNIT_ASSERT_EQUAL((double) i / n, sketch.get_rank(i));
+  }
+
   void merge() {
     kll_sketch<float> sketch1;
     kll_sketch<float> sketch2;
@@ -561,6 +620,657 @@ class kll_sketch_test: public CppUnit::TestFixture {
     }
   }
 
+  void bulk_update() {
+    const int n(1000000);
+    std::unique_ptr<float[]> values(new float[n]);
+    for (int i = 0; i < n; i++) values[i] = ((uint64_t) i * 7919) % n; // a permutation of 0..n-1
+    kll_sketch<float> sketch1;
+    kll_sketch<float> sketch2;
+    for (int i = 0; i < n; i++) sketch1.update(values[i]);
+    // uneven batches, some of them crossing compactions
+    int pos(0);
+    for (int size: {1, 7, 13, 1000, 12345}) {
+      sketch2.update(&values[pos], size);
+      pos += size;
+    }
+    sketch2.update(&values[pos], n - pos);
+
+    CPPUNIT_ASSERT_EQUAL(sketch1.get_n(), sketch2.get_n());
+    CPPUNIT_ASSERT_EQUAL(sketch1.get_num_retained(), sketch2.get_num_retained());
+    CPPUNIT_ASSERT_EQUAL(0.0f, sketch2.get_min_value());
+    CPPUNIT_ASSERT_EQUAL((float) n - 1, sketch2.get_max_value());
+    for (int i = 0; i < n; i += 1000) {
+      CPPUNIT_ASSERT_DOUBLES_EQUAL((double) i / n, sketch2.get_rank(i), RANK_EPS_FOR_K_200);
+    }
+  }
+
+  void bulk_update_exact_mode() {
+    const double values[] = {5, -1, 3, 8, 2, 9, 0, 4, 7};
+    kll_sketch<double> sketch1;
+    kll_sketch<double> sketch2;
+    for (double value: values) sketch1.update(value);
+    sketch2.update(values, 0); // nothing
+    CPPUNIT_ASSERT(sketch2.is_empty());
+    sketch2.update(values, 9);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 9, sketch2.get_n());
+    CPPUNIT_ASSERT_EQUAL(-1.0, sketch2.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(9.0, sketch2.get_max_value());
+    for (int i = -2; i < 11; i++) {
+      CPPUNIT_ASSERT_EQUAL(sketch1.get_rank(i), sketch2.get_rank(i));
+    }
+
+    kll_sketch<int> sketch3;
+    const int ints[] = {3, 1, 2};
+    sketch3.update(ints, 3);
+    CPPUNIT_ASSERT_EQUAL(1, sketch3.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(3, sketch3.get_max_value());
+  }
+
+  void seed() {
+    // the same seed must make the same random choices
+    kll_sketch<float> sketch1(200, 123);
+    kll_sketch<float> sketch2(200, 123);
+    kll_sketch<float> sketch3(200, 123);
+    kll_sketch<float> other(200, 123);
+    for (int i = 0; i < 10000; i++) {
+      sketch1.update(i);
+      sketch2.update(i);
+      other.update(-i);
+    }
+    sketch3 = sketch1; // copies the state of the generator
+    sketch1.merge(other);
+    sketch2.merge(other);
+    sketch3.merge(other);
+    CPPUNIT_ASSERT(sketch1.is_estimation_mode());
+    auto data1 = sketch1.serialize();
+    auto data2 = sketch2.serialize();
+    auto data3 = sketch3.serialize();
+    CPPUNIT_ASSERT_EQUAL(data1.second, data2.second);
+    CPPUNIT_ASSERT(std::memcmp(data1.first.get(), data2.first.get(), data1.second) == 0);
+    CPPUNIT_ASSERT_EQUAL(data1.second, data3.second);
+    CPPUNIT_ASSERT(std::memcmp(data1.first.get(), data3.first.get(), data1.second) == 0);
+  }
+
+  void sorted_view() {
+    kll_sketch<int> sketch;
+    for (int i = 0; i < 1000; i++) sketch.update(i);
+    const kll_quantile_calculator<int>* view = &sketch.get_sorted_view();
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1000, view->get_n());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.5, sketch.get_rank(500), RANK_EPS_FOR_K_200);
+    sketch.get_quantile(0.5);
+    CPPUNIT_ASSERT(view == &sketch.get_sorted_view()); // kept between queries
+
+    // any change must be visible to the next query
+    for (int i = 0; i < 1000; i++) sketch.update(-1);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.5, sketch.get_rank(0), RANK_EPS_FOR_K_200);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 2000, sketch.get_sorted_view().get_n());
+    kll_sketch<int> other;
+    for (int i = 0; i < 2000; i++) other.update(2000);
+    sketch.get_quantile(0.5);
+    sketch.merge(other);
+    CPPUNIT_ASSERT_EQUAL(2000, sketch.get_quantile(0.75));
+    const int split_points[] {0, 2000};
+    auto cdf = sketch.get_CDF(split_points, 2);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.25, cdf[0], RANK_EPS_FOR_K_200);
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.5, cdf[1], RANK_EPS_FOR_K_200);
+    CPPUNIT_ASSERT_EQUAL(1.0, cdf[2]);
+
+    // a copy has its own view
+    kll_sketch<int> copy(sketch);
+    CPPUNIT_ASSERT(&copy.get_sorted_view() != &sketch.get_sorted_view());
+    CPPUNIT_ASSERT_EQUAL(sketch.get_quantile(0.3), copy.get_quantile(0.3));
+  }
+
+  void get_ranks() {
+    kll_sketch<float> sketch;
+    CPPUNIT_ASSERT(!sketch.get_ranks(nullptr, 0));
+    for (int i = 0; i < 100000; i++) sketch.update((i * 37) % 1000);
+
+    // unsorted with duplicates and values outside of the range
+    const uint32_t size(3000);
+    std::unique_ptr<float[]> values(new float[size]);
+    for (uint32_t i = 0; i < size; i++) values[i] = ((i * 7919) % 1500) - 250.5f;
+    values[17] = std::numeric_limits<float>::quiet_NaN();
+    auto ranks = sketch.get_ranks(values.get(), size);
+    for (uint32_t i = 0; i < size; i++) {
+      CPPUNIT_ASSERT_EQUAL(sketch.get_rank(values[i]), ranks[i]);
+    }
+
+    // sorted
+    std::sort(values.get(), values.get() + size, [](float a, float b) { return !std::isnan(a) and (std::isnan(b) or a < b); });
+    ranks = sketch.get_ranks(values.get(), size - 1); // without the NaN at the end
+    for (uint32_t i = 0; i < size - 1; i++) {
+      CPPUNIT_ASSERT_EQUAL(sketch.get_rank(values[i]), ranks[i]);
+    }
+  }
+
+  void merge_many() {
+    const int num_sketches(100);
+    const int n(10000);
+    std::vector<kll_sketch<float>> sketches;
+    for (int i = 0; i < num_sketches; i++) {
+      sketches.push_back(kll_sketch<float>());
+      if (i % 10 == 3) continue; // some empty ones
+      for (int j = 0; j < n + i; j++) sketches.back().update(j * num_sketches + i);
+    }
+    uint64_t total_n(0);
+    for (const auto& sketch: sketches) total_n += sketch.get_n();
+
+    kll_sketch<float> sketch;
+    for (int i = 0; i < 1000; i++) sketch.update(-i - 1); // something already in the target
+    sketch.merge(sketches.begin(), sketches.end());
+    CPPUNIT_ASSERT_EQUAL(total_n + 1000, sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(-1000.0f, sketch.get_min_value());
+    CPPUNIT_ASSERT_EQUAL((float) (n + num_sketches - 2) * num_sketches + num_sketches - 1, sketch.get_max_value());
+    CPPUNIT_ASSERT(sketch.get_num_retained() < 1000); // compacted to about 3k
+    const double total(sketch.get_n());
+    for (int v = 0; v < n * num_sketches; v += 10007) {
+      // each sketch has about the same share of values below v
+      const double true_rank((1000 + (double) v / num_sketches * 90) / total);
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(true_rank, sketch.get_rank(v), RANK_EPS_FOR_K_200);
+    }
+  }
+
+  void merge_many_exact_mode() {
+    std::vector<kll_sketch<int>> sketches(5);
+    for (int i = 0; i < 5; i++) {
+      for (int j = 0; j < 20; j++) sketches[i].update(j * 5 + i);
+    }
+    std::vector<const kll_sketch<int>*> pointers;
+    for (const auto& s: sketches) pointers.push_back(&s);
+    kll_sketch<int> sketch;
+    sketch.merge(pointers.data(), pointers.size());
+    CPPUNIT_ASSERT(!sketch.is_estimation_mode());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 100, sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(0, sketch.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(99, sketch.get_max_value());
+    for (int i = 0; i <= 100; i++) {
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(i / 100.0, sketch.get_rank(i), 1e-10);
+    }
+  }
+
+  void parallel_build() {
+    const int n(1000000);
+    std::unique_ptr<double[]> values(new double[n]);
+    for (int i = 0; i < n; i++) values[i] = ((uint64_t) i * 7919) % n; // a permutation of 0..n-1
+    CPPUNIT_ASSERT_THROW(kll_sketch<double>::build(values.get(), n, 0), std::invalid_argument);
+
+    kll_sketch<double> sketch(kll_sketch<double>::build(values.get(), n, 4));
+    CPPUNIT_ASSERT_EQUAL((uint64_t) n, sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(0.0, sketch.get_min_value());
+    CPPUNIT_ASSERT_EQUAL((double) n - 1, sketch.get_max_value());
+    CPPUNIT_ASSERT(sketch.get_num_retained() < 1000); // compacted to about 3k
+    for (int i = 0; i < n; i += 1000) {
+      CPPUNIT_ASSERT_DOUBLES_EQUAL((double) i / n, sketch.get_rank(i), sketch.get_normalized_rank_error(false));
+    }
+
+    // too small to split
+    kll_sketch<double> small(kll_sketch<double>::build(values.get(), 100, 4, 100));
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 100, small.get_n());
+    CPPUNIT_ASSERT(!small.is_estimation_mode());
+    CPPUNIT_ASSERT_EQUAL(kll_sketch<double>::get_normalized_rank_error(100, false), small.get_normalized_rank_error(false));
+  }
+
+  // with the same seed the compactions are the same, only done later
+  template <typename T>
+  static void check_same_quantiles(const kll_sketch<T>& expected, const kll_sketch<T>& actual) {
+    CPPUNIT_ASSERT_EQUAL(expected.get_n(), actual.get_n());
+    CPPUNIT_ASSERT_EQUAL(expected.get_num_retained(), actual.get_num_retained());
+    CPPUNIT_ASSERT_EQUAL(expected.get_min_value(), actual.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(expected.get_max_value(), actual.get_max_value());
+    for (int i = 0; i <= 100; i++) {
+      CPPUNIT_ASSERT_EQUAL(expected.get_quantile(i / 100.0), actual.get_quantile(i / 100.0));
+    }
+  }
+
+  void deamortized() {
+    kll_sketch<float> sketch1(200, 1);
+    kll_sketch<float> sketch2(200, 1);
+    CPPUNIT_ASSERT(!sketch2.is_deamortized());
+    sketch2.set_deamortized(true);
+    CPPUNIT_ASSERT(sketch2.is_deamortized());
+    const int n(100000);
+    for (int i = 0; i < n; i++) {
+      const float value(((uint64_t) i * 7919) % n);
+      sketch1.update(value);
+      sketch2.update(value);
+      if (i == n / 2) check_same_quantiles(sketch1, kll_sketch<float>(sketch2));
+    }
+    sketch2.flush();
+    check_same_quantiles(sketch1, sketch2);
+
+    auto data(sketch2.serialize());
+    auto sketch3(kll_sketch<float>::deserialize(data.first.get(), data.second));
+    check_same_quantiles(sketch1, *sketch3);
+
+    for (int i = 0; i < 1000; i++) {
+      sketch1.update(i);
+      sketch2.update(i);
+    }
+    sketch2.set_deamortized(false);
+    CPPUNIT_ASSERT(!sketch2.is_deamortized());
+    sketch1.update(n);
+    sketch2.update(n);
+    check_same_quantiles(sketch1, sketch2);
+
+    kll_sketch<float> sketch4;
+    sketch4.set_deamortized(true);
+    sketch4.merge(sketch1);
+    for (int i = 0; i < 1000; i++) sketch4.update(i);
+    sketch4.merge(sketch2);
+    CPPUNIT_ASSERT_EQUAL(2 * sketch1.get_n() + 1000, sketch4.get_n());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.5, sketch4.get_rank(n / 2), sketch4.get_normalized_rank_error(false));
+  }
+
+  void deamortized_strings() {
+    kll_sketch<std::string> sketch1(20, 1);
+    kll_sketch<std::string> sketch2(20, 1);
+    sketch2.set_deamortized(true);
+    for (int i = 0; i < 10000; i++) {
+      sketch1.update(std::to_string(i));
+      sketch2.update(std::to_string(i));
+      // some of these are destroyed in the middle of a compaction
+      if (i % 1000 == 999) kll_sketch<std::string> copy(sketch2);
+      if (i % 1000 == 999) {
+        kll_sketch<std::string> other(20);
+        other.set_deamortized(true);
+        for (int j = 0; j < i; j++) other.update(std::to_string(j));
+      }
+    }
+    sketch2.flush();
+    check_same_quantiles(sketch1, sketch2);
+  }
+
+  void deamortized_work_in_progress() {
+    kll_sketch<float> sketch1(200, 1);
+    kll_sketch<float> sketch2(200, 1);
+    sketch2.set_deamortized(true);
+    bool in_progress(false);
+    for (int i = 0; i < 10000 and !in_progress; i++) {
+      sketch1.update(i);
+      sketch2.update(i);
+      try {
+        sketch2.get_num_retained();
+      } catch (std::logic_error&) {
+        in_progress = true;
+      }
+    }
+    CPPUNIT_ASSERT(in_progress);
+    // const methods do not do the work
+    const kll_sketch<float>& const_sketch(sketch2);
+    CPPUNIT_ASSERT_THROW(const_sketch.get_quantile(0.5), std::logic_error);
+    CPPUNIT_ASSERT_THROW(const_sketch.serialize(), std::logic_error);
+    CPPUNIT_ASSERT_THROW(const_sketch.get_serialized_size_bytes(), std::logic_error);
+
+    // a copy and a merge take the work with them
+    check_same_quantiles(sketch1, kll_sketch<float>(sketch2));
+    kll_sketch<float> merged1(200, 2);
+    merged1.merge(sketch1);
+    kll_sketch<float> merged2(200, 2);
+    merged2.merge(sketch2);
+    check_same_quantiles(merged1, merged2);
+    std::vector<const kll_sketch<float>*> others {&sketch2, &sketch1};
+    merged2.merge(others.data(), others.size());
+    CPPUNIT_ASSERT_EQUAL(3 * sketch1.get_n(), merged2.get_n());
+
+    sketch2.flush();
+    check_same_quantiles(sketch1, sketch2);
+  }
+
+  template <typename T>
+  static void check_sort_items(const std::vector<T>& items) {
+    std::vector<T> expected(items);
+    std::sort(expected.begin(), expected.end());
+    std::vector<T> sorted(items);
+    kll_helper::sort_items(sorted.data(), sorted.data() + sorted.size());
+    for (size_t i = 0; i < items.size(); i++) CPPUNIT_ASSERT_EQUAL(expected[i], sorted[i]);
+  }
+
+  template <typename T>
+  static void check_sort_items(std::mt19937_64& random) {
+    for (uint32_t size: {0, 1, 100, 1000, 10000}) {
+      std::vector<T> items(size);
+      for (T& item: items) {
+        const uint64_t bits(random());
+        memcpy(&item, &bits, sizeof(T));
+      }
+      check_sort_items(items);
+      for (size_t i = 0; i < items.size(); i++) items[i] = static_cast<T>(i % 7); // equal bytes above the first
+      check_sort_items(items);
+    }
+  }
+
+  void sort_items() {
+    std::mt19937_64 random(1);
+    check_sort_items<int8_t>(random);
+    check_sort_items<uint16_t>(random);
+    check_sort_items<int32_t>(random);
+    check_sort_items<uint32_t>(random);
+    check_sort_items<int64_t>(random);
+    check_sort_items<uint64_t>(random);
+
+    // no NaN, as in the sketch
+    std::vector<double> doubles;
+    for (int i = 0; i < 10000; i++) {
+      const double value(std::ldexp(static_cast<double>(random() % 1000000) - 500000, static_cast<int>(random() % 2000) - 1000));
+      doubles.push_back(value);
+    }
+    doubles[0] = std::numeric_limits<double>::infinity();
+    doubles[1] = -std::numeric_limits<double>::infinity();
+    doubles[2] = std::numeric_limits<double>::denorm_min();
+    doubles[3] = -std::numeric_limits<double>::denorm_min();
+    doubles[4] = std::numeric_limits<double>::lowest();
+    check_sort_items(doubles);
+    std::vector<float> floats;
+    for (int i = 0; i < 10000; i++) floats.push_back(static_cast<float>(static_cast<int>(random() % 2000) - 1000) / 7);
+    floats[0] = -std::numeric_limits<float>::infinity();
+    check_sort_items(floats);
+
+    // negative zero goes first, std::sort considers it equal to zero
+    std::vector<float> zeros(1000, 0.0f);
+    for (size_t i = 0; i < zeros.size(); i += 2) zeros[i] = -0.0f;
+    kll_helper::sort_items(zeros.data(), zeros.data() + zeros.size());
+    for (size_t i = 0; i < zeros.size(); i++) CPPUNIT_ASSERT_EQUAL(i < zeros.size() / 2, std::signbit(zeros[i]));
+
+    // a sketch of doubles with level 0 sorted this way
+    kll_sketch<double> sketch(1000);
+    const int n(100000);
+    for (int i = 0; i < n; i++) sketch.update(static_cast<double>((i * 7919) % n) - n / 2);
+    for (int i = 0; i < n; i += n / 100) {
+      CPPUNIT_ASSERT_DOUBLES_EQUAL(static_cast<double>(i) / n, sketch.get_rank(i - n / 2), sketch.get_normalized_rank_error(false));
+    }
+  }
+
+  template <typename T>
+  static void check_merge_sorted_arrays(std::vector<T> a, std::vector<T> b) {
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    std::vector<T> expected(a.size() + b.size());
+    std::merge(a.begin(), a.end(), b.begin(), b.end(), expected.begin());
+    std::vector<T> merged(a.size() + b.size());
+    kll_helper::merge_sorted_arrays(a.data(), 0, a.size(), b.data(), 0, b.size(), merged.data(), 0);
+    CPPUNIT_ASSERT(expected == merged);
+
+    // in place, as in the compaction: a before a gap of its size, then b, and the result starts after a
+    std::vector<T> buffer(a);
+    buffer.resize(2 * a.size());
+    buffer.insert(buffer.end(), b.begin(), b.end());
+    kll_helper::merge_sorted_arrays(buffer.data(), 0, a.size(), buffer.data(), 2 * a.size(), b.size(), buffer.data(), a.size());
+    CPPUNIT_ASSERT(std::equal(expected.begin(), expected.end(), buffer.begin() + a.size()));
+  }
+
+  void merge_sorted_arrays() {
+    std::mt19937_64 random(1);
+    for (uint32_t size_a: {0, 1, 100, 1000}) {
+      for (uint32_t size_b: {0, 1, 100, 1000}) {
+        std::vector<int> ints_a(size_a);
+        for (int& item: ints_a) item = random() % 1000;
+        std::vector<int> ints_b(size_b);
+        for (int& item: ints_b) item = random() % 1000;
+        check_merge_sorted_arrays(ints_a, ints_b);
+        std::vector<std::string> strings_a;
+        for (int item: ints_a) strings_a.push_back(std::to_string(item));
+        std::vector<std::string> strings_b;
+        for (int item: ints_b) strings_b.push_back(std::to_string(item));
+        check_merge_sorted_arrays(strings_a, strings_b);
+      }
+    }
+  }
+
+  void move() {
+    kll_sketch<std::string> sketch1;
+    const int n(1000);
+    for (int i = 0; i < n; i++) {
+      std::string value(std::to_string(i));
+      sketch1.update(std::move(value));
+    }
+    const std::string median(sketch1.get_quantile(0.5));
+    kll_sketch<std::string> sketch2(std::move(sketch1));
+    CPPUNIT_ASSERT_EQUAL((uint64_t) n, sketch2.get_n());
+    CPPUNIT_ASSERT_EQUAL(median, sketch2.get_quantile(0.5));
+    sketch1 = sketch2; // a moved from sketch can be assigned to
+    CPPUNIT_ASSERT_EQUAL(median, sketch1.get_quantile(0.5));
+    kll_sketch<std::string> sketch3;
+    sketch3 = std::move(sketch2);
+    CPPUNIT_ASSERT_EQUAL(median, sketch3.get_quantile(0.5));
+    sketch3.update("a");
+    CPPUNIT_ASSERT_EQUAL((uint64_t) n + 1, sketch3.get_n());
+
+    CPPUNIT_ASSERT(std::is_nothrow_move_constructible<kll_sketch<float>>::value);
+    std::vector<kll_sketch<float>> sketches;
+    for (int i = 0; i < 10; i++) {
+      sketches.emplace_back();
+      sketches.back().update(i);
+    }
+    for (int i = 0; i < 10; i++) CPPUNIT_ASSERT_EQUAL((float) i, sketches[i].get_min_value());
+  }
+
+  void constructed_items() {
+    {
+      kll_sketch<counted_item> sketch;
+      CPPUNIT_ASSERT_EQUAL(2, counted_item::num_live); // min and max
+      for (int i = 0; i < 10000; i++) sketch.update(counted_item(i));
+      CPPUNIT_ASSERT_EQUAL((int) sketch.get_num_retained() + 2, counted_item::num_live);
+
+      kll_sketch<counted_item> other;
+      for (int i = 0; i < 10000; i++) other.update(counted_item(-i));
+      sketch.merge(other);
+      kll_sketch<counted_item> copy(sketch);
+      CPPUNIT_ASSERT_EQUAL((int) (sketch.get_num_retained() + copy.get_num_retained() + other.get_num_retained()) + 6,
+          counted_item::num_live);
+
+      std::vector<const kll_sketch<counted_item>*> others {&other, &copy};
+      sketch.merge(others.data(), others.size());
+      kll_sketch<counted_item> deamortized;
+      const int num_live(counted_item::num_live);
+      deamortized.set_deamortized(true); // nothing is constructed until it is staged
+      CPPUNIT_ASSERT_EQUAL(num_live, counted_item::num_live);
+      for (int i = 0; i < 10000; i++) deamortized.update(counted_item(i)); // may be in the middle of a compaction
+    }
+    CPPUNIT_ASSERT_EQUAL(0, counted_item::num_live);
+  }
+
+  void weighted_update() {
+    // exact while nothing is compacted, since each weight is a sum of powers of two
+    kll_sketch<int> sketch;
+    sketch.update(3, 0);
+    CPPUNIT_ASSERT(sketch.is_empty());
+    uint64_t total_weight(0);
+    for (int i = 10; i > 0; i--) {
+      sketch.update(i, i);
+      total_weight += i;
+    }
+    CPPUNIT_ASSERT_EQUAL(total_weight, sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(1, sketch.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(10, sketch.get_max_value());
+    uint64_t weight_below(0);
+    for (int i = 1; i <= 10; i++) {
+      CPPUNIT_ASSERT_EQUAL((double) weight_below / total_weight, sketch.get_rank(i));
+      weight_below += i;
+    }
+    CPPUNIT_ASSERT_EQUAL(1.0, sketch.get_rank(11));
+
+    // as if each value was updated weight times
+    kll_sketch<float> weighted;
+    kll_sketch<float> replayed;
+    std::mt19937_64 random(1);
+    const int num_values(10000);
+    std::vector<uint64_t> weights(num_values);
+    uint64_t n(0);
+    for (int i = 0; i < num_values; i++) {
+      const int value((i * 7919) % num_values);
+      weights[value] = 1 + random() % 100;
+      weighted.update(value, weights[value]);
+      for (uint64_t j = 0; j < weights[value]; j++) replayed.update(value);
+      n += weights[value];
+    }
+    CPPUNIT_ASSERT_EQUAL(n, weighted.get_n());
+    CPPUNIT_ASSERT_EQUAL(replayed.get_min_value(), weighted.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(replayed.get_max_value(), weighted.get_max_value());
+    weight_below = 0;
+    for (int value = 0; value < num_values; value++) {
+      if (value % 100 == 0) {
+        const double true_rank((double) weight_below / n);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(true_rank, weighted.get_rank(value), RANK_EPS_FOR_K_200);
+        CPPUNIT_ASSERT_DOUBLES_EQUAL(replayed.get_rank(value), weighted.get_rank(value), 2 * RANK_EPS_FOR_K_200);
+      }
+      weight_below += weights[value];
+    }
+
+    // a weight far beyond the levels of the sketch adds levels, and the result can be serialized and merged
+    kll_sketch<float> heavy;
+    for (int i = 0; i < 1000; i++) heavy.update(i);
+    heavy.update(2000, 1ULL << 40);
+    CPPUNIT_ASSERT_EQUAL(1000 + (1ULL << 40), heavy.get_n());
+    CPPUNIT_ASSERT_EQUAL(2000.0f, heavy.get_quantile(0.5));
+    CPPUNIT_ASSERT(heavy.get_rank(2000) < 1e-6);
+    auto data(heavy.serialize());
+    auto heavy_copy(kll_sketch<float>::deserialize(data.first.get(), data.second));
+    CPPUNIT_ASSERT_EQUAL(heavy.get_n(), heavy_copy->get_n());
+    CPPUNIT_ASSERT_EQUAL(heavy.get_rank(500), heavy_copy->get_rank(500));
+    weighted.merge(heavy);
+    CPPUNIT_ASSERT_EQUAL(n + heavy.get_n(), weighted.get_n());
+    CPPUNIT_ASSERT_EQUAL(2000.0f, weighted.get_quantile(0.5));
+
+    // the deamortized mode finishes its work first
+    kll_sketch<std::string> strings;
+    strings.set_deamortized(true);
+    for (int i = 0; i < 1000; i++) strings.update(std::to_string(i % 10), 1 + i % 5);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 3000, strings.get_n());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(0.5, strings.get_rank("5"), RANK_EPS_FOR_K_200);
+  }
+
+  // the compressed form must give back exactly the same sketch, so it serializes to the same bytes
+  template <typename T>
+  static void check_compressed(const kll_sketch<T>& sketch) {
+    auto data(sketch.serialize());
+    auto compressed(sketch.serialize_compressed());
+    auto copy(kll_sketch<T>::deserialize(compressed.first.get(), compressed.second));
+    auto copy_data(copy->serialize());
+    CPPUNIT_ASSERT_EQUAL(data.second, copy_data.second);
+    CPPUNIT_ASSERT(memcmp(data.first.get(), copy_data.first.get(), data.second) == 0);
+    if (sketch.get_n() > 1) CPPUNIT_ASSERT(compressed.second < data.second);
+
+    std::stringstream s(std::ios::in | std::ios::out | std::ios::binary);
+    sketch.serialize_compressed(s);
+    CPPUNIT_ASSERT_EQUAL(static_cast<std::streampos>(compressed.second), s.tellp());
+    auto stream_copy(kll_sketch<T>::deserialize(s));
+    CPPUNIT_ASSERT_EQUAL(s.tellp(), s.tellg());
+    auto stream_copy_data(stream_copy->serialize());
+    CPPUNIT_ASSERT(memcmp(data.first.get(), stream_copy_data.first.get(), data.second) == 0);
+  }
+
+  void serialize_deserialize_compressed() {
+    check_compressed(kll_sketch<int>());
+    kll_sketch<int> one_item;
+    one_item.update(1);
+    check_compressed(one_item);
+
+    std::mt19937_64 gen(1);
+    std::lognormal_distribution<double> latency(5, 1); // in microseconds
+    kll_sketch<double> sketch1;
+    kll_sketch<float> sketch2;
+    kll_sketch<int32_t> sketch3;
+    kll_sketch<int64_t> sketch4;
+    for (int i = 0; i < 100000; i++) {
+      const double value(std::round(latency(gen)));
+      sketch1.update(value);
+      sketch2.update(-value / 3);
+      sketch3.update(static_cast<int32_t>(gen()));
+      sketch4.update(static_cast<int64_t>(gen())); // 64-bit differences
+      if (i == 150) check_compressed(sketch1); // level zero only
+    }
+    check_compressed(sketch1);
+    // whole numbers leave the low bits of the differences of the keys zero
+    CPPUNIT_ASSERT(sketch1.serialize_compressed().second < 2 * sketch1.get_num_retained());
+    check_compressed(sketch2);
+    check_compressed(sketch3);
+    check_compressed(sketch4);
+    sketch1.update(std::numeric_limits<double>::infinity());
+    sketch1.update(-0.0);
+    sketch1.merge(kll_sketch<double>(sketch1));
+    check_compressed(sketch1);
+
+    // a compressed sketch cannot be read in place, and corruption is detected
+    auto data(sketch1.serialize_compressed());
+    CPPUNIT_ASSERT_THROW(kll_sketch_view<double>(data.first.get(), data.second), std::invalid_argument);
+    CPPUNIT_ASSERT_THROW(kll_sketch<double>::deserialize(data.first.get(), data.second - 1), std::invalid_argument);
+    // an impossible compressed size is rejected before it is allocated, and so are invalid levels
+    std::string image(static_cast<const char*>(data.first.get()), data.second);
+    const uint8_t num_levels(image[18]);
+    const size_t compressed_size_offset(20 + num_levels * sizeof(uint32_t) + 2 * sizeof(double));
+    const uint32_t huge_size(std::numeric_limits<uint32_t>::max());
+    memcpy(&image[compressed_size_offset], &huge_size, sizeof(huge_size));
+    std::stringstream huge(image, std::ios::in | std::ios::binary);
+    CPPUNIT_ASSERT_THROW(kll_sketch<double>::deserialize(huge), std::invalid_argument);
+    image.assign(static_cast<const char*>(data.first.get()), data.second);
+    const uint32_t past_level_one(std::numeric_limits<uint32_t>::max());
+    memcpy(&image[20], &past_level_one, sizeof(past_level_one));
+    CPPUNIT_ASSERT_THROW(kll_sketch<double>::deserialize(image.data(), image.size()), std::invalid_argument);
+    std::stringstream invalid_levels(image, std::ios::in | std::ios::binary);
+    CPPUNIT_ASSERT_THROW(kll_sketch<double>::deserialize(invalid_levels), std::invalid_argument);
+    char* bytes(static_cast<char*>(data.first.get()));
+    bytes[1] = 1; // serial version
+    CPPUNIT_ASSERT_THROW(kll_sketch<double>::deserialize(data.first.get(), data.second), std::invalid_argument);
+  }
+
+  void serialize_into_buffer() {
+    // several sketches one after another in one buffer
+    std::vector<kll_sketch<float>> sketches(4);
+    sketches[1].update(1);
+    for (int i = 0; i < 1000; i++) sketches[2].update(i);
+    for (int i = 0; i < 100000; i++) sketches[3].update(i);
+    size_t size(0);
+    for (const auto& sketch: sketches) size += sketch.get_serialized_size_bytes();
+    std::vector<char> buffer(size);
+    size_t offset(0);
+    for (const auto& sketch: sketches) offset += sketch.serialize_into(buffer.data() + offset, buffer.size() - offset);
+    CPPUNIT_ASSERT_EQUAL(size, offset);
+
+    offset = 0;
+    for (const auto& sketch: sketches) {
+      auto data(sketch.serialize());
+      CPPUNIT_ASSERT(memcmp(data.first.get(), buffer.data() + offset, data.second) == 0);
+      auto copy(kll_sketch<float>::deserialize(buffer.data() + offset, data.second));
+      CPPUNIT_ASSERT_EQUAL(sketch.get_n(), copy->get_n());
+      offset += data.second;
+    }
+
+    CPPUNIT_ASSERT_THROW(sketches[3].serialize_into(buffer.data(), sketches[3].get_serialized_size_bytes() - 1), std::invalid_argument);
+  }
+
+  struct io_vec {
+    void* iov_base;
+    size_t iov_len;
+  };
+
+  void serialize_into_pieces() {
+    for (int n: {0, 1, 1000, 100000}) {
+      kll_sketch<double> sketch;
+      for (int i = 0; i < n; i++) sketch.update(i);
+      char header[1024];
+      io_vec iov[2];
+      const unsigned num_pieces(sketch.serialize_into(header, sizeof(header), iov));
+      CPPUNIT_ASSERT_EQUAL(n == 0 ? 1u : 2u, num_pieces);
+      CPPUNIT_ASSERT(iov[0].iov_base == header);
+      std::vector<char> bytes;
+      for (unsigned i = 0; i < num_pieces; i++) {
+        bytes.insert(bytes.end(), static_cast<char*>(iov[i].iov_base), static_cast<char*>(iov[i].iov_base) + iov[i].iov_len);
+      }
+      // the same size as serialize(), but level 0 is left as it is instead of sorted
+      CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(sketch.get_serialized_size_bytes()), bytes.size());
+      auto sketch_ptr(kll_sketch<double>::deserialize(bytes.data(), bytes.size()));
+      CPPUNIT_ASSERT_EQUAL(sketch.get_n(), sketch_ptr->get_n());
+      CPPUNIT_ASSERT_EQUAL(sketch.get_num_retained(), sketch_ptr->get_num_retained());
+      if (n > 0) {
+        for (int i = 0; i <= 10; i++) {
+          CPPUNIT_ASSERT_EQUAL(sketch.get_quantile(i / 10.0), sketch_ptr->get_quantile(i / 10.0));
+        }
+      }
+      CPPUNIT_ASSERT_THROW(sketch.serialize_into(header, iov[0].iov_len - 1, iov), std::invalid_argument);
+    }
+  }
+
 };
 
 CPPUNIT_TEST_SUITE_REGISTRATION(kll_sketch_test);
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+#include "kll_sketch_view.hpp"
+
+namespace datasketches {
+
+class kll_sketch_view_test: public CppUnit::TestFixture {
+
+  CPPUNIT_TEST_SUITE(kll_sketch_view_test);
+  CPPUNIT_TEST(empty);
+  CPPUNIT_TEST(one_item);
+  CPPUNIT_TEST(exact_mode);
+  CPPUNIT_TEST(estimation_mode);
+  CPPUNIT_TEST(level_zero_unsorted);
+  CPPUNIT_TEST(unaligned_and_concatenated);
+  CPPUNIT_TEST(invalid_bytes);
+  CPPUNIT_TEST_SUITE_END();
+
+  // compares the answers of the view with the answers of the deserialized sketch
+  template <typename T>
+  static void check_same_answers(const void* bytes, size_t size) {
+    kll_sketch_view<T> view(bytes, size);
+    auto sketch_ptr(kll_sketch<T>::deserialize(bytes, size));
+    const kll_sketch<T>& sketch(*sketch_ptr);
+    CPPUNIT_ASSERT_EQUAL(sketch.is_empty(), view.is_empty());
+    CPPUNIT_ASSERT_EQUAL(sketch.is_estimation_mode(), view.is_estimation_mode());
+    CPPUNIT_ASSERT_EQUAL(sketch.get_n(), view.get_n());
+    CPPUNIT_ASSERT_EQUAL(sketch.get_num_retained(), view.get_num_retained());
+    CPPUNIT_ASSERT_EQUAL(sketch.get_min_value(), view.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(sketch.get_max_value(), view.get_max_value());
+    CPPUNIT_ASSERT_EQUAL(sketch.get_normalized_rank_error(false), view.get_normalized_rank_error(false));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(sketch.get_serialized_size_bytes()), view.get_serialized_size_bytes());
+
+    for (int i = 0; i <= 1000; i++) {
+      const double fraction(i / 1000.0);
+      CPPUNIT_ASSERT_EQUAL(sketch.get_quantile(fraction), view.get_quantile(fraction));
+    }
+
+    const T min_value(sketch.get_min_value());
+    const T max_value(sketch.get_max_value());
+    std::vector<T> split_points;
+    for (int i = -1; i <= 101; i++) {
+      const T value(min_value + (max_value - min_value) * i / 100);
+      CPPUNIT_ASSERT_EQUAL(sketch.get_rank(value), view.get_rank(value));
+      if (i >= 0 and i < 100 and (split_points.empty() or split_points.back() < value)) split_points.push_back(value);
+    }
+    const uint32_t num_split_points(split_points.size());
+    std::vector<double> result(num_split_points + 1);
+    auto pmf(sketch.get_PMF(split_points.data(), num_split_points));
+    view.get_PMF(split_points.data(), num_split_points, result.data());
+    for (uint32_t i = 0; i <= num_split_points; i++) CPPUNIT_ASSERT_EQUAL(pmf[i], result[i]);
+    auto cdf(sketch.get_CDF(split_points.data(), num_split_points));
+    view.get_CDF(split_points.data(), num_split_points, result.data());
+    for (uint32_t i = 0; i <= num_split_points; i++) CPPUNIT_ASSERT_EQUAL(cdf[i], result[i]);
+  }
+
+  void empty() {
+    kll_sketch<float> sketch;
+    auto data(sketch.serialize());
+    kll_sketch_view<float> view(data.first.get(), data.second);
+    CPPUNIT_ASSERT(view.is_empty());
+    CPPUNIT_ASSERT(!view.is_estimation_mode());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 0, view.get_n());
+    CPPUNIT_ASSERT_EQUAL(0u, view.get_num_retained());
+    CPPUNIT_ASSERT(std::isnan(view.get_rank(0)));
+    CPPUNIT_ASSERT(std::isnan(view.get_min_value()));
+    CPPUNIT_ASSERT(std::isnan(view.get_max_value()));
+    CPPUNIT_ASSERT(std::isnan(view.get_quantile(0.5)));
+    const float split_points[1] {0};
+    double result[2];
+    view.get_CDF(split_points, 1, result);
+    CPPUNIT_ASSERT(std::isnan(result[0]));
+    CPPUNIT_ASSERT(std::isnan(result[1]));
+
+    kll_sketch<int> int_sketch;
+    auto int_data(int_sketch.serialize());
+    kll_sketch_view<int> int_view(int_data.first.get(), int_data.second);
+    CPPUNIT_ASSERT_THROW(int_view.get_quantile(0.5), std::runtime_error);
+  }
+
+  void one_item() {
+    kll_sketch<float> sketch;
+    sketch.update(1);
+    auto data(sketch.serialize());
+    kll_sketch_view<float> view(data.first.get(), data.second);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1, view.get_n());
+    CPPUNIT_ASSERT_EQUAL(1u, view.get_num_retained());
+    CPPUNIT_ASSERT_EQUAL(1.0f, view.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(1.0f, view.get_quantile(0.5));
+    CPPUNIT_ASSERT_EQUAL(0.0, view.get_rank(1));
+    CPPUNIT_ASSERT_EQUAL(1.0, view.get_rank(2));
+  }
+
+  void exact_mode() {
+    kll_sketch<int> sketch;
+    for (int i = 0; i < 100; i++) sketch.update((i * 37) % 100);
+    auto data(sketch.serialize());
+    check_same_answers<int>(data.first.get(), data.second);
+  }
+
+  void estimation_mode() {
+    for (uint16_t k: {8, 200}) {
+      kll_sketch<float> sketch(k);
+      const int n(100000);
+      for (int i = 0; i < n; i++) sketch.update((float) (((uint64_t) i * 7919) % n));
+      auto data(sketch.serialize());
+      check_same_answers<float>(data.first.get(), data.second);
+    }
+    kll_sketch<double> sketch;
+    for (int i = 0; i < 10000; i++) sketch.update(i % 100); // many equal items
+    auto data(sketch.serialize());
+    check_same_answers<double>(data.first.get(), data.second);
+  }
+
+  void level_zero_unsorted() {
+    kll_sketch<float> sketch;
+    for (int i = 0; i < 1000; i++) sketch.update((float) ((i * 7) % 1000));
+    auto data(sketch.serialize());
+    char* bytes(static_cast<char*>(data.first.get()));
+    CPPUNIT_ASSERT(bytes[3] & 2); // the sketch sorts level 0 when it serializes
+
+    // shuffle level 0 in place and clear the flag, as other writers may serialize it
+    const uint8_t num_levels(bytes[18]);
+    uint32_t level_zero_begin, level_zero_end;
+    memcpy(&level_zero_begin, bytes + 20, sizeof(uint32_t));
+    memcpy(&level_zero_end, bytes + 24, sizeof(uint32_t));
+    CPPUNIT_ASSERT(num_levels > 1);
+    const size_t items_start(20 + num_levels * sizeof(uint32_t) + 2 * sizeof(float));
+    std::vector<float> level_zero(level_zero_end - level_zero_begin);
+    CPPUNIT_ASSERT(level_zero.size() > 1);
+    memcpy(level_zero.data(), bytes + items_start, level_zero.size() * sizeof(float));
+    CPPUNIT_ASSERT(std::is_sorted(level_zero.begin(), level_zero.end()));
+    std::reverse(level_zero.begin(), level_zero.end());
+    std::rotate(level_zero.begin(), level_zero.begin() + level_zero.size() / 3, level_zero.end());
+    memcpy(bytes + items_start, level_zero.data(), level_zero.size() * sizeof(float));
+    bytes[3] &= ~2;
+
+    check_same_answers<float>(data.first.get(), data.second);
+  }
+
+  void unaligned_and_concatenated() {
+    kll_sketch<double> sketch1;
+    for (int i = 0; i < 1000; i++) sketch1.update(i);
+    kll_sketch<double> sketch2;
+    sketch2.update(1);
+    kll_sketch<double> sketch3;
+    auto data1(sketch1.serialize());
+    auto data2(sketch2.serialize());
+    auto data3(sketch3.serialize());
+
+    std::vector<char> buffer(1 + data1.second + data2.second + data3.second);
+    size_t offset(1); // to make the items unaligned
+    memcpy(buffer.data() + offset, data1.first.get(), data1.second);
+    memcpy(buffer.data() + offset + data1.second, data2.first.get(), data2.second);
+    memcpy(buffer.data() + offset + data1.second + data2.second, data3.first.get(), data3.second);
+
+    std::vector<uint64_t> n;
+    while (offset < buffer.size()) {
+      kll_sketch_view<double> view(buffer.data() + offset, buffer.size() - offset);
+      n.push_back(view.get_n());
+      offset += view.get_serialized_size_bytes();
+    }
+    CPPUNIT_ASSERT_EQUAL(buffer.size(), offset);
+    CPPUNIT_ASSERT_EQUAL((size_t) 3, n.size());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1000, n[0]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 1, n[1]);
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 0, n[2]);
+    check_same_answers<double>(buffer.data() + 1, data1.second);
+  }
+
+  void invalid_bytes() {
+    kll_sketch<float> sketch;
+    for (int i = 0; i < 1000; i++) sketch.update(i);
+    auto data(sketch.serialize());
+    CPPUNIT_ASSERT_THROW(kll_sketch_view<float>(data.first.get(), 7), std::invalid_argument);
+    CPPUNIT_ASSERT_THROW(kll_sketch_view<float>(data.first.get(), data.second - 1), std::invalid_argument);
+    char* bytes(static_cast<char*>(data.first.get()));
+    bytes[2] = 0; // family
+    CPPUNIT_ASSERT_THROW(kll_sketch_view<float>(data.first.get(), data.second), std::invalid_argument);
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(kll_sketch_view_test);
+
+} /* namespace datasketches */
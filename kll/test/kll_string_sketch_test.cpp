@@ -0,0 +1,144 @@
+/*
+ * Copyright 2018, Oath Inc. Licensed under the terms of the
+ * Apache License 2.0. See LICENSE file at the project root for terms.
+ */
+
+#include <cppunit/TestFixture.h>
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <sstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "kll_string_sketch.hpp"
+
+namespace datasketches {
+
+class kll_string_sketch_test: public CppUnit::TestFixture {
+
+  CPPUNIT_TEST_SUITE(kll_string_sketch_test);
+  CPPUNIT_TEST(compare_refs);
+  CPPUNIT_TEST(empty);
+  CPPUNIT_TEST(same_as_sketch_of_strings);
+  CPPUNIT_TEST(long_and_empty_strings);
+  CPPUNIT_TEST(copy_and_merge);
+  CPPUNIT_TEST(serialize_deserialize);
+  CPPUNIT_TEST_SUITE_END();
+
+  static std::string make_string(int i) {
+    // a common prefix of 9 bytes to get past the prefix comparison
+    return "/some/url" + std::to_string((i * 7919) % 100000);
+  }
+
+  void compare_refs() {
+    const std::vector<std::string> values {
+      "", std::string(1, '\0'), std::string(2, '\0'), "a", std::string("a\0", 2), "ab", "abcdefgh",
+      std::string("abcdefgh\0", 9), "abcdefghi", "abcdefgz", "\xff", "\x7f" "abcdefghijk", "\x80" "abcdefghijk"
+    };
+    for (const std::string& a: values) {
+      for (const std::string& b: values) {
+        const kll_string_ref ref_a(a.data(), a.size());
+        const kll_string_ref ref_b(b.data(), b.size());
+        CPPUNIT_ASSERT_EQUAL(a < b, ref_a < ref_b);
+      }
+    }
+  }
+
+  void empty() {
+    kll_string_sketch sketch;
+    CPPUNIT_ASSERT(sketch.is_empty());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 0, sketch.get_n());
+    CPPUNIT_ASSERT_THROW(sketch.get_min_value(), std::runtime_error);
+    CPPUNIT_ASSERT_THROW(sketch.get_quantile(0.5), std::runtime_error);
+    const std::string split_points[1] {"a"};
+    CPPUNIT_ASSERT(!sketch.get_PMF(split_points, 1));
+  }
+
+  void same_as_sketch_of_strings() {
+    // the same order and the same random choices give the same items
+    kll_sketch<std::string> sketch(200, 1);
+    kll_string_sketch string_sketch(200, 1);
+    const int n(200000); // enough to reclaim the arena a few times
+    for (int i = 0; i < n; i++) {
+      const std::string value(make_string(i));
+      sketch.update(value);
+      string_sketch.update(value);
+    }
+    CPPUNIT_ASSERT_EQUAL(sketch.get_n(), string_sketch.get_n());
+    CPPUNIT_ASSERT_EQUAL(sketch.get_num_retained(), string_sketch.get_num_retained());
+    CPPUNIT_ASSERT_EQUAL(sketch.get_min_value(), string_sketch.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(sketch.get_max_value(), string_sketch.get_max_value());
+    CPPUNIT_ASSERT_EQUAL(0.0, sketch.get_rank(sketch.get_min_value())); // no item lost in a compaction
+    std::vector<std::string> split_points;
+    for (int i = 0; i <= 100; i++) {
+      split_points.push_back(sketch.get_quantile(i / 100.0));
+      CPPUNIT_ASSERT_EQUAL(split_points.back(), string_sketch.get_quantile(i / 100.0));
+      CPPUNIT_ASSERT_EQUAL(sketch.get_rank(split_points.back()), string_sketch.get_rank(split_points.back()));
+    }
+    split_points.erase(std::unique(split_points.begin(), split_points.end()), split_points.end());
+    auto cdf(sketch.get_CDF(split_points.data(), split_points.size()));
+    auto string_cdf(string_sketch.get_CDF(split_points.data(), split_points.size()));
+    for (size_t i = 0; i <= split_points.size(); i++) CPPUNIT_ASSERT_EQUAL(cdf[i], string_cdf[i]);
+  }
+
+  void long_and_empty_strings() {
+    kll_string_sketch sketch;
+    const std::string long_string(100000, 'x');
+    sketch.update("");
+    CPPUNIT_ASSERT_EQUAL(std::string(), sketch.get_min_value());
+    for (int i = 0; i < 1000; i++) sketch.update(long_string + std::to_string(i));
+    CPPUNIT_ASSERT_EQUAL(std::string(), sketch.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(long_string + "999", sketch.get_max_value());
+    CPPUNIT_ASSERT_EQUAL(long_string, sketch.get_quantile(0.5).substr(0, long_string.size()));
+  }
+
+  void copy_and_merge() {
+    kll_string_sketch sketch1(200, 1);
+    const int n(10000);
+    for (int i = 0; i < n; i++) sketch1.update(std::to_string(i));
+    kll_string_sketch sketch2(sketch1);
+    {
+      kll_string_sketch sketch3;
+      for (int i = 0; i < n; i++) sketch3.update(std::to_string(n + i));
+      sketch2.merge(sketch3);
+    } // the strings of sketch3 are gone
+    CPPUNIT_ASSERT_EQUAL((uint64_t) n, sketch1.get_n());
+    CPPUNIT_ASSERT_EQUAL((uint64_t) 2 * n, sketch2.get_n());
+    CPPUNIT_ASSERT_EQUAL(std::string("0"), sketch2.get_min_value());
+    CPPUNIT_ASSERT_EQUAL(std::string("9999"), sketch2.get_max_value());
+    CPPUNIT_ASSERT_EQUAL(0.0, sketch2.get_rank("0"));
+    CPPUNIT_ASSERT_EQUAL(1.0, sketch2.get_rank("99999"));
+    sketch1 = sketch2;
+    CPPUNIT_ASSERT_EQUAL(sketch2.get_quantile(0.5), sketch1.get_quantile(0.5));
+  }
+
+  void serialize_deserialize() {
+    for (int n: {0, 1, 10, 100000}) {
+      kll_string_sketch sketch;
+      for (int i = 0; i < n; i++) sketch.update(make_string(i));
+      std::stringstream s(std::ios::in | std::ios::out | std::ios::binary);
+      sketch.serialize(s);
+      CPPUNIT_ASSERT_EQUAL(static_cast<std::streampos>(sketch.get_serialized_size_bytes()), s.tellp());
+      auto sketch_ptr(kll_string_sketch::deserialize(s));
+      CPPUNIT_ASSERT_EQUAL(s.tellp(), s.tellg());
+      CPPUNIT_ASSERT_EQUAL(sketch.get_n(), sketch_ptr->get_n());
+      CPPUNIT_ASSERT_EQUAL(sketch.get_num_retained(), sketch_ptr->get_num_retained());
+      if (n == 0) continue;
+      CPPUNIT_ASSERT_EQUAL(sketch.get_min_value(), sketch_ptr->get_min_value());
+      CPPUNIT_ASSERT_EQUAL(sketch.get_max_value(), sketch_ptr->get_max_value());
+      for (int i = 0; i <= 100; i++) {
+        CPPUNIT_ASSERT_EQUAL(sketch.get_quantile(i / 100.0), sketch_ptr->get_quantile(i / 100.0));
+      }
+      // the deserialized sketch keeps going
+      for (int i = 0; i < n; i++) sketch_ptr->update(make_string(i));
+      CPPUNIT_ASSERT_EQUAL((uint64_t) 2 * n, sketch_ptr->get_n());
+      CPPUNIT_ASSERT_EQUAL(sketch.get_min_value(), sketch_ptr->get_min_value());
+    }
+  }
+
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(kll_string_sketch_test);
+
+} /* namespace datasketches */
@@ -74,7 +74,7 @@ void export_cpc()
   bpy::class_<cpc_union, boost::noncopyable>("CpcUnion", bpy::init<const cpc_union&>())
     .def(bpy::init<uint8_t>())
     .def(bpy::init<uint8_t, uint64_t>())
-    .def("update", &cpc_union::update)
+    .def<void (cpc_union::*)(const cpc_sketch&)>("update", &cpc_union::update)
     .def("getResult", &dspy::CpcUnion_getResult, bpy::return_value_policy<bpy::manage_new_object>())
     ;
 }
\ No newline at end of file